@@ -4,11 +4,16 @@
 #include "FormulaLexer.h"
 #include "FormulaParser.h"
 
+#include <algorithm>
 #include <cassert>
+#include <charconv>
 #include <cmath>
+#include <cstring>
 #include <memory>
+#include <iterator>
 #include <optional>
 #include <sstream>
+#include <string_view>
 
 namespace ASTImpl {
 
@@ -67,17 +72,31 @@ namespace ASTImpl {
         /* EP_ATOM */ {PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE, PR_NONE},
     };
 
+    // Способ печати узлов. Ссылки в дереве хранятся смещениями от якоря и печатаются либо абсолютными
+    // адресами относительно якоря, либо самими смещениями в виде R[строка]C[столбец].
+    // Точная печать чисел (кратчайшая запись без потери точности) используется для ключей интернирования
+    struct PrintContext {
+        Position anchor = Position(0, 0);
+        bool relative = false;
+        bool exact_numbers = false;
+    };
+
     class Expr {
     public:
         virtual ~Expr() = default;
-        virtual void Print(std::ostream& out) const = 0;
-        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const = 0;
-        virtual double Evaluate(const CellFinder& finder) const = 0;
+        virtual void Print(std::ostream& out, const PrintContext& context) const = 0;
+        virtual void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, const PrintContext& context) const = 0;
+        // добавляет в программу команды вычисления узла в постфиксном порядке
+        virtual void Compile(FormulaProgram& program) const = 0;
+        // дописывает узлы поддерева в постфиксном порядке
+        virtual void Save(std::vector<FormulaNode>& nodes) const = 0;
+        // добавляет к хешу узлы поддерева в постфиксном порядке, ссылки - адресами для якоря
+        virtual std::uint64_t Hash(std::uint64_t seed, Position anchor) const = 0;
 
         // higher is tighter
         virtual ExprPrecedence GetPrecedence() const = 0;
 
-        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence,
+        void PrintFormula(std::ostream& out, ExprPrecedence parent_precedence, const PrintContext& context,
                           bool right_child = false) const {
             auto precedence = GetPrecedence();
             auto mask = right_child ? PR_RIGHT : PR_LEFT;
@@ -86,7 +105,7 @@ namespace ASTImpl {
                 out << '(';
             }
 
-            DoPrintFormula(out, precedence);
+            DoPrintFormula(out, precedence, context);
 
             if (parens_needed) {
                 out << ')';
@@ -112,18 +131,18 @@ namespace ASTImpl {
                 , rhs_(std::move(rhs)) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, const PrintContext& context) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                lhs_->Print(out);
+                lhs_->Print(out, context);
                 out << ' ';
-                rhs_->Print(out);
+                rhs_->Print(out, context);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
-                lhs_->PrintFormula(out, precedence);
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, const PrintContext& context) const override {
+                lhs_->PrintFormula(out, precedence, context);
                 out << static_cast<char>(type_);
-                rhs_->PrintFormula(out, precedence, /* right_child = */ true);
+                rhs_->PrintFormula(out, precedence, context, /* right_child = */ true);
             }
 
             ExprPrecedence GetPrecedence() const override {
@@ -143,43 +162,58 @@ namespace ASTImpl {
                 }
             }
 
-        // Реализуйте метод Evaluate() для бинарных операций.
-        // При делении на 0 выбрасывайте ошибку вычисления FormulaError
-            double Evaluate(const CellFinder& finder) const override {
-
-                // получаем значения операндов
-                double lhs = lhs_->Evaluate(finder);
-                double rhs = rhs_->Evaluate(finder);
-
-                double result = 0.0;
+            void Compile(FormulaProgram& program) const override {
+                // сначала операнды, затем сама операция
+                lhs_->Compile(program);
+                rhs_->Compile(program);
 
                 switch (type_) {
                 case Add:
-                    result = lhs + rhs;
+                    program.Emit(FormulaProgram::OpCode::Add);
                     break;
                 case Subtract:
-                    result = lhs - rhs;
+                    program.Emit(FormulaProgram::OpCode::Subtract);
                     break;
                 case Multiply:
-                    result = lhs * rhs;
+                    program.Emit(FormulaProgram::OpCode::Multiply);
                     break;
                 case Divide:
-                    result = rhs ? (lhs / rhs) : throw FormulaError(FormulaError::Category::Div0);
+                    program.Emit(FormulaProgram::OpCode::Divide);
                     break;
                 }
+            }
 
-                // если ответ "не число" или бесконечность, то возвращем DivO
-                if (std::isinf(result) || std::isnan(result)) {
-                    throw FormulaError(FormulaError::Category::Div0);
-                }
+            void Save(std::vector<FormulaNode>& nodes) const override {
+                lhs_->Save(nodes);
+                rhs_->Save(nodes);
+
+                FormulaNode node;
+                node.kind = GetKind();
+                nodes.push_back(node);
+            }
 
-                return result;
+            std::uint64_t Hash(std::uint64_t seed, Position anchor) const override {
+                seed = rhs_->Hash(lhs_->Hash(seed, anchor), anchor);
+                return CombineHash(seed, static_cast<std::uint64_t>(GetKind()));
             }
 
         private:
             Type type_;
             std::unique_ptr<Expr> lhs_;
             std::unique_ptr<Expr> rhs_;
+
+            FormulaNode::Kind GetKind() const {
+                switch (type_) {
+                case Add:
+                    return FormulaNode::Kind::Add;
+                case Subtract:
+                    return FormulaNode::Kind::Subtract;
+                case Multiply:
+                    return FormulaNode::Kind::Multiply;
+                default:
+                    return FormulaNode::Kind::Divide;
+                }
+            }
         };
 
         class UnaryOpExpr final : public Expr {
@@ -195,31 +229,41 @@ namespace ASTImpl {
                 , operand_(std::move(operand)) {
             }
 
-            void Print(std::ostream& out) const override {
+            void Print(std::ostream& out, const PrintContext& context) const override {
                 out << '(' << static_cast<char>(type_) << ' ';
-                operand_->Print(out);
+                operand_->Print(out, context);
                 out << ')';
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence) const override {
+            void DoPrintFormula(std::ostream& out, ExprPrecedence precedence, const PrintContext& context) const override {
                 out << static_cast<char>(type_);
-                operand_->PrintFormula(out, precedence);
+                operand_->PrintFormula(out, precedence, context);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_UNARY;
             }
 
-            double Evaluate(const CellFinder& finder) const override {
-                // работаем в зависимости от операнда
-                if (type_ == UnaryPlus) {
-                    return operand_->Evaluate(finder);
-                }
-                else {
-                    double pre_res = operand_->Evaluate(finder);
-                    return (pre_res * (-1));
+            void Compile(FormulaProgram& program) const override {
+                operand_->Compile(program);
+
+                // унарный плюс значение не меняет и команд не порождает
+                if (type_ == UnaryMinus) {
+                    program.Emit(FormulaProgram::OpCode::Negate);
                 }
-        
+            }
+
+            void Save(std::vector<FormulaNode>& nodes) const override {
+                operand_->Save(nodes);
+
+                FormulaNode node;
+                node.kind = type_ == UnaryMinus ? FormulaNode::Kind::UnaryMinus : FormulaNode::Kind::UnaryPlus;
+                nodes.push_back(node);
+            }
+
+            std::uint64_t Hash(std::uint64_t seed, Position anchor) const override {
+                const auto kind = type_ == UnaryMinus ? FormulaNode::Kind::UnaryMinus : FormulaNode::Kind::UnaryPlus;
+                return CombineHash(operand_->Hash(seed, anchor), static_cast<std::uint64_t>(kind));
             }
 
         private:
@@ -227,29 +271,53 @@ namespace ASTImpl {
             std::unique_ptr<Expr> operand_;
         };
 
+        // Ссылка на ячейку. Хранит смещение от якоря формулы, адрес вычисляется для конкретного якоря
         class CellExpr final : public Expr {
         public:
             explicit CellExpr(const Position* cell) : cell_(cell) {}
 
-            void Print(std::ostream& out) const override {
-                if (!cell_->IsValid()) {
+            void Print(std::ostream& out, const PrintContext& context) const override {
+                if (context.relative) {
+                    out << "R[" << cell_->row << "]C[" << cell_->col << ']';
+                    return;
+                }
+
+                Position pos(context.anchor.row + cell_->row, context.anchor.col + cell_->col);
+                if (!pos.IsValid()) {
                     out << FormulaError::Category::Ref;
                 }
                 else {
-                    out << cell_->ToString();
+                    out << pos.ToString();
                 }
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                Print(out);
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, const PrintContext& context) const override {
+                Print(out, context);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
-            double Evaluate(const CellFinder& finder) const {
-                return finder(*cell_);
+            void Compile(FormulaProgram& program) const override {
+                program.LoadCell(*cell_);
+            }
+
+            void Save(std::vector<FormulaNode>& nodes) const override {
+                FormulaNode node;
+                node.kind = FormulaNode::Kind::Cell;
+                node.cell = *cell_;
+                nodes.push_back(node);
+            }
+
+            std::uint64_t Hash(std::uint64_t seed, Position anchor) const override {
+                // адреса за пределами листа печатаются одинаково - #REF!, так же они и хешируются
+                Position pos(anchor.row + cell_->row, anchor.col + cell_->col);
+                if (!pos.IsValid()) {
+                    pos = Position::NONE;
+                }
+                seed = CombineHash(seed, static_cast<std::uint64_t>(FormulaNode::Kind::Cell));
+                return CombineHash(seed, PositionHasher()(pos));
             }
 
         private:
@@ -262,21 +330,43 @@ namespace ASTImpl {
                 : value_(value) {
             }
 
-            void Print(std::ostream& out) const override {
-                out << value_;
+            void Print(std::ostream& out, const PrintContext& context) const override {
+                if (context.exact_numbers) {
+                    // кратчайшая запись, однозначно восстанавливающая число
+                    std::array<char, 32> buffer;
+                    auto result = std::to_chars(buffer.data(), buffer.data() + buffer.size(), value_);
+                    out.write(buffer.data(), result.ptr - buffer.data());
+                }
+                else {
+                    out << value_;
+                }
             }
 
-            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */) const override {
-                out << value_;
+            void DoPrintFormula(std::ostream& out, ExprPrecedence /* precedence */, const PrintContext& context) const override {
+                Print(out, context);
             }
 
             ExprPrecedence GetPrecedence() const override {
                 return EP_ATOM;
             }
 
-        // Для чисел метод возвращает значение числа.
-            double Evaluate(const CellFinder& finder) const override {
-                return value_;
+            void Compile(FormulaProgram& program) const override {
+                program.PushNumber(value_);
+            }
+
+            void Save(std::vector<FormulaNode>& nodes) const override {
+                FormulaNode node;
+                node.kind = FormulaNode::Kind::Number;
+                node.number = value_;
+                nodes.push_back(node);
+            }
+
+            std::uint64_t Hash(std::uint64_t seed, Position /* anchor */) const override {
+                // число хешируется точно, как в ключах интернирования
+                std::uint64_t bits = 0;
+                std::memcpy(&bits, &value_, sizeof(bits));
+                seed = CombineHash(seed, static_cast<std::uint64_t>(FormulaNode::Kind::Number));
+                return CombineHash(seed, bits);
             }
 
         private:
@@ -387,10 +477,291 @@ namespace ASTImpl {
             }
         };
 
+        enum class TokenType {
+            Number,
+            Cell,
+            Add,
+            Sub,
+            Mul,
+            Div,
+            LeftParen,
+            RightParen,
+            End,
+        };
+
+        struct Token {
+            TokenType type = TokenType::End;
+            std::string_view text;
+        };
+
+        // Лексер грамматики Formula.g4: выделяет лексемы по одной, пробельные символы WS пропускаются
+        class Lexer {
+        public:
+            explicit Lexer(std::string_view text)
+                : text_(text) {
+                Next();
+            }
+
+            const Token& Current() const {
+                return token_;
+            }
+
+            void Next() {
+                while (pos_ < text_.size()
+                    && (text_[pos_] == ' ' || text_[pos_] == '\t' || text_[pos_] == '\n' || text_[pos_] == '\r')) {
+                    ++pos_;
+                }
+
+                const std::size_t begin = pos_;
+                if (pos_ == text_.size()) {
+                    token_ = { TokenType::End, {} };
+                    return;
+                }
+
+                TokenType type = TokenType::End;
+                const char c = text_[pos_];
+                switch (c) {
+                case '+':
+                    type = TokenType::Add;
+                    ++pos_;
+                    break;
+                case '-':
+                    type = TokenType::Sub;
+                    ++pos_;
+                    break;
+                case '*':
+                    type = TokenType::Mul;
+                    ++pos_;
+                    break;
+                case '/':
+                    type = TokenType::Div;
+                    ++pos_;
+                    break;
+                case '(':
+                    type = TokenType::LeftParen;
+                    ++pos_;
+                    break;
+                case ')':
+                    type = TokenType::RightParen;
+                    ++pos_;
+                    break;
+                default:
+                    if (IsDigit(c) || c == '.') {
+                        // NUMBER: UINT EXPONENT? | UINT? '.' UINT EXPONENT?
+                        type = TokenType::Number;
+                        SkipDigits();
+                        if (pos_ < text_.size() && text_[pos_] == '.') {
+                            if (!DigitAt(pos_ + 1)) {
+                                throw ParsingError("Error when lexing: invalid number");
+                            }
+                            ++pos_;
+                            SkipDigits();
+                        }
+                        // экспонента входит в число, только если она записана полностью
+                        if (pos_ < text_.size() && (text_[pos_] == 'e' || text_[pos_] == 'E')) {
+                            std::size_t digits = pos_ + 1;
+                            if (digits < text_.size() && (text_[digits] == '+' || text_[digits] == '-')) {
+                                ++digits;
+                            }
+                            if (DigitAt(digits)) {
+                                pos_ = digits;
+                                SkipDigits();
+                            }
+                        }
+                    }
+                    else if (IsUpper(c)) {
+                        // CELL: [A-Z]+[0-9]+
+                        type = TokenType::Cell;
+                        while (pos_ < text_.size() && IsUpper(text_[pos_])) {
+                            ++pos_;
+                        }
+                        if (!DigitAt(pos_)) {
+                            throw ParsingError("Error when lexing: invalid cell");
+                        }
+                        SkipDigits();
+                    }
+                    else {
+                        throw ParsingError("Error when lexing: unexpected symbol " + std::string(1, c));
+                    }
+                }
+
+                token_ = { type, text_.substr(begin, pos_ - begin) };
+            }
+
+        private:
+            std::string_view text_;
+            std::size_t pos_ = 0;
+            Token token_;
+
+            static bool IsDigit(char c) {
+                return c >= '0' && c <= '9';
+            }
+
+            static bool IsUpper(char c) {
+                return c >= 'A' && c <= 'Z';
+            }
+
+            bool DigitAt(std::size_t pos) const {
+                return pos < text_.size() && IsDigit(text_[pos]);
+            }
+
+            void SkipDigits() {
+                while (DigitAt(pos_)) {
+                    ++pos_;
+                }
+            }
+        };
+
+        // Разбор выражения по грамматике Formula.g4 рекурсивным спуском, без потоков, дерева разбора и слушателя.
+        // Приоритеты совпадают с разбором ANTLR: унарные операторы связывают сильнее бинарных,
+        // умножение и деление сильнее сложения и вычитания, бинарные операторы левоассоциативны.
+        // Строятся те же узлы ASTImpl, что и в ParseASTListener, но ссылки сохраняются смещениями от якоря
+        class DirectParser {
+        public:
+            DirectParser(std::string_view text, Position anchor)
+                : lexer_(text), anchor_(anchor) {
+            }
+
+            FormulaAST Parse() {
+                auto root = ParseAdditive();
+                if (lexer_.Current().type != TokenType::End) {
+                    throw ParsingError("Error when parsing: " + std::string(lexer_.Current().text));
+                }
+                return FormulaAST(std::move(root), std::move(cells_));
+            }
+
+        private:
+            Lexer lexer_;
+            Position anchor_;
+            std::forward_list<Position> cells_;
+
+            TokenType Current() const {
+                return lexer_.Current().type;
+            }
+
+            // expr (ADD | SUB) expr
+            std::unique_ptr<Expr> ParseAdditive() {
+                auto lhs = ParseMultiplicative();
+                while (Current() == TokenType::Add || Current() == TokenType::Sub) {
+                    auto type = Current() == TokenType::Add ? BinaryOpExpr::Add : BinaryOpExpr::Subtract;
+                    lexer_.Next();
+                    lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), ParseMultiplicative());
+                }
+                return lhs;
+            }
+
+            // expr (MUL | DIV) expr
+            std::unique_ptr<Expr> ParseMultiplicative() {
+                auto lhs = ParseUnary();
+                while (Current() == TokenType::Mul || Current() == TokenType::Div) {
+                    auto type = Current() == TokenType::Mul ? BinaryOpExpr::Multiply : BinaryOpExpr::Divide;
+                    lexer_.Next();
+                    lhs = std::make_unique<BinaryOpExpr>(type, std::move(lhs), ParseUnary());
+                }
+                return lhs;
+            }
+
+            // (ADD | SUB) expr
+            std::unique_ptr<Expr> ParseUnary() {
+                if (Current() == TokenType::Add || Current() == TokenType::Sub) {
+                    auto type = Current() == TokenType::Add ? UnaryOpExpr::UnaryPlus : UnaryOpExpr::UnaryMinus;
+                    lexer_.Next();
+                    return std::make_unique<UnaryOpExpr>(type, ParseUnary());
+                }
+                return ParsePrimary();
+            }
+
+            // '(' expr ')' | CELL | NUMBER
+            std::unique_ptr<Expr> ParsePrimary() {
+                const Token& token = lexer_.Current();
+                std::unique_ptr<Expr> node;
+                switch (token.type) {
+                case TokenType::LeftParen:
+                    lexer_.Next();
+                    node = ParseAdditive();
+                    if (Current() != TokenType::RightParen) {
+                        throw ParsingError("Error when parsing: expected )");
+                    }
+                    break;
+                case TokenType::Cell:
+                {
+                    auto value = Position::FromString(token.text);
+                    if (!value.IsValid()) {
+                        throw FormulaException("Invalid position: " + std::string(token.text));
+                    }
+                    // ссылка запоминается смещением от якоря
+                    cells_.push_front(Position(value.row - anchor_.row, value.col - anchor_.col));
+                    node = std::make_unique<CellExpr>(&cells_.front());
+                    break;
+                }
+                case TokenType::Number:
+                {
+                    // те же правила, что и у потокового ввода в exitLiteral: переполнение - ошибка
+                    auto value = ParseCellNumber(token.text);
+                    if (!value) {
+                        throw ParsingError("Invalid number: " + std::string(token.text));
+                    }
+                    node = std::make_unique<NumberExpr>(*value);
+                    break;
+                }
+                default:
+                    throw ParsingError("Error when parsing: " + std::string(token.text));
+                }
+                lexer_.Next();
+                return node;
+            }
+        };
+
     }  // namespace
 }  // namespace ASTImpl
 
-FormulaAST ParseFormulaAST(std::istream& in) {
+// ----------------------------------- class FormulaProgram --------------------------------------------
+
+// добавить загрузку числа
+void FormulaProgram::PushNumber(double value) {
+    code_.push_back({ OpCode::PushNumber, static_cast<std::uint32_t>(numbers_.size()) });
+    numbers_.push_back(value);
+    Track(1);
+}
+
+// добавить загрузку ячейки
+void FormulaProgram::LoadCell(Position offset) {
+    code_.push_back({ OpCode::LoadCell, static_cast<std::uint32_t>(cells_.size()) });
+    cells_.push_back(offset);
+    Track(1);
+}
+
+// добавить операцию над стеком
+void FormulaProgram::Emit(OpCode code) {
+    code_.push_back({ code });
+    // бинарная операция снимает два значения и кладёт одно, отрицание глубину не меняет
+    Track(code == OpCode::Negate ? 0 : -1);
+}
+
+// учёт глубины стека при компиляции
+void FormulaProgram::Track(int delta) {
+    depth_ += delta;
+    max_depth_ = std::max(max_depth_, depth_);
+}
+
+// команды программы
+const std::vector<FormulaProgram::Instruction>& FormulaProgram::GetCode() const {
+    return code_;
+}
+
+// есть ли среди значений бесконечность или nan
+bool FormulaProgram::HasNonFinite(const double* values, std::size_t count) {
+    for (std::size_t i = 0; i != count; ++i) {
+        if (!std::isfinite(values[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// ----------------------------------- class FormulaProgram END ----------------------------------------
+
+FormulaAST ParseFormulaASTReference(std::istream& in) {
     using namespace antlr4;
 
     ANTLRInputStream input(in);
@@ -414,17 +785,128 @@ FormulaAST ParseFormulaAST(std::istream& in) {
     return FormulaAST(listener.MoveRoot(), listener.MoveCells());
 }
 
-FormulaAST ParseFormulaAST(const std::string& in_str) {
+FormulaAST ParseFormulaASTReference(const std::string& in_str) {
     std::istringstream in(in_str);
-    return ParseFormulaAST(in);
+    return ParseFormulaASTReference(in);
 }
 
-void FormulaAST::Print(std::ostream& out) const {
-    root_expr_->Print(out);
+FormulaAST ParseFormulaAST(std::istream& in) {
+    std::string text(std::istreambuf_iterator<char>(in), {});
+    return ParseFormulaAST(text);
 }
 
-void FormulaAST::PrintFormula(std::ostream& out) const {
-    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM);
+FormulaAST ParseFormulaAST(const std::string& in_str, Position anchor) {
+    return ASTImpl::DirectParser(in_str, anchor).Parse();
+}
+
+// восстановление формулы из узлов в постфиксном порядке
+FormulaAST BuildFormulaAST(const std::vector<FormulaNode>& nodes) {
+    using namespace ASTImpl;
+
+    std::vector<std::unique_ptr<Expr>> args;
+    std::forward_list<Position> cells;
+
+    // операнды снимаются со стека в обратном порядке
+    auto pop = [&args]() {
+        if (args.empty()) {
+            throw ParsingError("Formula nodes: missing operand");
+        }
+        auto operand = std::move(args.back());
+        args.pop_back();
+        return operand;
+    };
+
+    auto binary = [&](BinaryOpExpr::Type type) {
+        auto rhs = pop();
+        auto lhs = pop();
+        args.push_back(std::make_unique<BinaryOpExpr>(type, std::move(lhs), std::move(rhs)));
+    };
+
+    for (const FormulaNode& node : nodes) {
+        switch (node.kind) {
+        case FormulaNode::Kind::Number:
+            args.push_back(std::make_unique<NumberExpr>(node.number));
+            break;
+        case FormulaNode::Kind::Cell:
+            cells.push_front(node.cell);
+            args.push_back(std::make_unique<CellExpr>(&cells.front()));
+            break;
+        case FormulaNode::Kind::UnaryPlus:
+            args.push_back(std::make_unique<UnaryOpExpr>(UnaryOpExpr::UnaryPlus, pop()));
+            break;
+        case FormulaNode::Kind::UnaryMinus:
+            args.push_back(std::make_unique<UnaryOpExpr>(UnaryOpExpr::UnaryMinus, pop()));
+            break;
+        case FormulaNode::Kind::Add:
+            binary(BinaryOpExpr::Add);
+            break;
+        case FormulaNode::Kind::Subtract:
+            binary(BinaryOpExpr::Subtract);
+            break;
+        case FormulaNode::Kind::Multiply:
+            binary(BinaryOpExpr::Multiply);
+            break;
+        case FormulaNode::Kind::Divide:
+            binary(BinaryOpExpr::Divide);
+            break;
+        default:
+            throw ParsingError("Formula nodes: unknown node kind");
+        }
+    }
+
+    if (args.size() != 1) {
+        throw ParsingError("Formula nodes: expression is not a single tree");
+    }
+    return FormulaAST(std::move(args.front()), std::move(cells));
+}
+
+// ключ выражения со ссылками в виде смещений от якоря
+std::optional<std::string> MakeRelativeKey(std::string_view text, Position anchor) {
+    std::string key;
+    key.reserve(text.size() + 16);
+
+    try {
+        for (ASTImpl::Lexer lexer(text); lexer.Current().type != ASTImpl::TokenType::End; lexer.Next()) {
+            const auto& token = lexer.Current();
+            if (!key.empty()) {
+                // лексемы разделяются, чтобы соседние числа и ссылки не склеивались в другую запись
+                key += ' ';
+            }
+
+            if (token.type == ASTImpl::TokenType::Cell) {
+                auto pos = Position::FromString(token.text);
+                if (!pos.IsValid()) {
+                    return std::nullopt;
+                }
+                key += "R[" + std::to_string(pos.row - anchor.row) + "]C[" + std::to_string(pos.col - anchor.col) + "]";
+            }
+            else {
+                key += token.text;
+            }
+        }
+    }
+    catch (const ParsingError&) {
+        return std::nullopt;
+    }
+    return key;
+}
+
+void FormulaAST::Print(std::ostream& out, Position anchor) const {
+    root_expr_->Print(out, { anchor });
+}
+
+void FormulaAST::PrintFormula(std::ostream& out, Position anchor) const {
+    root_expr_->PrintFormula(out, ASTImpl::EP_ATOM, { anchor });
+}
+
+// печать дерева со всеми скобками, абсолютными адресами и точной записью чисел
+void FormulaAST::PrintAbsoluteKey(std::ostream& out, Position anchor) const {
+    root_expr_->Print(out, { anchor, false, true });
+}
+
+// печать дерева со всеми скобками, смещениями R[строка]C[столбец] и точной записью чисел
+void FormulaAST::PrintRelativeKey(std::ostream& out) const {
+    root_expr_->Print(out, { Position(0, 0), true, true });
 }
 
 // возвращает флаг того, что есть вектор зависимостей
@@ -432,6 +914,16 @@ bool FormulaAST::HasDepends() const {
     return !cells_.empty();
 }
 
+// дописать узлы дерева в постфиксном порядке
+void FormulaAST::Save(std::vector<FormulaNode>& nodes) const {
+    root_expr_->Save(nodes);
+}
+
+// хеш выражения с адресами ссылок для якоря
+std::uint64_t FormulaAST::Hash(Position anchor) const {
+    return root_expr_->Hash(0, anchor);
+}
+
 // возвращает вектор позиций ссылок
 std::forward_list<Position> FormulaAST::GetReferenceList() {
     return cells_;
@@ -443,20 +935,17 @@ const std::forward_list<Position>& FormulaAST::GetReferenceList() const {
 }
 
 // печать листа ячеек
-void FormulaAST::PrintReferenceCells(std::ostream& out) const {
+void FormulaAST::PrintReferenceCells(std::ostream& out, Position anchor) const {
     for (const auto& pos : cells_) {
-        out << pos.ToString() << " ";
+        out << Position(anchor.row + pos.row, anchor.col + pos.col).ToString() << " ";
     }
 }
 
-double FormulaAST::Execute(CellFinder [[maybe_unused]] finder) const {
-    return root_expr_->Evaluate(finder);
-}
-
 FormulaAST::FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr, std::forward_list<Position> cells)
     : root_expr_(std::move(root_expr))
     , cells_(std::move(cells)) {
     cells_.sort();  // to avoid sorting in GetReferencedCells
+    root_expr_->Compile(program_);
 }
 
 FormulaAST::~FormulaAST() = default;
\ No newline at end of file
@@ -3,13 +3,18 @@
 #include "FormulaLexer.h"
 #include "common.h"
 
+#include <array>
+#include <cmath>
+#include <cstdint>
 #include <forward_list>
-#include <functional>
+#include <optional>
 #include <stdexcept>
+#include <string_view>
+#include <vector>
 
-// лямбда-функция поиска ячейки по позиции в таблице
-// возвращает результат в double если ячейка существует и нормально считается
-using CellFinder = std::function<double(Position)>;
+// Результат вычисления формулы: число либо ошибка вычисления.
+// Ошибки передаются значением, исключения при вычислении не используются
+using EvaluationResult = std::variant<double, FormulaError>;
 
 namespace ASTImpl {
 class Expr;
@@ -19,6 +24,72 @@ class ParsingError : public std::runtime_error {
     using std::runtime_error::runtime_error;
 };
 
+// Скомпилированная формула: плоский массив команд в постфиксной записи.
+// Выполняется на стековой машине одним циклом без виртуальных вызовов, операнды команд
+// (числа и смещения ячеек от якоря формулы) лежат в отдельных массивах в порядке появления в выражении.
+// Значения ячеек запрашиваются у resolver - любого вызываемого объекта вида
+// EvaluationResult(Position), он подставляется в цикл напрямую, без std::function
+class FormulaProgram {
+public:
+    enum class OpCode : std::uint8_t {
+        PushNumber,                    // положить на стек число numbers_[operand]
+        LoadCell,                      // положить на стек значение ячейки якорь + cells_[operand]
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+        Negate,
+    };
+
+    struct Instruction {
+        OpCode code;
+        std::uint32_t operand = 0;
+    };
+
+    void PushNumber(double value);                                         // добавить загрузку числа
+    void LoadCell(Position offset);                                        // добавить загрузку ячейки по смещению
+    void Emit(OpCode code);                                                // добавить операцию над стеком
+
+    template <typename Resolver>
+    EvaluationResult Execute(const Resolver& resolver, Position anchor) const; // выполнить программу для якоря
+
+    const std::vector<Instruction>& GetCode() const;                       // команды программы
+
+private:
+    std::vector<Instruction> code_;
+    std::vector<double> numbers_;
+    std::vector<Position> cells_;
+    std::size_t depth_ = 0;                                                // глубина стека после последней команды
+    std::size_t max_depth_ = 0;                                            // наибольшая глубина стека при выполнении
+
+    void Track(int delta);                                                 // учёт глубины стека при компиляции
+
+    static bool HasNonFinite(const double* values, std::size_t count);     // есть ли среди значений бесконечность или nan
+};
+
+// Узел разобранной формулы. Узлы дерева в постфиксном порядке однозначно восстанавливают выражение
+// вместе с унарными плюсами, без лексера и парсера: так формулы хранятся в снимке листа
+struct FormulaNode {
+    enum class Kind : std::uint8_t {
+        Number,                        // число number
+        Cell,                          // ссылка на ячейку со смещением cell от якоря
+        UnaryPlus,
+        UnaryMinus,
+        Add,
+        Subtract,
+        Multiply,
+        Divide,
+    };
+
+    Kind kind = Kind::Number;
+    Position cell;
+    double number = 0.0;
+};
+
+// Разобранная формула. Ссылки на ячейки хранятся смещениями от якоря - ячейки, для которой формула
+// разбиралась, поэтому одна формула может обслуживать целый столбец, заполненный однотипным выражением.
+// Абсолютные адреса получаются прибавлением якоря при вычислении и печати. При якоре A1 смещения
+// совпадают с абсолютными адресами
 class FormulaAST {
 public:
     explicit FormulaAST(std::unique_ptr<ASTImpl::Expr> root_expr,
@@ -27,20 +98,105 @@ public:
     FormulaAST& operator=(FormulaAST&&) = default;
     ~FormulaAST();
 
-    // в экзекут передается лямбда поиска и применяется по необходимости 
-    // если ячейка имеет в себе ссылки, для обычной строки надобности в поисковике нет
-    double Execute(CellFinder [[maybe_unused]]finder) const;
-    void PrintReferenceCells(std::ostream& out) const;                     // печать листа ячеек
-    void Print(std::ostream& out) const;                                   // обычная печать
-    void PrintFormula(std::ostream& out) const;                            // печать формулы
+    // в экзекут передается resolver значений ячеек и применяется по необходимости
+    // если ячейка имеет в себе ссылки, для обычной строки надобности в нём нет
+    template <typename Resolver>
+    EvaluationResult Execute(const Resolver& resolver, Position anchor) const {
+        return program_.Execute(resolver, anchor);
+    }
+    void PrintReferenceCells(std::ostream& out, Position anchor = Position(0, 0)) const; // печать листа ячеек
+    void Print(std::ostream& out, Position anchor = Position(0, 0)) const;               // обычная печать
+    void PrintFormula(std::ostream& out, Position anchor = Position(0, 0)) const;        // печать формулы
+    void PrintAbsoluteKey(std::ostream& out, Position anchor) const;       // дерево выражения с адресами
+    void PrintRelativeKey(std::ostream& out) const;                        // дерево выражения со смещениями
     bool HasDepends() const;                                               // возвращает флаг того, что есть вектор зависимостей
-    std::forward_list<Position> GetReferenceList() ;                       // возвращает вектор позиций ссылок
-    const std::forward_list<Position>& GetReferenceList() const;           // возвращает вектор позиций ссылок
+    void Save(std::vector<FormulaNode>& nodes) const;                      // дописать узлы дерева в постфиксном порядке
+    std::uint64_t Hash(Position anchor) const;                             // хеш выражения с адресами ссылок для якоря
+    std::forward_list<Position> GetReferenceList() ;                       // возвращает смещения ссылок от якоря
+    const std::forward_list<Position>& GetReferenceList() const;           // возвращает смещения ссылок от якоря
 
 private:
-    std::unique_ptr<ASTImpl::Expr> root_expr_;
+    std::unique_ptr<ASTImpl::Expr> root_expr_;                            // дерево выражения, используется для печати
     std::forward_list<Position> cells_;
+    FormulaProgram program_;                                              // байткод для вычисления
 };
 
+// разбор формулы рукописным парсером грамматики Formula.g4, ссылки сохраняются смещениями от якоря
 FormulaAST ParseFormulaAST(std::istream& in);
-FormulaAST ParseFormulaAST(const std::string& in_str);
\ No newline at end of file
+FormulaAST ParseFormulaAST(const std::string& in_str, Position anchor = Position(0, 0));
+
+// восстановление формулы из узлов, записанных FormulaAST::Save(). Бросает ParsingError, если узлы не образуют дерево
+FormulaAST BuildFormulaAST(const std::vector<FormulaNode>& nodes);
+
+// ключ выражения для интернирования: лексемы через пробел, ссылки в виде смещений R[строка]C[столбец] от якоря.
+// Строится одним проходом лексера без разбора, nullopt - если лексер текст не принимает
+std::optional<std::string> MakeRelativeKey(std::string_view text, Position anchor);
+
+// эталонный разбор через сгенерированный ANTLR парсер, используется для сверки в тестах. Якорь - A1
+FormulaAST ParseFormulaASTReference(std::istream& in);
+FormulaAST ParseFormulaASTReference(const std::string& in_str);
+
+template <typename Resolver>
+EvaluationResult FormulaProgram::Execute(const Resolver& resolver, Position anchor) const {
+    // стек небольших формул размещается в кадре функции, без выделения памяти
+    std::array<double, 32> local{};
+    std::vector<double> heap;
+    double* stack = local.data();
+    if (max_depth_ > local.size()) {
+        heap.resize(max_depth_);
+        stack = heap.data();
+    }
+    std::size_t top = 0;                                                   // количество значений на стеке
+
+    for (const Instruction& instruction : code_) {
+        switch (instruction.code) {
+        case OpCode::PushNumber:
+            stack[top++] = numbers_[instruction.operand];
+            break;
+        case OpCode::LoadCell:
+        {
+            const Position& offset = cells_[instruction.operand];
+            EvaluationResult value = resolver(Position(anchor.row + offset.row, anchor.col + offset.col));
+            if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+                // бесконечность на стеке означает, что до этой ячейки уже было переполнение,
+                // при пооперационной проверке оно дало бы #DIV/0! раньше ошибки ячейки
+                if (HasNonFinite(stack, top)) {
+                    return FormulaError(FormulaError::Category::Div0);
+                }
+                return *error;
+            }
+            stack[top++] = std::get<double>(value);
+            break;
+        }
+        case OpCode::Add:
+            --top;
+            stack[top - 1] += stack[top];
+            break;
+        case OpCode::Subtract:
+            --top;
+            stack[top - 1] -= stack[top];
+            break;
+        case OpCode::Multiply:
+            --top;
+            stack[top - 1] *= stack[top];
+            break;
+        case OpCode::Divide:
+            --top;
+            // деление на бесконечность дало бы конечный результат и скрыло бы переполнение в делителе
+            if (stack[top] == 0.0 || !std::isfinite(stack[top])) {
+                return FormulaError(FormulaError::Category::Div0);
+            }
+            stack[top - 1] /= stack[top];
+            break;
+        case OpCode::Negate:
+            stack[top - 1] = -stack[top - 1];
+            break;
+        }
+    }
+
+    // единственная проверка результата: бесконечность и nan промежуточных операций доходят до конца
+    if (!std::isfinite(stack[0])) {
+        return FormulaError(FormulaError::Category::Div0);
+    }
+    return stack[0];
+}
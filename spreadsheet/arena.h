@@ -0,0 +1,105 @@
+﻿#pragma once
+
+#include <array>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Слэб-арена для мелких объектов таблицы (ячеек).
+// Память выделяется крупными слэбами и нарезается на объекты по классам размера с шагом GRANULE.
+// Освобождённые объекты попадают в список свободных своего класса и переиспользуются, адреса живых объектов
+// не меняются. Разрушение арены освобождает все слэбы разом, без поштучного возврата памяти.
+class SlabArena {
+public:
+    static const std::size_t SLAB_SIZE = 64 * 1024;                                   // размер одного слэба
+    static const std::size_t GRANULE = 16;                                            // шаг классов размера и выравнивание
+    static const std::size_t MAX_OBJECT = 512;                                        // крупнее выделяются напрямую
+
+    SlabArena() = default;
+
+    SlabArena(const SlabArena&) = delete;
+    SlabArena& operator=(const SlabArena&) = delete;
+
+    void* Allocate(std::size_t size) {
+        if (size > MAX_OBJECT) {
+            return ::operator new(size);
+        }
+
+        const std::size_t index = ClassIndex(size);
+        if (FreeNode* node = _free[index]) {
+            // сначала переиспользуем освобождённые объекты
+            _free[index] = node->next;
+            return node;
+        }
+
+        const std::size_t bytes = (index + 1) * GRANULE;
+        if (static_cast<std::size_t>(_end - _cursor) < bytes) {
+            NewSlab();
+        }
+
+        void* result = _cursor;
+        _cursor += bytes;
+        return result;
+    }
+
+    void Deallocate(void* ptr, std::size_t size) {
+        if (size > MAX_OBJECT) {
+            ::operator delete(ptr);
+            return;
+        }
+
+        const std::size_t index = ClassIndex(size);
+        _free[index] = new (ptr) FreeNode{ _free[index] };
+    }
+
+    // создать объект в арене
+    template <typename T, typename... Args>
+    T* Create(Args&&... args) {
+        static_assert(alignof(T) <= GRANULE, "SlabArena: object alignment is too large");
+
+        void* memory = Allocate(sizeof(T));
+        try {
+            return new (memory) T(std::forward<Args>(args)...);
+        }
+        catch (...) {
+            Deallocate(memory, sizeof(T));
+            throw;
+        }
+    }
+
+    // разрушить объект и вернуть память в арену
+    template <typename T>
+    void Destroy(T* object) {
+        if (object) {
+            object->~T();
+            Deallocate(object, sizeof(T));
+        }
+    }
+
+    // количество выделенных слэбов
+    std::size_t SlabCount() const {
+        return _slabs.size();
+    }
+
+private:
+    struct FreeNode {
+        FreeNode* next;
+    };
+
+    std::vector<std::unique_ptr<std::byte[]>> _slabs;                                 // выделенные слэбы
+    std::array<FreeNode*, MAX_OBJECT / GRANULE> _free{};                              // списки свободных по классам размера
+    std::byte* _cursor = nullptr;                                                     // свободная часть текущего слэба
+    std::byte* _end = nullptr;                                                        // конец текущего слэба
+
+    static std::size_t ClassIndex(std::size_t size) {
+        return size ? (size - 1) / GRANULE : 0;
+    }
+
+    void NewSlab() {
+        _slabs.push_back(std::make_unique<std::byte[]>(SLAB_SIZE));
+        _cursor = _slabs.back().get();
+        _end = _cursor + SLAB_SIZE;
+    }
+};
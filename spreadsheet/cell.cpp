@@ -1,69 +1,96 @@
 ﻿#include "cell.h"
+#include "output_buffer.h"
 #include "sheet.h"
 
-Cell::~Cell() {
-	// сначала запускаем очистку данных
-	// чтобы обновились хеши если надо
-	Clear();
-}
+#include <algorithm>
+#include <iterator>
+#include <utility>
 
-// конструктор от ссылки на таблицу
-Cell::Cell(Sheet& sheet, Position pos) 
-	: _sheet(sheet), _pos(pos) {
+// конструктор от связи с таблицей
+Cell::Cell(SheetLink& link, Position pos)
+	: _link(&link), _pos(pos) {
+}
+// копия содержимого и кеша для другой связи: формула остаётся общей, рёбра графа копия не трогает
+Cell::Cell(SheetLink& link, const Cell& other)
+	: _link(&link), _string_data(other._string_data), _impl(other._impl), _pos(other._pos) {
+}
+// перейти к связи над той же памятью: ячейка замороженной связи снова отвечает по графу листа
+void Cell::Rebind(SheetLink& link) {
+	assert(_link->memory == link.memory);
+	_link = &link;
 }
 
 // задать новое содержимое ячейки
 void Cell::SetData(std::string text) {
 
 	// перезапись осуществляется если только не передана точно такая же строка
-	if (_string_data != text)
+	if (IsRaw() || _string_data != text)
 	{
-		if (text.empty()) {
-			// для пустой строки создаём пустую имплементацию
-			_impl = std::make_unique<EmptyImpl>(text);
-		}
+		// разбор не трогает ячейку, при ошибке в формуле данные не пострадают
+		Draft draft = Parse(GetSheet(), _pos, std::move(text));
 
-		else {
-			// если строка не начинается с формульного знака
-			if (text[0] != FORMULA_SIGN) {
-				// создаём тесктовую имплементацию
-				_impl = std::make_unique<TextImpl>(text);
-			}
-			else
-			{
-				// создаём новую формульную имплементацию
-				std::unique_ptr<FormulaImpl> new_implementation =
-					std::make_unique<FormulaImpl>(_sheet, text.substr(1, text.size()));
-
-				// если формула имеет зависимости
-				if (new_implementation->HasDepends()) {
-					std::vector<Position> depends_on = new_implementation->GetReferencedCells();
-
-					// запускаем проверку на образование циклической зависимости
-					// проверка выкинет исключение если будет найдена такая зависимость
-					// таким образом данные в ячейке не постарадают, так как метод прекратит выполнение
-					ReferenceManager(RManagerFlag::cyclic_check, depends_on);
-					// после имплементации и проверки запускаем менеджер зависимостей на обновление пула ссылок
-					ReferenceManager(RManagerFlag::update_roots, depends_on);
-					// в случае успешных проверок, чтобы не терять массив кидаем его в список зависимости ячейки
-					AddDependsOn(depends_on);
-				}
-
-				// просле проверок смотрим была ли ячейка уже активированна чем-то
-				// если ячейка создаётся впервые, то скорее всего на неё еще нет ссылок
-				if (!IsRaw() && !IsEmpty()) {
-					Clear();     // операция очистки ячейки позаботится о инвалидации кеша
-				}
-
-				// после всех проверок и обновлений загружаем новую имплементацию
-				_impl = std::move(new_implementation);
-				// записываем полученную строку
-				_string_data = text;
-			}
-		}
+		// заменяем ссылки ячейки в графе, рёбра прежней формулы уходят вместе с ней
+		// граф выкинет исключение если новые ссылки образуют циклическую зависимость
+		// таким образом данные в ячейке не постарадают, так как метод прекратит выполнение
+		ReferenceManager(RManagerFlag::update_roots, draft._refs);
+
+		// после всех проверок и обновлений загружаем новую имплементацию
+		Apply(std::move(draft));
+
+		// значение ячейки поменялось - кеши всех зависимых от неё формул больше не верны, в том числе для текста
+		ClearCache();
 	}
 }
 
+// разобрать строку для ячейки в позиции pos
+Cell::Draft Cell::Parse(Sheet& sheet, Position pos, std::string text) {
+	Draft draft;
+
+	if (text.empty()) {
+		// для пустой строки создаём пустую имплементацию, ссылок у неё нет
+		draft._impl.emplace<EmptyImpl>();
+	}
+	// если строка не начинается с формульного знака
+	else if (text[0] != FORMULA_SIGN) {
+		// создаём тесктовую имплементацию, сам текст хранится в ячейке
+		draft._impl.emplace<TextImpl>(text);
+	}
+	else {
+		// ссылки разбираются относительно позиции ячейки, так формулы заполненного столбца тоже общие
+		auto shared = sheet.GetFormulaPool().Intern(text.substr(1, text.size()), pos);
+		FormulaImpl& formula = draft._impl.emplace<FormulaImpl>(std::move(shared.formula), shared.anchor);
+		draft._refs = formula.GetReferencedCells();
+	}
+
+	draft._text = std::move(text);
+	return draft;
+}
+
+// содержимое из готовой формулы без разбора текста
+Cell::Draft Cell::Restore(std::string text, std::shared_ptr<const FormulaInterface> formula, Position anchor,
+                          std::optional<FormulaInterface::Value> cache) {
+	Draft draft;
+
+	if (formula) {
+		draft._impl.emplace<FormulaImpl>(std::move(formula), anchor, std::move(cache));
+	}
+	else if (text.empty()) {
+		draft._impl.emplace<EmptyImpl>();
+	}
+	else {
+		draft._impl.emplace<TextImpl>(text);
+	}
+
+	draft._text = std::move(text);
+	return draft;
+}
+
+// записать разобранное содержимое
+void Cell::Apply(Draft&& draft) {
+	_impl = std::move(draft._impl);
+	_string_data = std::move(draft._text);
+}
+
 // задать позицию ячейки
 void Cell::SetPosition(Position pos) {
 	_pos.col = pos.col;
@@ -75,7 +102,7 @@ void Cell::Copy(const Cell& other) {
 	// првоеряем на самоприсваивание по адресам в памяти и по значениям
 	if (*this != other && !IsEqual(other)) {
 
-		if (static_cast<bool>(_impl)) {
+		if (!IsRaw()) {
 			// очищаем старые данные если они есть
 			Clear();  // очистка автоматически инвалидирует кеш если от данной ячейки зависят
 		}
@@ -90,13 +117,26 @@ void Cell::Move(Cell& other) {
 	// првоеряем на самоприсваивание по адресам в памяти и по значениям
 	if (*this != other && !IsEqual(other)) {
 
-		// для начала инвалидируем кеши обоих ячеек
-		ClearCache(); other.ClearCache();
+		// ссылки переходят в графе вместе с содержимым
+		std::vector<Position> depends_on = other.GetReferencedCells();
+		other.ReferenceManager(RManagerFlag::update_roots, {});
+		try {
+			// на новом месте формула может замкнуть цикл
+			ReferenceManager(RManagerFlag::update_roots, depends_on);
+		}
+		catch (const CircularDependencyException&) {
+			other.ReferenceManager(RManagerFlag::update_roots, depends_on);
+			throw;
+		}
 
 		// переносим базовую строку
 		_string_data = std::move(other._string_data);
-		// указатель на данные обрабатываем через release/reset
-		_impl.reset(other._impl.release());
+		// переносим содержимое, исходная ячейка остаётся без данных
+		_impl = std::move(other._impl);
+		other._impl.emplace<std::monostate>();
+
+		// инвалидируем кеши обоих ячеек и их зависимых
+		ClearCache(); other.ClearCache();
 	}
 }
 // обменять содержимое ячеек
@@ -105,7 +145,7 @@ void Cell::Swap(Cell& other) {
 	if (*this != other && !IsEqual(other)) {
 		try
 		{
-			Cell temp(_sheet, Position::NONE); // делаем временную копию ячейки
+			Cell temp(*_link, Position::NONE); // делаем временную копию ячейки
 			this->Copy(other);                 // записываем данные из другой ячейки
 			other.Move(temp);           // перезаписываем данные другой ячейки
 		}
@@ -118,44 +158,68 @@ void Cell::Swap(Cell& other) {
 
 // очистить ранее посчитаный кеш формулы
 void Cell::ClearCache() {
-	if (IsFormula()) {
-		// удаляем кеши через менеджер со спец-флагом
-		ReferenceManager(RManagerFlag::clear_cache, _dependent);
-	}
+	// удаляем кеши через менеджер со спец-флагом, зависимые есть и у текстовых ячеек
+	ReferenceManager(RManagerFlag::clear_cache, {});
 }
 
 // удалить содержимое ячейки
 void Cell::Clear() {
-	// если ячейка формульная и от неё зависят другие ячейки
-	if (IsFormula() && IsRoot()) {
-		// необходимо инвалидировать кеши зависимых
-		ReferenceManager(RManagerFlag::clear_cache, _dependent);
-	}
+	// ссылки ячейки уходят из графа, а ссылки на неё остаются за позицией
+	ReferenceManager(RManagerFlag::update_roots, {});
 
-	if (_impl) _impl.release()->~Impl();       // полностью удаляет содержимое
+	_impl.emplace<std::monostate>();           // полностью удаляет содержимое
 	_string_data = "";                         // удаляем входящую строку
+
+	// необходимо инвалидировать кеши зависимых
+	ClearCache();
 }
 
 // получить расчётное значение ячейки
 Cell::Value Cell::GetValue() const {
-	if (!IsRaw()) {
-		// только не сырая ячейка может дать какое-то значение
-		return _impl->GetValue();
-	}
-	else {
+	switch (GetType())
+	{
+	case Type::empty:
+		return std::get<EmptyImpl>(_impl).GetValue();
+	case Type::text:
+		return std::get<TextImpl>(_impl).GetValue(_string_data);
+	case Type::formula:
+		// после EvaluateFormula() результат в кеше: посчитанная ячейка читается без обращения к листу
+		EvaluateFormula();
+		return std::get<FormulaImpl>(_impl).GetCachedValue();
+	default:
+		// сырая ячейка значения не имеет
 		return 0.0;
 	}
 }
 // получить текстовое представление ячейки
 std::string Cell::GetText() const {
-	if (!IsRaw()) {
+	switch (GetType())
+	{
+	case Type::empty:
+		return std::get<EmptyImpl>(_impl).GetString();
+	case Type::text:
+		return std::get<TextImpl>(_impl).GetString(_string_data);
+	case Type::formula:
+		return std::get<FormulaImpl>(_impl).GetString();
+	default:
 		// только не сырая ячейка может вернуть текст
-		return _impl->GetString();
-	}
-	else {
 		return "";
 	}
 }
+// получить значение ячейки в виде числа для формул
+std::variant<double, FormulaError> Cell::GetNumericValue() const {
+	switch (GetType())
+	{
+	case Type::text:
+		return std::get<TextImpl>(_impl).GetNumber();
+	case Type::formula:
+		EvaluateFormula();
+		return *std::get<FormulaImpl>(_impl).GetCache();
+	default:
+		// пустые и сырые ячейки трактуются как ноль
+		return 0.0;
+	}
+}
 
 // получить содержимое пула зависимостей формулы
 std::vector<Position> Cell::GetReferencedCells() const {
@@ -167,134 +231,118 @@ std::vector<Position> Cell::GetReferencedCells() const {
 		return {};
 	}
 }
+// получить формулу ячейки либо nullptr
+const FormulaImpl* Cell::GetFormulaData() const {
+	return std::get_if<FormulaImpl>(&_impl);
+}
 // получить базовую строку ячйеки
 const std::string& Cell::GetTextData() const {
 	return _string_data;
 }
-
-// добавить зависимую ячейку
-void Cell::AddDependentCell(Position pos) {
-	// проверяем есть ли такая ячейка в векторе
-	if (!IsDependentCell(pos)) {
-		_dependent.push_back(pos);
+// хеш типа и содержимого ячейки. Текст хешируется по строке, формула - по дереву выражения с адресами ссылок
+// и точными числами, её текст не печатается. Формулы, печатающиеся одинаково, но с разными деревьями
+// (например "=1+(2+3)" и "=1+2+3"), получают разные хеши
+std::uint64_t Cell::GetContentHash() const {
+	const std::uint64_t hash = CombineHash(0, static_cast<std::uint64_t>(GetType()));
+	if (const FormulaImpl* formula = GetFormulaData()) {
+		return CombineHash(hash, formula->GetFormula()->GetHash(formula->GetAnchor()));
 	}
-}
-// добавить вектор зависимых ячейк
-void Cell::AddDependentCell(const std::vector<Position>& dependent) {
-	// копируем новый лист зависимых
-	_dependent = dependent;
-}
-// добавить ячейку от которой зависит текущая
-void Cell::AddDependsOn(Position pos) {
-	// проверяем есть ли такая ячейка в векторе
-	if (!IsDependsFromCell(pos)) {
-		_depends_on.push_back(pos);
-		// не вызываем менеджер для единичного случая
-		// "сообщаем" ячейке, что у неё появилась зависимая подруга
-		_sheet.GetDirectCell(pos)->AddDependentCell(_pos);
-	}
-}
-// добавить вектор ячеек от которой зависит текущая
-void Cell::AddDependsOn(const std::vector<Position>& dependent) {
-	// копируем новый лист зависимостей от
-	_depends_on = dependent;
-	// запускаем менеджер на обновление ссылок
-	ReferenceManager(RManagerFlag::update_roots, _depends_on);
+	return CombineHash(hash, std::hash<std::string>()(_string_data));
 }
 
 // подтверждает что позиция является зависимой от текущей
 bool Cell::IsDependentCell(Position pos) const {
-	return std::find(/*std::execution::par,*/_dependent.begin(), _dependent.end(), pos) != _dependent.end() ? true : false;
+	return GetGraph().IsPrecedent(pos, _pos);
 }
 // подтверждает что данная ячейка зависит от позиции
 bool Cell::IsDependsFromCell(Position pos) const {
-	return std::find(/*std::execution::par,*/_depends_on.begin(), _depends_on.end(), pos) != _depends_on.end() ? true : false;
-}
-// проверка на циклическую зависимость
-bool Cell::CyclicRecurceCheck(Position pos) const {
-	
-	if (_depends_on.empty()) {
-		// если список зависимостей пуст, то дальше и искать не надо
-		return false;
-	}
-
-	if (IsDependsFromCell(pos)) {
-		// если в списке зависимостей есть переданная позиция, то сразу говорим - да, мы уже от неё зависим!
-		return true;
-	}
-	else {
-		for (const auto& cell : _depends_on) {
-			// запускаем дальнейшую проверку
-			const Cell* test = _sheet.GetDirectCell(cell);
-			if (test && test->CyclicRecurceCheck(pos)) {
-				// если нашли таки попадание, то выходим
-				return true;
-			}
-			else {
-				// иначе продолжаем до талого, когда наконец не появится фолс
-				continue;
-			}
-		}
-
-		return false;
-	}
+	return GetGraph().IsPrecedent(_pos, pos);
 }
 // возвращает вектор ячеек зависимых от текущей 
 std::vector<Position> Cell::GetDependent() const{
-	return _dependent;
+	return GetGraph().GetDependents(_pos);
 }
 // возвращает вектор ячеек, от которых зависит текущая
 std::vector<Position> Cell::GetDependsOn() const{
-	return _depends_on;
+	return GetGraph().GetPrecedents(_pos);
 }
 
-// печать GetValue в поток
-void Cell::PrintValue(std::ostream& out) {
-	// если строка текстовая, то выведется текстовое предаставление 
-	if (IsText()) {
-		out << std::get<std::string>(GetValue());
-	}
-	else {
-		// если формула то будем смотреть что там выводится
-		if (IsFormula() && std::holds_alternative<double>(GetValue())) {
-			out << std::get<double>(GetValue());
+// печать GetValue в буфер вывода
+void Cell::PrintValue(OutputBuffer& out) const {
+	switch (GetType())
+	{
+	case Type::text:
+		// текст пишется из базовой строки без копии, экранирующий апостроф отбрасывается
+		if (!_string_data.empty() && _string_data[0] == ESCAPE_SIGN) {
+			out.Write(std::string_view(_string_data).substr(1));
+		}
+		else {
+			out.Write(_string_data);
+		}
+		break;
+	case Type::formula:
+	{
+		// значение формулы - число либо ошибка, строку результата собирать не нужно
+		auto value = GetNumericValue();
+		if (const double* number = std::get_if<double>(&value)) {
+			out.Number(*number);
 		}
 		else {
-			out << std::get<FormulaError>(GetValue());
+			out.Error(std::get<FormulaError>(value));
 		}
+		break;
+	}
+	default:
+		// пустые и сырые ячейки печатаются пустой строкой
+		break;
 	}
 }
-// печать GetText в поток
-void Cell::PrintText(std::ostream& out) {
-	if (!IsEmpty() && !IsRaw()) {
-		out << GetText();
+// печать GetText в буфер вывода
+void Cell::PrintText(OutputBuffer& out) const {
+	switch (GetType())
+	{
+	case Type::text:
+		out.Write(_string_data);
+		break;
+	case Type::formula:
+		out.Write(GetText());
+		break;
+	default:
+		break;
 	}
 }
 
+// возвращает тип содержимого ячейки
+Cell::Type Cell::GetType() const {
+	return static_cast<Type>(_impl.index());
+}
 // возвращает флаг незаполненной ячейки
 bool Cell::IsEmpty() const {
-	// если лежит именно EmptyImpl
-	return !IsRaw() && dynamic_cast<EmptyImpl*>(_impl.get()) ? true : false;
+	return GetType() == Type::empty;
 }
 // возвращает флаг текстовой ячейки
 bool Cell::IsText() const {
-	return !IsRaw() && dynamic_cast<TextImpl*>(_impl.get()) ? true : false;
+	return GetType() == Type::text;
 }
 // возвращает флаг ячейки с формульным выражением
 bool Cell::IsFormula() const {
-	return !IsRaw() && dynamic_cast<FormulaImpl*>(_impl.get()) ? true : false;
+	return GetType() == Type::formula;
+}
+// возвращает флаг формулы, значение которой уже в кеше
+bool Cell::IsCalculated() const {
+	return IsFormula() && AsFormula()->IsCached();
 }
 // возвращает флаг того, что ячейка является ссылкой
 bool Cell::IsReference() const {
-	return !_depends_on.empty();
+	return GetGraph().HasPrecedents(_pos);
 }
 // возвращает флаг того, что на данную ячейку ссылаются
 bool Cell::IsRoot() const {
-	return !_dependent.empty();
+	return GetGraph().HasDependents(_pos);
 }
 // возвращает флаг пустой ячейки
 bool Cell::IsRaw() const {
-	return !(_impl);
+	return GetType() == Type::raw;
 }
 // флаг равенство ячеек по значениям по ссылке
 bool Cell::IsEqual(const Cell& other) const {
@@ -305,7 +353,7 @@ bool Cell::IsEqual(const Cell& other) const {
 	}
 	// обе ячейки НЕ "сырые" - сравниваем по значению и текстовому представлению
 	else if (!IsRaw() && !other.IsRaw()) {
-		return _impl->GetString() == other._impl->GetString();
+		return GetType() == other.GetType() && GetText() == other.GetText();
 	}
 	else {
 		return false;
@@ -327,28 +375,80 @@ bool Cell::IsEqual(const CellInterface* other) const {
 }
 
 // читает ячейку как текст
-TextImpl* Cell::AsText() const {
-	if (this->IsText()) {
-		return dynamic_cast<TextImpl*>(_impl.get());
-	}
-	else {
-		throw CellException("ERROR::AsText()::" + std::to_string(__LINE__));
+const TextImpl* Cell::AsText() const {
+	if (const TextImpl* text = std::get_if<TextImpl>(&_impl)) {
+		return text;
 	}
+	throw CellException("ERROR::AsText()::" + std::to_string(__LINE__));
 }
 
 // читает ячейку как формулу
-FormulaImpl* Cell::AsFormula() const {
-	if (this->IsFormula()) {
-		return dynamic_cast<FormulaImpl*>(_impl.get());
+FormulaImpl* Cell::AsFormula() {
+	if (FormulaImpl* formula = std::get_if<FormulaImpl>(&_impl)) {
+		return formula;
 	}
-	else {
-		throw CellException("ERROR::AsFormula()::" + std::to_string(__LINE__));
+	throw CellException("ERROR::AsFormula()::" + std::to_string(__LINE__));
+}
+// читает ячейку как формулу
+const FormulaImpl* Cell::AsFormula() const {
+	return const_cast<Cell*>(this)->AsFormula();
+}
+
+// лист-владелец ячейки
+Sheet& Cell::GetSheet() {
+	return *_link->sheet;
+}
+// лист-владелец ячейки
+const Sheet& Cell::GetSheet() const {
+	return *_link->sheet;
+}
+
+// граф листа-владельца либо замороженной связи: ячейка общего блока переживает лист, создавший блок
+const DependencyGraph& Cell::GetGraph() const {
+	static const DependencyGraph empty;
+	if (_link->sheet) {
+		return std::as_const(*_link->sheet).GetDependencyGraph();
 	}
+	return _link->graph ? *_link->graph : empty;
 }
 
 // получение результата работы формулы
 Cell::Value Cell::GetFormulaEvaluate() const {
-	return AsFormula()->GetValue();
+	return AsFormula()->GetValue(GetSheet());
+}
+
+// посчитать формулу и её влияющие снизу вверх
+void Cell::EvaluateFormula() const {
+	const FormulaImpl& formula = std::get<FormulaImpl>(_impl);
+	if (formula.IsCached()) {
+		return;
+	}
+
+	// формула без кеша у влияющих
+	auto is_pending = [this](Position pos) {
+		const Cell* cell = GetSheet().GetDirectCell(pos);
+		const FormulaImpl* other = cell ? std::get_if<FormulaImpl>(&cell->_impl) : nullptr;
+		return other && !other->IsCached();
+	};
+
+	const DependencyGraph& graph = GetSheet().GetDependencyGraph();
+	bool ready = true;
+	graph.ForEachPrecedent(_pos, [&](Position pos) {
+		ready = ready && !is_pending(pos);
+	});
+
+	if (ready) {
+		// все влияющие посчитаны, вычисление не уйдёт вглубь
+		formula.GetNumber(GetSheet());
+		return;
+	}
+
+	// непосчитанные влияющие вычисляются по порядку, начиная с самых глубоких:
+	// к моменту вычисления каждой формулы значения всех её ссылок уже в кеше, и стек не растёт с длиной цепочки
+	for (Position pos : graph.CollectUpstream(_pos, is_pending)) {
+		const Cell* cell = GetSheet().GetDirectCell(pos);
+		std::get<FormulaImpl>(cell->_impl).GetNumber(GetSheet());
+	}
 }
 
 // менеджер обработки ссылок
@@ -358,55 +458,75 @@ void Cell::ReferenceManager(RManagerFlag flag, const std::vector<Position>&refs)
 	{
 		// работа во время имплементации или просто обновления
 	case Cell::update_roots:
-		// идём по списку и добавляем джанные в каждую ячейку
-		std::for_each(/*std::execution::par,*/refs.begin(), refs.end(), [this](const Position& pos) {
-			// если искомая ячейка, от которой зависит текущая существует
-			if (_sheet.IsValid(pos)) {
-				// добавляем зависимость напрямую по полученному указателю ячейки, через соответствующий метод класса
-				_sheet.GetDirectCell(pos)->AddDependentCell(_pos);
-			}
-		// но может случиться так, что еще нет той ячейки от которой зависит текущая
-			else {
-				// необходимо сказать таблице - "я тут это, завишу вон от той, ты потом ей скажи, когда она появится, позязя"
-				_sheet.AddFutureRefLine(pos, _pos);
+	{
+		// правка с теми же ссылками (в том числе текст вместо текста) граф не меняет: граф, общий
+		// с копией либо опубликованной версией листа, при этом не копируется
+		std::vector<Position> current = std::as_const(GetSheet()).GetDependencyGraph().GetPrecedents(_pos);
+		std::vector<Position> next = refs;
+		std::sort(current.begin(), current.end());
+		std::sort(next.begin(), next.end());
+		next.erase(std::unique(next.begin(), next.end()), next.end());
+		if (current == next) {
+			break;
+		}
+
+		// ссылки заменяются целиком, граф сам убирает рёбра прежнего содержимого
+		// и проверяет, не образуют ли новые рёбра цикл, поддерживая топологический порядок ячеек
+		Sheet& sheet = GetSheet();
+		if (!sheet.GetDependencyGraph().SetPrecedents(_pos, refs)) {
+			throw CircularDependencyException("IsCyclicDependency");
+		}
+
+		// у ячеек, на которые ссылка появилась либо пропала, изменились зависимые. Ячейка общего блока
+		// отвечает по графу, с которым блок стал общим, поэтому её блок лист забирает себе
+		std::vector<Position> changed;
+		std::set_symmetric_difference(current.begin(), current.end(), next.begin(), next.end(), std::back_inserter(changed));
+		for (Position pos : changed) {
+			const Cell* cell = std::as_const(sheet).GetDirectCell(pos);
+			if (cell && cell->_link != _link) {
+				sheet.GetDirectCell(pos);
 			}
-			});
+		}
+		// ячеек, от которых зависит текущая, может ещё не быть: их позиции остаются вершинами графа,
+		// и появившаяся ячейка сразу найдёт всех своих зависимых
 		break;
+	}
 
 		// очистка кеша по всей линии зависимых ссылок
 	case Cell::clear_cache:
-		// удаление кеша приведет к инвалидации кеша, зависимых ячеек
-		// таким образом необходимо сначала очистить кеши зависимых и всем цепочкам их зависимостей
-		std::for_each(/*std::execution::par,*/_dependent.begin(), _dependent.end(), [this](const Position& pos) {
-			// сначала точно также запускаем рекурсивное удаление
-			Cell* cell = _sheet.GetDirectCell(pos);
-			if (cell) cell->ClearCache();
-
-			});
+	{
 		// удаляем текущий кеш
-		AsFormula()->ClearCache();
-		break;
-
-		// проверка на образование циклической звисимости сразу выкинет исключение если что-то найдёт
-	case Cell::cyclic_check:
-		// сейчас будет масло масленное - необходимо проверить, не входит ли
-		// данная ячейка в списки зависимостей ячеек, от которых зависит она сама
-
-		// начинаем искать совпадение по зависимостям
-		for (const auto& item : refs) {
-			if (item == _pos) {
-				// если ссылаемся на себя же то выдаем ошибку
-				throw CircularDependencyException("IsCyclicDependency");
-			}
+		if (FormulaImpl* formula = std::get_if<FormulaImpl>(&_impl)) {
+			formula->ClearCache();
+		}
 
-			// получаем ячейку на проверку
-			const Cell* cell = _sheet.GetDirectCell(item);
-			// проверяем совпадение по зависимостям полученной ячейки
-			if (cell && cell->CyclicRecurceCheck(_pos)) {
-				throw CircularDependencyException("IsCyclicDependency");
+		// зависимые обходятся явным списком работ, глубина стека не зависит от длины цепочки.
+		// Формула кешируется только после того, как закешированы все её влияющие, поэтому у формулы
+		// без кеша нет закешированных зависимых: на ней обход останавливается. Так каждая ячейка
+		// очищается один раз за правку, сколько бы путей к ней ни вело, а обход не выходит за
+		// пределы ячеек, которые действительно были посчитаны
+		Sheet& sheet = GetSheet();
+		const DependencyGraph& graph = std::as_const(sheet).GetDependencyGraph();
+		std::vector<Position> worklist;
+		auto push_dependents = [&worklist](Position pos) {
+			worklist.push_back(pos);
+		};
+
+		graph.ForEachDependent(_pos, push_dependents);
+		while (!worklist.empty()) {
+			Position pos = worklist.back();
+			worklist.pop_back();
+
+			const Cell* cell = std::as_const(sheet).GetDirectCell(pos);
+			if (cell && cell->IsCalculated()) {
+				// кеш сбрасывается в ячейке для изменения: блок, общий с копией листа, лист сначала копирует
+				std::get<FormulaImpl>(sheet.GetDirectCell(pos)->_impl).ClearCache();
+				graph.ForEachDependent(pos, push_dependents);
 			}
 		}
 		break;
+	}
+
 	default:
 		break;
 	}
@@ -1,16 +1,49 @@
 ﻿#pragma once
 
+#include "arena.h"
 #include "common.h"
 #include "formula.h"
 
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
 #include <variant>
 #include <string_view>
 #include <cassert>
 #include <iostream>
 #include <string>
 #include <optional>
+#include <vector>
 
 class Sheet;
+class OutputBuffer;
+class DependencyGraph;
+
+// Память ячеек листа. Общий блок может разрушить другой лист, в том числе в другом потоке, поэтому память
+// его ячеек не идёт в арену напрямую: она складывается в список возврата, и хранилище-владелец арены забирает
+// его в своём потоке
+struct SheetMemory {
+    SlabArena arena;                                                              // память ячеек листа
+
+    std::mutex returned_mutex;                                                    // защищает список возврата
+    std::vector<void*> returned;                                                  // память ячеек общих блоков, разрушенных не владельцем
+    std::atomic<bool> has_returned{ false };                                      // список возврата не пуст
+};
+
+// Связь ячеек с листом: указатель на лист-владелец и память, в которой размещены ячейки листа.
+// Ячейка хранит указатель на связь, а не на лист, поэтому перемещение и обмен листов только переставляют
+// указатель в связи. Блоки хранилища держат связь своих ячеек, и блок, общий с копией листа, переживает
+// лист вместе с памятью. После разрушения листа указатель обнуляется.
+// Когда блоки становятся общими с копией, связь замораживается: указатель на лист обнуляется, связь запоминает
+// граф зависимостей на этот момент, а лист продолжает работу с новой связью над той же памятью. Ячейки
+// замороженной связи отвечают о зависимостях по этому графу, а лист, меняющий зависимости такой ячейки,
+// сначала забирает её блок себе
+struct SheetLink {
+    Sheet* sheet = nullptr;                                                       // лист-владелец ячеек
+    std::shared_ptr<SheetMemory> memory = std::make_shared<SheetMemory>();        // память ячеек, общая для связей листа
+    std::shared_ptr<const DependencyGraph> graph;                                 // граф зависимостей замороженной связи
+};
 
 // Исключение, выбрасываемое при попытке некорректного прочтения строки
 class CellException : public std::runtime_error {
@@ -18,70 +51,84 @@ public:
     using std::runtime_error::runtime_error;
 };
 
-// Базовый интерфейс представления ячейки
-class Impl {
-public:
-
-    virtual ~Impl() = default;
-    virtual std::string GetString() const = 0;                            // возвращает строковое представление данных
-    virtual CellInterface::Value GetValue() const = 0;                    // возвращает значение формулы или строки
-};
-
 // Представление пустой ячейки
-class EmptyImpl : public Impl {
+class EmptyImpl {
 public:
-    explicit EmptyImpl(std::string_view text)
-        : _data(std::string(text)) {
-    }
-
-    std::string GetString() const override {
+    std::string GetString() const {
         return "";
     }
 
-    CellInterface::Value GetValue() const override {
+    CellInterface::Value GetValue() const {
         return "";
     }
-private:
-    std::string _data;
 };
 
-// Представление текстовой ячейки
-class TextImpl : public Impl {
+// Представление текстовой ячейки. Сам текст хранится в ячейке и передаётся в методы представления.
+// Числовое значение текста для формул разбирается один раз при создании
+class TextImpl {
 public:
-    explicit TextImpl(std::string_view text) 
-        : _data(std::string(text)) {
+    explicit TextImpl(std::string_view text)
+        : _number(ParseNumber(text)) {
     }
 
-    CellInterface::Value GetValue() const override {
+    CellInterface::Value GetValue(const std::string& text) const {
         // если в данных строки апостров
-        if (_data[0] == ESCAPE_SIGN) {
+        if (!text.empty() && text[0] == ESCAPE_SIGN) {
             // возвращаем Value без него
-            return _data.substr(1);
+            return text.substr(1);
         }
-        return _data;
+        return text;
     }
 
-    std::string GetString() const override {
-        return _data;
+    std::string GetString(const std::string& text) const {
+        return text;
     }
+
+    // возвращает заранее разобранное число либо ошибку #VALUE!
+    FormulaInterface::Value GetNumber() const {
+        return _number;
+    }
+
 private:
-    std::string _data;
+    FormulaInterface::Value _number;                                              // числовое значение текста для формул
+
+    static FormulaInterface::Value ParseNumber(std::string_view text) {
+        // число разбирается из видимого значения, без экранирующего апострофа
+        if (!text.empty() && text[0] == ESCAPE_SIGN) {
+            text.remove_prefix(1);
+        }
+        if (auto number = ParseCellNumber(text)) {
+            return *number;
+        }
+        return FormulaError(FormulaError::Category::Value);
+    }
 };
 
-// Представление формульной ячейки
-class FormulaImpl : public Impl {
+// Представление формульной ячейки. Разобранная формула неизменяема и разделяется всеми ячейками
+// с тем же выражением, кеш результата у каждой ячейки свой. Ссылки формулы отсчитываются от якоря:
+// для формул заполненного столбца это сама ячейка, для абсолютных копий - ячейка, где формула разбиралась
+class FormulaImpl {
 public:
-    FormulaImpl() = default;
-
-    explicit FormulaImpl(const SheetInterface& sheet, std::string text)
-        : _sheet(sheet), _data(ParseFormula(std::string(text))) {
+    FormulaImpl(std::shared_ptr<const FormulaInterface> formula, Position anchor,
+                std::optional<FormulaInterface::Value> cache = std::nullopt)
+        : _data(std::move(formula)), _anchor(anchor), _cache_result(std::move(cache)) {
     }
 
     // возвращает указатель на формулу
-    FormulaInterface* GetFormula() {
+    const FormulaInterface* GetFormula() const {
         return _data.get();
     }
 
+    // возвращает якорь ссылок формулы
+    Position GetAnchor() const {
+        return _anchor;
+    }
+
+    // возвращает кеш результата без вычисления
+    const std::optional<FormulaInterface::Value>& GetCache() const {
+        return _cache_result;
+    }
+
     // возвращает вектор зависимостей формулы
     bool HasDepends() const {
         return _data.get()->HasDepends();
@@ -89,31 +136,41 @@ public:
 
     // возвращает вектор зависимостей формулы
     std::vector<Position> GetReferencedCells() const {
-        return _data.get()->GetReferencedCells();
+        return _data.get()->GetReferencedCells(_anchor);
     }
 
-    std::string GetString() const override {
+    std::string GetString() const {
         // возвращаем текстовое представление со знаком равно
-        return FORMULA_SIGN + _data->GetExpression();
+        return FORMULA_SIGN + _data->GetExpression(_anchor);
     }
 
-    CellInterface::Value GetValue() const override {
+    // таблица передаётся при вычислении, формула не хранит ссылку на неё
+    CellInterface::Value GetValue(const SheetInterface& sheet) const {
         // если данные еще не кешированны
         if (!IsCached()) {
             // сначала записываем в кеш
-            _cache_result = _data->Evaluate(_sheet);
+            _cache_result = _data->Evaluate(sheet, _anchor);
         }
+        return GetCachedValue();
+    }
 
+    // возвращает посчитанный результат из кеша, к таблице не обращается
+    CellInterface::Value GetCachedValue() const {
         // возвращаем результат в зависимости от того, что хранится в кеше
         if (std::holds_alternative<double>(_cache_result.value())) {
             return std::get<double>(_cache_result.value());
         }
-        else if (std::holds_alternative<FormulaError>(_cache_result.value())) {
+        else {
             return std::get<FormulaError>(_cache_result.value());
         }
-        else {
-            throw CellException("ERROR::FormulaImpl::GetValue()::uncorrect value" + std::to_string(__LINE__));
+    }
+
+    // возвращает результат формулы в числовом виде, вычисляя его при отсутствии в кеше
+    FormulaInterface::Value GetNumber(const SheetInterface& sheet) const {
+        if (!IsCached()) {
+            _cache_result = _data->Evaluate(sheet, _anchor);
         }
+        return *_cache_result;
     }
 
     bool IsCached() const {
@@ -125,20 +182,72 @@ public:
     }
 
 private:
-    const SheetInterface& _sheet;                                                 // ссылка на таблицу
-    std::unique_ptr<FormulaInterface> _data;                                      // формульные данные
+    std::shared_ptr<const FormulaInterface> _data;                                // разделяемые формульные данные
+    Position _anchor;                                                             // якорь ссылок формулы
     mutable std::optional<FormulaInterface::Value> _cache_result;                 // кешированный результат работы формулы
 };
 
+// Ячейка позиции, на которую ссылаются формулы, но которой ещё нет. Сама позиция - вершина графа зависимостей,
+// для GetCell() её представляет этот объект без состояния: пустое значение, пустой текст, ссылок нет.
+// Объект неизменяем, поэтому один экземпляр на лист безопасно читать из любого потока
+class PendingCell final : public CellInterface {
+public:
+    Value GetValue() const override {
+        return "";
+    }
+
+    std::string GetText() const override {
+        return "";
+    }
+
+    std::variant<double, FormulaError> GetNumericValue() const override {
+        // отсутствующая ячейка в формулах - ноль
+        return 0.0;
+    }
+
+    std::vector<Position> GetReferencedCells() const override {
+        return {};
+    }
+};
 
 class Cell : public CellInterface {
 private:
-    Sheet& _sheet;
+    // содержимое хранится прямо в ячейке, тип определяется номером альтернативы
+    using Content = std::variant<std::monostate, EmptyImpl, TextImpl, FormulaImpl>;
+
+    SheetLink* _link = nullptr;
 public:
+    // тип содержимого ячейки, совпадает с номером альтернативы в хранилище содержимого
+    enum class Type : std::uint8_t
+    {
+        raw,                 // ячейка создана, но данные ещё не заданы
+        empty,               // пустая строка
+        text,                // текст
+        formula              // формульное выражение
+    };
+
+    // разобранное содержимое ячейки. Разбор не меняет лист, поэтому пакет правок сначала разбирается
+    // целиком и только потом записывается: ошибка в любой формуле пакета оставляет таблицу прежней
+    class Draft {
+    public:
+        const std::vector<Position>& GetReferencedCells() const {
+            return _refs;
+        }
+
+    private:
+        friend class Cell;
+
+        std::string _text;                                                        // базовая строка
+        Content _impl;                                                            // содержимое ячейки
+        std::vector<Position> _refs;                                              // ссылки формулы
+    };
+
     Cell() = default;
-    ~Cell();
+    ~Cell() = default;                                                            // связи и кеши зависимых убирает лист до удаления ячейки
 
-    Cell(Sheet& /*sheet*/, Position/*pos*/);                                      // конструктор от ссылки на таблицу
+    Cell(SheetLink& /*link*/, Position/*pos*/);                                   // конструктор от связи с таблицей
+    Cell(SheetLink& /*link*/, const Cell& /*other*/);                             // копия содержимого и кеша для другой связи
+    void Rebind(SheetLink& /*link*/);                                             // перейти к связи над той же памятью
 
     Cell(const Cell&) = delete;                                                   // запрещаем конструктор копирования
     Cell& operator=(const Cell& /*other*/) = delete;                              // запрещаем оператор присваивания
@@ -148,34 +257,38 @@ public:
     // --------------------------------------- сеттеры класса ----------------------------------------------------------------------
 
     void SetData(std::string /*text*/);                                           // задать новое содержимое ячейки
+    static Draft Parse(Sheet& /*sheet*/, Position /*pos*/, std::string /*text*/); // разобрать строку для ячейки в позиции pos
+    // содержимое из готовой формулы без разбора текста, formula пуст для текстовой ячейки. Ссылки в черновик не попадают
+    static Draft Restore(std::string /*text*/, std::shared_ptr<const FormulaInterface> /*formula*/, Position /*anchor*/,
+                         std::optional<FormulaInterface::Value> /*cache*/);
+    void Apply(Draft&& /*draft*/);                                                // записать разобранное содержимое, ссылки в графе уже заменены
     void SetPosition(Position /*pos*/);                                           // задать позицию ячейки
 
     // --------------------------------------- геттеры класса ----------------------------------------------------------------------
 
     Value GetValue() const override;                                              // получить расчётное значение ячейки
     std::string GetText() const override;                                         // получить текстовое представление ячейки
+    std::variant<double, FormulaError> GetNumericValue() const override;          // получить значение ячейки в виде числа для формул
     std::vector<Position> GetReferencedCells() const override;                    // получить содержимое пула зависимостей формулы
     const std::string& GetTextData() const;                                       // получить базовую строку ячйеки
+    const FormulaImpl* GetFormulaData() const;                                    // получить формулу ячейки либо nullptr
+    std::uint64_t GetContentHash() const;                                         // хеш типа и содержимого ячейки (формулы - по дереву), без позиции
 
     // --------------------------------------- блок работы с зависимостями класса --------------------------------------------------
-
-    void AddDependentCell(Position /*pos*/);                                      // добавить зависимую ячейку
-    void AddDependentCell(const std::vector<Position>& /*dependent*/);            // добавить вектор зависимых ячейк
-
-    void AddDependsOn(Position /*pos*/);                                          // добавить ячейку от которой зависит текущая
-    void AddDependsOn(const std::vector<Position>& /*depends*/);                  // добавить вектор ячеек от которой зависит текущая
+    // связи ячеек хранит граф зависимостей листа, методы ниже - обращения к нему по позиции ячейки.
+    // Ячейка блока, общего с копией либо опубликованной версией листа, спрашивает граф, с которым блок стал общим:
+    // лист, меняющий зависимости такой ячейки, сначала копирует её блок, поэтому ответы совпадают с графом листа
 
     bool IsDependentCell(Position /*pos*/) const;                                 // подтверждает что позиция является зависимой от текущей
     bool IsDependsFromCell(Position /*pos*/) const;                               // подтверждает что данная ячейка зависит от позиции
-    bool CyclicRecurceCheck(Position /*pos*/) const;                              // проверка на циклическую зависимость
 
     std::vector<Position> GetDependent() const;                                   // возвращает вектор ячеек зависимых от текущей
     std::vector<Position> GetDependsOn() const;                                   // возвращает вектор ячеек, от которых зависит текущая
 
     // --------------------------------------- блок печати класса ------------------------------------------------------------------
 
-    void PrintValue(std::ostream& /*out*/);                                       // печать GetValue в поток
-    void PrintText(std::ostream& /*out*/);                                        // печать GetText в поток
+    void PrintValue(OutputBuffer& /*out*/) const;                                 // печать GetValue в буфер вывода
+    void PrintText(OutputBuffer& /*out*/) const;                                  // печать GetText в буфер вывода
 
     // --------------------------------------- операции переноса и удаления --------------------------------------------------------
 
@@ -187,9 +300,12 @@ public:
 
     // --------------------------------------- булевые флаги класса ----------------------------------------------------------------
 
+    Type GetType() const;                                                         // возвращает тип содержимого ячейки
+
     bool IsEmpty() const;                                                         // возвращает флаг незаполненной ячейки
     bool IsText() const;                                                          // возвращает флаг текстовой ячейки
     bool IsFormula() const;                                                       // возвращает флаг ячейки с формульным выражением
+    bool IsCalculated() const;                                                    // возвращает флаг формулы, значение которой уже в кеше
 
     bool IsReference() const;                                                     // возвращает флаг того, что ячейка является ссылкой
     bool IsRoot() const;                                                          // возвращает флаг того, что на данную ячейку ссылаются
@@ -201,23 +317,26 @@ public:
 
 private:
     std::string _string_data = "";                                                // базовая строка
-    std::unique_ptr<Impl> _impl;                                                  // содержимое ячейки
+    Content _impl;                                                                // содержимое ячейки
     Position _pos = Position::NONE;                                               // позиция ячейки при создании
 
-    std::vector<Position> _dependent;                                             // зависимые ячейки, которые ссылаются на эту
-    std::vector<Position> _depends_on;                                            // ячейки, от которых зависит данная
-    
-    TextImpl* AsText() const;                                                     // кастует данные ячейки как текст
-    FormulaImpl* AsFormula() const;                                               // кастует данные ячейки  как формулу
+
+    const TextImpl* AsText() const;                                               // возвращает данные ячейки как текст
+    FormulaImpl* AsFormula();                                                     // возвращает данные ячейки как формулу
+    const FormulaImpl* AsFormula() const;                                         // возвращает данные ячейки как формулу
+
+    Sheet& GetSheet();                                                            // лист-владелец ячейки
+    const Sheet& GetSheet() const;                                                // лист-владелец ячейки
+    const DependencyGraph& GetGraph() const;                                      // граф листа-владельца либо замороженной связи
 
     Value GetFormulaEvaluate() const;                                             // получение результата работы формулы
+    void EvaluateFormula() const;                                                 // посчитать формулу и её влияющие снизу вверх
 
     // флаг работы менеджера ссылок
     enum RManagerFlag
     {
-        update_roots,        // обычное обновление вектора ссылок ячеек, от которых зависит текущая
-        clear_cache,         // рекурсивная очистка кеша у всего пула зависимых ячеек
-        cyclic_check         // проверка на образование циклической зависимости
+        update_roots,        // замена ссылок текущей ячейки в графе зависимостей листа
+        clear_cache          // рекурсивная очистка кеша у всего пула зависимых ячеек
     };
 
     void ReferenceManager(RManagerFlag /*flag*/, const std::vector<Position>& /*refs*/); // менеджер обработки ссылок
@@ -1,7 +1,9 @@
 #pragma once
 
+#include <cstdint>
 #include <iosfwd>
 #include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -20,6 +22,7 @@ struct Position {
 	Position() = default;
 	Position(int, int);
 	Position(const Position& other);
+	Position& operator=(const Position& other) = default;
 
 	bool IsValid() const;
 	std::string ToString() const;
@@ -37,12 +40,28 @@ struct Position {
 class PositionHasher {
 public:
 	std::size_t operator()(const Position& pos) const noexcept {
-		return _hasher(pos.row) + _hasher(pos.col * 37);
+		// строка и столбец упаковываются без потерь, разные позиции не дают одинаковых хешей
+		return _hasher((static_cast<std::uint64_t>(static_cast<std::uint32_t>(pos.row)) << 32)
+			| static_cast<std::uint32_t>(pos.col));
 	}
 private:
-	std::hash<int> _hasher;
+	std::hash<std::uint64_t> _hasher;
 };
 
+// Перемешивание битов 64-битного значения (финализатор splitmix64): близкие значения дают далёкие хеши.
+// На нём строятся хеши содержимого листа, которые складываются и сравниваются без перехеширования
+inline std::uint64_t MixHash(std::uint64_t value) {
+	value += 0x9E3779B97F4A7C15ull;
+	value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+	value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+	return value ^ (value >> 31);
+}
+
+// добавить значение к хешу последовательности, порядок значений важен
+inline std::uint64_t CombineHash(std::uint64_t seed, std::uint64_t value) {
+	return MixHash(seed * 0x100000001B3ull ^ value);
+}
+
 struct Size {
 
 	Size() = default;
@@ -103,6 +122,11 @@ public:
 inline constexpr char FORMULA_SIGN = '=';
 inline constexpr char ESCAPE_SIGN = '\'';
 
+// Разбор значения текстовой ячейки как числа для формул. Пустой текст считается нулём, допускаются
+// ведущие пробельные символы и знак, остаток строки целиком должен быть конечным числом.
+// Если текст не может быть трактован как число, возвращается пустой optional
+std::optional<double> ParseCellNumber(std::string_view text);
+
 class CellInterface {
 public:
 	// Либо текст ячейки, либо значение формулы, либо сообщение об ошибке из
@@ -128,6 +152,10 @@ public:
 	// редактирование. В случае текстовой ячейки это её текст (возможно,
 	// содержащий экранирующие символы). В случае формулы - её выражение.
 	virtual std::string GetText() const = 0;
+	// Возвращает значение ячейки в виде числа для вычисления формул: число,
+	// либо ошибку, если значение не может быть трактовано как число.
+	// Реализация по умолчанию разбирает результат GetValue().
+	virtual std::variant<double, FormulaError> GetNumericValue() const;
 
 	// Возвращает список ячеек, которые непосредственно задействованы в данной
 	// формуле. Список отсортирован по возрастанию и не содержит повторяющихся
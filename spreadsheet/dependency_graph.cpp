@@ -0,0 +1,489 @@
+﻿#include "dependency_graph.h"
+
+#include <algorithm>
+
+// ----------------------------------- class EdgeSet -----------------------------------------------------
+
+EdgeSet::EdgeSet(const EdgeSet& other)
+    : _inline(other._inline)
+    , _size(other._size)
+    , _large(other._large ? std::make_unique<LargeSet>(*other._large) : nullptr) {
+}
+
+EdgeSet& EdgeSet::operator=(const EdgeSet& other) {
+    if (this != &other) {
+        EdgeSet copy(other);
+        *this = std::move(copy);
+    }
+    return *this;
+}
+
+// добавить ребро, false - уже было
+bool EdgeSet::Insert(Position pos) {
+    if (_large) {
+        return _large->insert(pos).second;
+    }
+
+    if (Contains(pos)) {
+        return false;
+    }
+
+    if (_size < INLINE_LIMIT) {
+        _inline[_size++] = pos;
+    }
+    else {
+        // вершина выросла, дальше рёбра ищутся по хешу
+        _large = std::make_unique<LargeSet>(_inline.begin(), _inline.end());
+        _large->insert(pos);
+        _size = 0;
+    }
+    return true;
+}
+
+// удалить ребро, false - не было
+bool EdgeSet::Erase(Position pos) {
+    if (_large) {
+        if (!_large->erase(pos)) {
+            return false;
+        }
+        if (_large->empty()) {
+            _large.reset();
+        }
+        return true;
+    }
+
+    for (std::uint32_t i = 0; i != _size; ++i) {
+        if (_inline[i] == pos) {
+            // порядок рёбер не важен, на место удалённого ставится последнее
+            _inline[i] = _inline[--_size];
+            return true;
+        }
+    }
+    return false;
+}
+
+// флаг наличия ребра
+bool EdgeSet::Contains(Position pos) const {
+    if (_large) {
+        return _large->count(pos);
+    }
+    return std::find(_inline.begin(), _inline.begin() + _size, pos) != _inline.begin() + _size;
+}
+
+// количество рёбер
+std::size_t EdgeSet::Size() const {
+    return _large ? _large->size() : _size;
+}
+
+// флаг отсутствия рёбер
+bool EdgeSet::IsEmpty() const {
+    return Size() == 0;
+}
+
+// рёбра по возрастанию позиций
+std::vector<Position> EdgeSet::ToVector() const {
+    std::vector<Position> result;
+    result.reserve(Size());
+    ForEach([&result](Position pos) {
+        result.push_back(pos);
+    });
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
+// ----------------------------------- class EdgeSet END -------------------------------------------------
+
+// ----------------------------------- class DependencyGraph ---------------------------------------------
+
+// заменить ссылки ячейки, false - ссылки образуют цикл, граф при этом не меняется
+bool DependencyGraph::SetPrecedents(Position cell, const std::vector<Position>& precedents) {
+    std::vector<Position> previous = GetPrecedents(cell);
+    ClearPrecedents(cell);
+    if (precedents.empty()) {
+        return true;
+    }
+
+    // новые влияющие вершины встают в начало порядка, новая ячейка - в конец,
+    // так ссылки только что введённой формулы согласованы с порядком без обхода
+    for (Position precedent : precedents) {
+        if (precedent != cell) {
+            GetOrCreateNode(precedent, true);
+        }
+    }
+    Node& node = GetOrCreateNode(cell, false);
+
+    std::vector<Position> inserted;
+    for (Position precedent : precedents) {
+        if (node.precedents.Contains(precedent)) {
+            continue;
+        }
+
+        if (!InsertEdge(precedent, _nodes.find(precedent)->second, cell, node)) {
+            // цикл: ссылки новой формулы убираются, прежние возвращаются на место
+            for (Position item : inserted) {
+                EraseEdge(item, cell);
+            }
+            for (Position item : precedents) {
+                if (auto found = _nodes.find(item); found != _nodes.end()) {
+                    EraseIfIsolated(found);
+                }
+            }
+            if (auto found = _nodes.find(cell); found != _nodes.end()) {
+                EraseIfIsolated(found);
+            }
+            SetPrecedents(cell, previous);
+            return false;
+        }
+        inserted.push_back(precedent);
+    }
+    return true;
+}
+
+// заменить ссылки пакета ячеек по порядку, false - ссылки образуют цикл
+bool DependencyGraph::SetPrecedents(const std::vector<PrecedentsUpdate>& updates) {
+    std::size_t inserted = 0;
+    for (const auto& update : updates) {
+        inserted += update.second.size();
+    }
+
+    // прежние ссылки возвращаются в обратном порядке, так повтор ячейки в пакете тоже откатывается верно
+    std::vector<std::vector<Position>> previous;
+    previous.reserve(updates.size());
+
+    if (inserted * BULK_RATIO < _edges) {
+        // небольшой пакет в большом графе: каждое ребро проверяется на месте, без обхода всего графа
+        for (std::size_t i = 0; i != updates.size(); ++i) {
+            previous.push_back(GetPrecedents(updates[i].first));
+            if (!SetPrecedents(updates[i].first, updates[i].second)) {
+                while (i-- != 0) {
+                    SetPrecedents(updates[i].first, previous[i]);
+                }
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // крупный пакет: рёбра вставляются без поддержки порядка, цикл ищется одним обходом всего графа
+    _nodes.reserve(_nodes.size() + updates.size() + inserted);
+    for (const auto& [cell, precedents] : updates) {
+        previous.push_back(GetPrecedents(cell));
+        ClearPrecedents(cell);
+        LinkPrecedents(cell, precedents);
+    }
+    if (Sort()) {
+        return true;
+    }
+
+    // прежний граф ацикличен, после возврата рёбер он снова упорядочивается
+    for (std::size_t i = updates.size(); i-- != 0;) {
+        ClearPrecedents(updates[i].first);
+        LinkPrecedents(updates[i].first, previous[i]);
+    }
+    Sort();
+    return false;
+}
+
+// удалить ссылки ячейки
+void DependencyGraph::ClearPrecedents(Position cell) {
+    auto node = _nodes.find(cell);
+    if (node == _nodes.end() || node->second.precedents.IsEmpty()) {
+        return;
+    }
+
+    // у каждой влияющей ячейки убираем обратное ребро
+    node->second.precedents.ForEach([this, cell](Position precedent) {
+        auto other = _nodes.find(precedent);
+        other->second.dependents.Erase(cell);
+        --_edges;
+        if (precedent != cell) {
+            EraseIfIsolated(other);
+        }
+    });
+    node->second.precedents = EdgeSet();
+    EraseIfIsolated(node);
+}
+
+// удалить все рёбра
+void DependencyGraph::Clear() {
+    _nodes.clear();
+    _edges = 0;
+    _first_order = 0;
+    _last_order = 0;
+}
+
+// влияющие ячейки по возрастанию
+std::vector<Position> DependencyGraph::GetPrecedents(Position cell) const {
+    const Node* node = FindNode(cell);
+    return node ? node->precedents.ToVector() : std::vector<Position>{};
+}
+
+// зависимые ячейки по возрастанию
+std::vector<Position> DependencyGraph::GetDependents(Position cell) const {
+    const Node* node = FindNode(cell);
+    return node ? node->dependents.ToVector() : std::vector<Position>{};
+}
+
+// флаг того, что ячейка ссылается на другие
+bool DependencyGraph::HasPrecedents(Position cell) const {
+    const Node* node = FindNode(cell);
+    return node && !node->precedents.IsEmpty();
+}
+
+// флаг того, что на ячейку ссылаются
+bool DependencyGraph::HasDependents(Position cell) const {
+    const Node* node = FindNode(cell);
+    return node && !node->dependents.IsEmpty();
+}
+
+// флаг прямой ссылки cell на precedent
+bool DependencyGraph::IsPrecedent(Position cell, Position precedent) const {
+    const Node* node = FindNode(cell);
+    return node && node->precedents.Contains(precedent);
+}
+
+// количество вершин с рёбрами
+std::size_t DependencyGraph::NodeCount() const {
+    return _nodes.size();
+}
+
+// количество ссылок
+std::size_t DependencyGraph::EdgeCount() const {
+    return _edges;
+}
+
+// вершины, влияющие раньше зависимых
+std::vector<Position> DependencyGraph::GetTopologicalOrder() const {
+    std::vector<std::pair<std::int64_t, Position>> ordered;
+    ordered.reserve(_nodes.size());
+    for (const auto& [pos, node] : _nodes) {
+        ordered.push_back({ node.order, pos });
+    }
+    std::sort(ordered.begin(), ordered.end(), [](const auto& lhs, const auto& rhs) {
+        return lhs.first < rhs.first;
+    });
+
+    std::vector<Position> result;
+    result.reserve(ordered.size());
+    for (const auto& item : ordered) {
+        result.push_back(item.second);
+    }
+    return result;
+}
+
+// вершина по позиции либо nullptr
+const DependencyGraph::Node* DependencyGraph::FindNode(Position cell) const {
+    auto node = _nodes.find(cell);
+    return node != _nodes.end() ? &node->second : nullptr;
+}
+
+// вершина, новая - в начале или в конце порядка
+DependencyGraph::Node& DependencyGraph::GetOrCreateNode(Position cell, bool first) {
+    auto [node, inserted] = _nodes.try_emplace(cell);
+    if (inserted) {
+        // у новой вершины нет рёбер, любое место в порядке для неё верно
+        node->second.order = first ? --_first_order : ++_last_order;
+    }
+    return node->second;
+}
+
+// удалить вершину без рёбер
+void DependencyGraph::EraseIfIsolated(Nodes::iterator node) {
+    if (node->second.precedents.IsEmpty() && node->second.dependents.IsEmpty()) {
+        _nodes.erase(node);
+    }
+}
+
+// добавить ребро, false - цикл
+bool DependencyGraph::InsertEdge(Position precedent, Node& from, Position cell, Node& to) {
+    if (&from == &to) {
+        // ссылка ячейки на саму себя
+        return false;
+    }
+
+    if (from.order > to.order) {
+        // ребро нарушает порядок: обходим только вершины между его концами
+        ++_epoch;
+        Region forward;
+        if (!CollectForward(to, from.order, from, forward)) {
+            // влияющая достижима из зависимой - ребро замкнёт цикл
+            return false;
+        }
+        Region backward;
+        CollectBackward(from, to.order, backward);
+        Reorder(backward, forward);
+    }
+
+    to.precedents.Insert(precedent);
+    from.dependents.Insert(cell);
+    ++_edges;
+    return true;
+}
+
+// добавить рёбра без поддержки порядка, повторы отбрасываются
+void DependencyGraph::LinkPrecedents(Position cell, const std::vector<Position>& precedents) {
+    if (precedents.empty()) {
+        return;
+    }
+
+    for (Position precedent : precedents) {
+        GetOrCreateNode(precedent, true);
+    }
+    // адреса вершин не меняются при росте таблицы
+    Node& node = GetOrCreateNode(cell, false);
+
+    for (Position precedent : precedents) {
+        if (node.precedents.Insert(precedent)) {
+            _nodes.find(precedent)->second.dependents.Insert(cell);
+            ++_edges;
+        }
+    }
+}
+
+// упорядочить весь граф, false - цикл
+bool DependencyGraph::Sort() {
+    struct Frame {
+        Node* node;
+        bool expanded;
+    };
+
+    // вершина на пути обхода отмечена эпохой active, завершённая - эпохой done. Номера выдаются
+    // по завершении вершины, то есть после всех её влияющих. Ребро в вершину на пути - цикл
+    const std::uint64_t active = ++_epoch;
+    const std::uint64_t done = ++_epoch;
+    std::int64_t order = 0;
+
+    std::vector<Frame> stack;
+    for (auto& item : _nodes) {
+        Node& root = item.second;
+        if (root.visited == done) {
+            continue;
+        }
+
+        stack.push_back({ &root, false });
+        while (!stack.empty()) {
+            Frame& frame = stack.back();
+            Node* node = frame.node;
+
+            if (frame.expanded) {
+                node->visited = done;
+                node->order = ++order;
+                stack.pop_back();
+                continue;
+            }
+            if (node->visited == done) {
+                // вершина уже пройдена по другому пути
+                stack.pop_back();
+                continue;
+            }
+
+            frame.expanded = true;
+            node->visited = active;
+
+            bool cycle = false;
+            node->precedents.ForEach([&](Position pos) {
+                Node& next = _nodes.find(pos)->second;
+                if (next.visited == active) {
+                    cycle = true;
+                }
+                else if (next.visited != done) {
+                    stack.push_back({ &next, false });
+                }
+            });
+            if (cycle) {
+                return false;
+            }
+        }
+    }
+
+    _first_order = 1;
+    _last_order = order;
+    return true;
+}
+
+// удалить ребро
+void DependencyGraph::EraseEdge(Position precedent, Position cell) {
+    auto from = _nodes.find(precedent);
+    auto to = _nodes.find(cell);
+    if (to->second.precedents.Erase(precedent)) {
+        from->second.dependents.Erase(cell);
+        --_edges;
+    }
+    EraseIfIsolated(from);
+    EraseIfIsolated(to);
+}
+
+// зависимые до границы, false - достигнута вершина target
+bool DependencyGraph::CollectForward(Node& start, std::int64_t upper, const Node& target, Region& region) {
+    start.visited = _epoch;
+    Region stack{ &start };
+    bool cycle = false;
+
+    while (!stack.empty() && !cycle) {
+        Node* node = stack.back();
+        stack.pop_back();
+        region.push_back(node);
+
+        node->dependents.ForEach([&](Position pos) {
+            Node& next = _nodes.find(pos)->second;
+            if (&next == &target) {
+                cycle = true;
+            }
+            else if (next.visited != _epoch && next.order < upper) {
+                // вершины за границей уже стоят после влияющей, их порядок не нарушен
+                next.visited = _epoch;
+                stack.push_back(&next);
+            }
+        });
+    }
+    return !cycle;
+}
+
+// влияющие до границы
+void DependencyGraph::CollectBackward(Node& start, std::int64_t lower, Region& region) {
+    start.visited = _epoch;
+    Region stack{ &start };
+
+    while (!stack.empty()) {
+        Node* node = stack.back();
+        stack.pop_back();
+        region.push_back(node);
+
+        node->precedents.ForEach([&](Position pos) {
+            Node& next = _nodes.find(pos)->second;
+            if (next.visited != _epoch && next.order > lower) {
+                next.visited = _epoch;
+                stack.push_back(&next);
+            }
+        });
+    }
+}
+
+// поставить влияющие перед зависимыми, заняв те же номера порядка
+void DependencyGraph::Reorder(Region& backward, Region& forward) {
+    auto by_order = [](const Node* lhs, const Node* rhs) {
+        return lhs->order < rhs->order;
+    };
+    std::sort(backward.begin(), backward.end(), by_order);
+    std::sort(forward.begin(), forward.end(), by_order);
+
+    std::vector<std::int64_t> orders;
+    orders.reserve(backward.size() + forward.size());
+    for (const Node* node : backward) {
+        orders.push_back(node->order);
+    }
+    for (const Node* node : forward) {
+        orders.push_back(node->order);
+    }
+    std::sort(orders.begin(), orders.end());
+
+    std::size_t index = 0;
+    for (Node* node : backward) {
+        node->order = orders[index++];
+    }
+    for (Node* node : forward) {
+        node->order = orders[index++];
+    }
+}
+
+// ----------------------------------- class DependencyGraph END -----------------------------------------
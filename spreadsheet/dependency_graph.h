@@ -0,0 +1,188 @@
+﻿#pragma once
+
+#include "common.h"
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+// Множество рёбер одной вершины графа зависимостей.
+// Большинство ячеек ссылается на несколько ячеек и имеет несколько зависимых, такие рёбра лежат прямо
+// в вершине без выделения памяти. Когда рёбер становится больше INLINE_LIMIT (ячейка-концентратор,
+// на которую ссылаются тысячи формул), множество переходит в хеш-таблицу: вставка и удаление O(1)
+class EdgeSet {
+public:
+    static const std::size_t INLINE_LIMIT = 4;                                        // рёбер без выделения памяти
+
+    EdgeSet() = default;
+
+    EdgeSet(const EdgeSet& /*other*/);                                                // копия с собственной хеш-таблицей
+    EdgeSet& operator=(const EdgeSet& /*other*/);
+    EdgeSet(EdgeSet&&) noexcept = default;
+    EdgeSet& operator=(EdgeSet&&) noexcept = default;
+
+    bool Insert(Position pos);                                                        // добавить ребро, false - уже было
+    bool Erase(Position pos);                                                         // удалить ребро, false - не было
+    bool Contains(Position pos) const;                                                // флаг наличия ребра
+
+    std::size_t Size() const;                                                         // количество рёбер
+    bool IsEmpty() const;                                                             // флаг отсутствия рёбер
+    std::vector<Position> ToVector() const;                                           // рёбра по возрастанию позиций
+
+    // обход рёбер в произвольном порядке, func(Position)
+    template <typename Func>
+    void ForEach(Func func) const {
+        if (_large) {
+            for (Position pos : *_large) {
+                func(pos);
+            }
+        }
+        else {
+            for (std::uint32_t i = 0; i != _size; ++i) {
+                func(_inline[i]);
+            }
+        }
+    }
+
+private:
+    using LargeSet = std::unordered_set<Position, PositionHasher>;
+
+    std::array<Position, INLINE_LIMIT> _inline;                                       // рёбра малой вершины
+    std::uint32_t _size = 0;                                                          // количество рёбер в _inline
+    std::unique_ptr<LargeSet> _large;                                                 // рёбра крупной вершины
+};
+
+// Граф зависимостей листа.
+// Вершины - позиции, рёбра ведут от формулы к ячейкам, на которые она ссылается (влияющие), и обратно
+// (зависимые). Граф хранит рёбра и для позиций, где ячейки ещё нет, поэтому появление ячейки не требует
+// перестройки связей. Вершина без рёбер удаляется.
+// Граф ацикличен и поддерживает топологический порядок вершин: влияющая ячейка стоит раньше зависимой
+// (алгоритм Пирса-Келли). Ребро, согласованное с порядком, добавляется за O(1). Иначе обходится только
+// область между концами ребра: если зависимая достижима из влияющей - это цикл, если нет - вершины
+// области переупорядочиваются. Повторные заходы в вершину отсекаются отметкой эпохи обхода.
+// Копия графа независима от исходного, лист делит граф со своими копиями до первой правки
+class DependencyGraph {
+public:
+    using PrecedentsUpdate = std::pair<Position, std::vector<Position>>;          // ячейка и её новые ссылки
+
+    // пакет, добавляющий меньше рёбер, чем 1/BULK_RATIO графа, вставляется по одной ячейке
+    static const std::size_t BULK_RATIO = 4;
+
+    DependencyGraph() = default;
+
+    // заменить ссылки ячейки, false - ссылки образуют цикл, граф при этом не меняется
+    bool SetPrecedents(Position cell, const std::vector<Position>& precedents);
+    // заменить ссылки пакета ячеек по порядку, false - ссылки образуют цикл, граф при этом не меняется.
+    // Крупный пакет вставляется без поддержки порядка, затем граф один раз проверяется на циклы и упорядочивается
+    bool SetPrecedents(const std::vector<PrecedentsUpdate>& updates);
+    void ClearPrecedents(Position cell);                                              // удалить ссылки ячейки
+    void Clear();                                                                     // удалить все рёбра
+
+    std::vector<Position> GetPrecedents(Position cell) const;                         // влияющие ячейки по возрастанию
+    std::vector<Position> GetDependents(Position cell) const;                         // зависимые ячейки по возрастанию
+
+    bool HasPrecedents(Position cell) const;                                          // флаг того, что ячейка ссылается на другие
+    bool HasDependents(Position cell) const;                                          // флаг того, что на ячейку ссылаются
+    bool IsPrecedent(Position cell, Position precedent) const;                        // флаг прямой ссылки cell на precedent
+
+    std::size_t NodeCount() const;                                                    // количество вершин с рёбрами
+    std::size_t EdgeCount() const;                                                    // количество ссылок
+    std::vector<Position> GetTopologicalOrder() const;                                // вершины, влияющие раньше зависимых
+
+    // обход влияющих ячеек, func(Position)
+    template <typename Func>
+    void ForEachPrecedent(Position cell, Func func) const {
+        if (const Node* node = FindNode(cell)) {
+            node->precedents.ForEach(func);
+        }
+    }
+
+    // обход зависимых ячеек, func(Position)
+    template <typename Func>
+    void ForEachDependent(Position cell, Func func) const {
+        if (const Node* node = FindNode(cell)) {
+            node->dependents.ForEach(func);
+        }
+    }
+
+    // ячейка cell и её влияющие, принятые фильтром filter(Position), в порядке вычисления: влияющие
+    // раньше зависимых, cell последней. Обход не идёт за отвергнутые фильтром вершины и не использует рекурсию
+    template <typename Filter>
+    std::vector<Position> CollectUpstream(Position cell, Filter filter) const;
+
+private:
+    struct Node {
+        EdgeSet precedents;                                                           // ячейки, на которые ссылается вершина
+        EdgeSet dependents;                                                           // ячейки, которые ссылаются на вершину
+        std::int64_t order = 0;                                                       // номер в топологическом порядке
+        mutable std::uint64_t visited = 0;                                            // эпоха последнего обхода
+    };
+
+    using Nodes = std::unordered_map<Position, Node, PositionHasher>;
+    using Region = std::vector<Node*>;
+
+    Nodes _nodes;                                                                     // вершины, имеющие рёбра
+    std::size_t _edges = 0;                                                           // количество ссылок
+    std::int64_t _first_order = 0;                                                    // номер перед всеми вершинами
+    std::int64_t _last_order = 0;                                                     // номер после всех вершин
+    mutable std::uint64_t _epoch = 0;                                                 // эпоха текущего обхода
+
+    const Node* FindNode(Position cell) const;                                        // вершина по позиции либо nullptr
+    Node& GetOrCreateNode(Position cell, bool first);                                 // вершина, новая - в начале или в конце порядка
+    void EraseIfIsolated(Nodes::iterator node);                                       // удалить вершину без рёбер
+
+    bool InsertEdge(Position precedent, Node& from, Position cell, Node& to);         // добавить ребро, false - цикл
+    void LinkPrecedents(Position cell, const std::vector<Position>& precedents);      // добавить рёбра без поддержки порядка
+    bool Sort();                                                                      // упорядочить весь граф, false - цикл
+    void EraseEdge(Position precedent, Position cell);                                // удалить ребро
+    bool CollectForward(Node& start, std::int64_t upper, const Node& target, Region& region); // зависимые до границы
+    void CollectBackward(Node& start, std::int64_t lower, Region& region);            // влияющие до границы
+    static void Reorder(Region& backward, Region& forward);                           // поставить влияющие перед зависимыми
+};
+
+template <typename Filter>
+std::vector<Position> DependencyGraph::CollectUpstream(Position cell, Filter filter) const {
+    struct Frame {
+        Position pos;
+        const Node* node;
+        bool expanded;
+    };
+
+    std::vector<Position> result;
+    const Node* root = FindNode(cell);
+    if (!root) {
+        // ячейка ни на что не ссылается
+        result.push_back(cell);
+        return result;
+    }
+
+    // обход в глубину с явным стеком, вершина попадает в результат после всех своих влияющих
+    ++_epoch;
+    root->visited = _epoch;
+    std::vector<Frame> stack{ { cell, root, false } };
+    while (!stack.empty()) {
+        if (stack.back().expanded) {
+            result.push_back(stack.back().pos);
+            stack.pop_back();
+            continue;
+        }
+
+        stack.back().expanded = true;
+        const Node* node = stack.back().node;
+        node->precedents.ForEach([&](Position pos) {
+            const Node& next = _nodes.find(pos)->second;
+            if (next.visited != _epoch) {
+                next.visited = _epoch;
+                if (filter(pos)) {
+                    stack.push_back({ pos, &next, false });
+                }
+            }
+        });
+    }
+    return result;
+}
@@ -13,77 +13,81 @@ std::ostream& operator<<(std::ostream& output, FormulaError fe) {
     return output << fe.ToString();
 }
 
-namespace {
-    double GetDoubleFrom(const std::string& str) {
-        double value = 0;
-        if (!str.empty()) {
-            std::istringstream in(str);
-            if (!(in >> value) || !in.eof()) {
-                throw FormulaError(FormulaError::Category::Value);
-            }
-        }
-        return value;
-    }
-
-    double GetDoubleFrom(double value) {
-        return value;
-    }
-
-    double GetDoubleFrom(FormulaError error) {
-        throw FormulaError(error);
-    }
-
-    double GetCellValue(const CellInterface* cell) {
-        if (!cell) return 0;
-        return std::visit([](const auto& value) { return GetDoubleFrom(value); },
-            cell->GetValue());
-    }
-}
-
 namespace {
     class Formula : public FormulaInterface {
     public:
         // Реализуйте следующие методы:
-        explicit Formula(std::string expression) try
-            : ast_(ParseFormulaAST(expression)) {
+        Formula(std::string expression, Position anchor) try
+            : ast_(ParseFormulaAST(expression, anchor)) {
         }
         catch (const std::exception& exc){
             std::throw_with_nested(FormulaException(exc.what()));
         }
 
+        // дерево собирается прямо в члене формулы из узлов GetNodes()
+        explicit Formula(const std::vector<FormulaNode>& nodes)
+            : ast_(BuildFormulaAST(nodes)) {
+        }
+
         Value Evaluate(const SheetInterface& sheet) const override {
-            try
-            {
-                // лямбда поиска ячейки CellFinder
-                auto cell_finder = [&sheet](Position position) -> double {
-                    if (!position.IsValid()) {
-                        throw FormulaError(FormulaError::Category::Ref);
-                    }
-                    const auto* cell = sheet.GetCell(position);
-                    return GetCellValue(cell);
-                };
-                return ast_.Execute(cell_finder);
-            }
-            catch (FormulaError exception)
-            {
-                return exception;
-            }
+            return Evaluate(sheet, Position(0, 0));
+        }
+
+        Value Evaluate(const SheetInterface& sheet, Position anchor) const override {
+            // значения ячеек и ошибки передаются результатом, без исключений
+            auto resolver = [&sheet](Position position) -> Value {
+                if (!position.IsValid()) {
+                    return FormulaError(FormulaError::Category::Ref);
+                }
+                const auto* cell = sheet.GetCell(position);
+                if (!cell) {
+                    return 0.0;
+                }
+                // числовое значение текстовых ячеек разобрано заранее, здесь нет ни разбора, ни выделения памяти
+                return cell->GetNumericValue();
+            };
+            return ast_.Execute(resolver, anchor);
         }
 
         std::string GetExpression() const override {
+            return GetExpression(Position(0, 0));
+        }
+
+        std::string GetExpression(Position anchor) const override {
             std::stringstream out;
-            ast_.PrintFormula(out);
+            ast_.PrintFormula(out, anchor);
             return out.str();
         }
 
+        std::string GetAbsoluteKey(Position anchor) const override {
+            std::stringstream out;
+            ast_.PrintAbsoluteKey(out, anchor);
+            return out.str();
+        }
+
+        std::string GetRelativeKey() const override {
+            std::stringstream out;
+            ast_.PrintRelativeKey(out);
+            return out.str();
+        }
+
+        std::uint64_t GetHash(Position anchor) const override {
+            return ast_.Hash(anchor);
+        }
+
         std::vector<Position> GetReferencedCells() const override {
+            return GetReferencedCells(Position(0, 0));
+        }
+
+        std::vector<Position> GetReferencedCells(Position anchor) const override {
             std::vector<Position> result;
 
+            // смещения отсортированы, сдвиг на якорь порядок не меняет
             for (Position item : ast_.GetReferenceList()) {
-                if (item.IsValid()) {
-                    result.push_back(item);
+                Position pos(anchor.row + item.row, anchor.col + item.col);
+                if (pos.IsValid()) {
+                    result.push_back(pos);
                 }
-                
             }
             // убираем дубликаты
             result.resize(std::unique(result.begin(), result.end()) - result.begin());
@@ -94,11 +98,30 @@ namespace {
             return ast_.HasDepends();
         }
 
+        std::vector<FormulaNode> GetNodes() const override {
+            std::vector<FormulaNode> nodes;
+            ast_.Save(nodes);
+            return nodes;
+        }
+
     private:
         FormulaAST ast_;
     };
 }  // namespace
 
 std::unique_ptr<FormulaInterface> ParseFormula(std::string expression) {
-    return std::make_unique<Formula>(std::move(expression));
-}
\ No newline at end of file
+    return ParseFormula(std::move(expression), Position(0, 0));
+}
+
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor) {
+    return std::make_unique<Formula>(std::move(expression), anchor);
+}
+
+std::unique_ptr<FormulaInterface> BuildFormula(const std::vector<FormulaNode>& nodes) {
+    try {
+        return std::make_unique<Formula>(nodes);
+    }
+    catch (const ParsingError& exc) {
+        throw FormulaException(exc.what());
+    }
+}
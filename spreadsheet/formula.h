@@ -27,19 +27,45 @@ public:
     // любая.
     virtual Value Evaluate(const SheetInterface& sheet) const = 0;
 
+    // Ссылки формулы хранятся смещениями от якоря - ячейки, для которой она разбиралась.
+    // Формула, общая для нескольких ячеек, вычисляется, печатается и сообщает ссылки
+    // относительно якоря конкретной ячейки. Методы без якоря используют якорь A1.
+    virtual Value Evaluate(const SheetInterface& sheet, Position anchor) const = 0;
+
     // Возвращает выражение, которое описывает формулу.
     // Не содержит пробелов и лишних скобок.
     virtual std::string GetExpression() const = 0;
+    virtual std::string GetExpression(Position anchor) const = 0;
+
+    // Ключи интернирования: дерево выражения со всеми скобками и точной записью чисел,
+    // с абсолютными адресами для якоря или со смещениями R[строка]C[столбец].
+    // Формулы с равными ключами вычисляются одинаково
+    virtual std::string GetAbsoluteKey(Position anchor) const = 0;
+    virtual std::string GetRelativeKey() const = 0;
+
+    // Хеш выражения с абсолютными адресами для якоря и точными числами. Одинаковые выражения
+    // дают одинаковый хеш независимо от якоря формулы, строка при этом не строится
+    virtual std::uint64_t GetHash(Position anchor) const = 0;
 
     // Возвращает флаг того, есть ли у формулы зависимости
     virtual bool HasDepends() const = 0;
 
+    // Возвращает узлы разобранного выражения в постфиксном порядке, по ним формула
+    // восстанавливается без разбора текста функцией BuildFormula()
+    virtual std::vector<FormulaNode> GetNodes() const = 0;
+
     // Возвращает список ячеек, которые непосредственно задействованы в вычислении
     // формулы. Список отсортирован по возрастанию и не содержит повторяющихся
     // ячеек.
     virtual std::vector<Position> GetReferencedCells() const = 0;
+    virtual std::vector<Position> GetReferencedCells(Position anchor) const = 0;
 };
 
 // Парсит переданное выражение и возвращает объект формулы.
 // Бросает FormulaException в случае, если формула синтаксически некорректна.
-std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
\ No newline at end of file
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression);
+std::unique_ptr<FormulaInterface> ParseFormula(std::string expression, Position anchor);
+
+// Восстанавливает формулу из узлов, полученных GetNodes().
+// Бросает FormulaException, если узлы не образуют выражение.
+std::unique_ptr<FormulaInterface> BuildFormula(const std::vector<FormulaNode>& nodes);
\ No newline at end of file
@@ -0,0 +1,117 @@
+﻿#include "formula_pool.h"
+
+#include <algorithm>
+#include <unordered_set>
+
+// ----------------------------------- class FormulaPool -------------------------------------------------
+
+// готовая формула либо результат разбора для ячейки в позиции anchor
+FormulaPool::SharedFormula FormulaPool::Intern(const std::string& expression, Position anchor) {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        // та же строка уже вводилась - разбор не нужен
+        if (auto shared = FindAbsolute(expression)) {
+            return *shared;
+        }
+    }
+
+    // та же строка, сдвинутая вместе с ячейкой, - соседняя формула заполненного столбца
+    std::optional<std::string> relative = MakeRelativeKey(expression, anchor);
+    if (relative) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (Handle formula = FindRelative(*relative)) {
+            _absolute[expression] = { formula, anchor };
+            return { formula, anchor };
+        }
+    }
+
+    // разбор идёт без блокировки, исключение о некорректной формуле таблицу не затрагивает
+    Handle parsed = ParseFormula(expression, anchor);
+    std::string absolute_key = parsed->GetAbsoluteKey(anchor);
+    std::string relative_key = parsed->GetRelativeKey();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (_absolute.size() + _relative.size() >= _sweep_limit) {
+        Sweep();
+    }
+
+    // сначала ищется то же выражение по адресам, затем то же выражение со сдвигом, иначе регистрируется новое
+    SharedFormula result{ parsed, anchor };
+    if (auto shared = FindAbsolute(absolute_key)) {
+        result = *shared;
+    }
+    else if (Handle formula = FindRelative(relative_key)) {
+        result.formula = formula;
+    }
+
+    _absolute[expression] = { result.formula, result.anchor };
+    _absolute[absolute_key] = { result.formula, result.anchor };
+    // относительные ключи верны только для формулы, вычисляемой от якоря этой ячейки
+    if (result.anchor == anchor) {
+        _relative[relative_key] = result.formula;
+        if (relative) {
+            _relative[*relative] = result.formula;
+        }
+    }
+    return result;
+}
+
+// количество живых различных формул
+std::size_t FormulaPool::Size() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    std::unordered_set<const FormulaInterface*> alive;
+    for (const auto& [key, entry] : _absolute) {
+        if (Handle formula = entry.formula.lock()) {
+            alive.insert(formula.get());
+        }
+    }
+    for (const auto& [key, entry] : _relative) {
+        if (Handle formula = entry.lock()) {
+            alive.insert(formula.get());
+        }
+    }
+    return alive.size();
+}
+
+// живая формула по абсолютному ключу
+std::optional<FormulaPool::SharedFormula> FormulaPool::FindAbsolute(const std::string& key) const {
+    auto found = _absolute.find(key);
+    if (found == _absolute.end()) {
+        return std::nullopt;
+    }
+    if (Handle formula = found->second.formula.lock()) {
+        return SharedFormula{ std::move(formula), found->second.anchor };
+    }
+    return std::nullopt;
+}
+
+// живая формула по относительному ключу
+FormulaPool::Handle FormulaPool::FindRelative(const std::string& key) const {
+    auto found = _relative.find(key);
+    return found != _relative.end() ? found->second.lock() : nullptr;
+}
+
+// удалить записи умерших формул
+void FormulaPool::Sweep() {
+    for (auto it = _absolute.begin(); it != _absolute.end();) {
+        if (it->second.formula.expired()) {
+            it = _absolute.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    for (auto it = _relative.begin(); it != _relative.end();) {
+        if (it->second.expired()) {
+            it = _relative.erase(it);
+        }
+        else {
+            ++it;
+        }
+    }
+    // следующая чистка - когда таблица снова вырастет вдвое
+    _sweep_limit = std::max<std::size_t>(1024, (_absolute.size() + _relative.size()) * 2);
+}
+
+// ----------------------------------- class FormulaPool END ---------------------------------------------
@@ -0,0 +1,61 @@
+﻿#pragma once
+
+#include "formula.h"
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+// Таблица интернирования формул.
+// Одинаковые выражения разделяют один неизменяемый разобранный и скомпилированный объект формулы, ячейки
+// держат на него счётные ссылки, а результат вычисления кешируют каждая у себя.
+// Формула хранит ссылки смещениями от базового якоря, поэтому разделяется двумя способами:
+// * по абсолютному ключу - то же выражение с теми же адресами, базовый якорь берётся из записи;
+// * по относительному ключу R[строка]C[столбец] - то же выражение, сдвинутое вместе с ячейкой, как при
+//   заполнении столбца однотипной формулой, якорем становится сама ячейка.
+// Ключи строятся по дереву выражения (все скобки, точная запись чисел): печать формулы для них не годится,
+// она округляет числа и опускает скобки, так что 0.1+(0.2+0.3) и 0.1+0.2+0.3 совпали бы.
+// Кроме ключей запоминаются исходный текст и его относительная запись, поэтому повторный ввод строки и
+// соседние формулы столбца обходятся без разбора.
+// Таблица не продлевает жизнь формул: записи хранят слабые ссылки и периодически вычищаются.
+// Таблица может разделяться копиями листа, доступ к ней защищён мьютексом.
+class FormulaPool {
+public:
+    using Handle = std::shared_ptr<const FormulaInterface>;
+
+    // формула и якорь, относительно которого ячейка её вычисляет и печатает
+    struct SharedFormula {
+        Handle formula;
+        Position anchor;
+    };
+
+    FormulaPool() = default;
+
+    FormulaPool(const FormulaPool&) = delete;
+    FormulaPool& operator=(const FormulaPool&) = delete;
+
+    // готовая формула либо результат разбора для ячейки в позиции anchor
+    SharedFormula Intern(const std::string& expression, Position anchor = Position(0, 0));
+    std::size_t Size() const;                                                         // количество живых различных формул
+
+private:
+    struct AbsoluteEntry {
+        std::weak_ptr<const FormulaInterface> formula;
+        Position anchor;
+    };
+
+    using AbsoluteEntries = std::unordered_map<std::string, AbsoluteEntry>;
+    using RelativeEntries = std::unordered_map<std::string, std::weak_ptr<const FormulaInterface>>;
+
+    mutable std::mutex _mutex;
+    AbsoluteEntries _absolute;                                                        // исходные выражения и ключи деревьев
+    RelativeEntries _relative;                                                        // их записи со смещениями от якоря
+    std::size_t _sweep_limit = 1024;                                                  // размер, при котором чистятся устаревшие записи
+
+    std::optional<SharedFormula> FindAbsolute(const std::string& key) const;          // живая формула по абсолютному ключу
+    Handle FindRelative(const std::string& key) const;                                // живая формула по относительному ключу
+    void Sweep();                                                                     // удалить записи умерших формул
+};
@@ -373,7 +373,13 @@ namespace {
     }
 }   // namespace
 
-int main() {
+int main(int argc, char* argv[]) {
+    if (argc > 1 && std::string_view(argv[1]) == "--bench") {
+        // замеры производительности вместо тестов
+        unit_tests::RunAllBenchmarks();
+        return 0;
+    }
+
     TestRunner tr;
     RUN_TEST(tr, TestPositionAndStringConversion);
     RUN_TEST(tr, TestPositionToStringInvalid);
@@ -0,0 +1,145 @@
+﻿#include "output_buffer.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <climits>
+#include <cstring>
+#include <string>
+#include <utility>
+
+#if defined(_MSC_VER)
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+// ----------------------------------- class OutputBuffer ------------------------------------------------
+
+OutputBuffer::OutputBuffer()
+    : _buffer(DEFAULT_CAPACITY) {
+}
+
+OutputBuffer::OutputBuffer(std::ostream& output, std::size_t capacity)
+    : _buffer(std::max<std::size_t>(capacity, 64)), _stream(&output) {
+}
+
+OutputBuffer::OutputBuffer(int fd, std::size_t capacity)
+    : _buffer(std::max<std::size_t>(capacity, 64)), _fd(fd) {
+    if (fd < 0) {
+        throw OutputException("ERROR::OutputBuffer()::file descriptor is not valid::" + std::to_string(__LINE__));
+    }
+}
+
+OutputBuffer::~OutputBuffer() {
+    try {
+        Flush();
+    }
+    catch (...) {
+        // деструктор не бросает, о потере вывода сообщает только явный Flush()
+    }
+}
+
+// записать символ
+void OutputBuffer::Put(char symbol) {
+    *Reserve(1) = symbol;
+    ++_used;
+}
+
+// записать строку
+void OutputBuffer::Write(std::string_view text) {
+    while (!text.empty()) {
+        const std::size_t count = std::min(text.size(), _buffer.size());
+        std::memcpy(Reserve(count), text.data(), count);
+        _used += count;
+        text.remove_prefix(count);
+    }
+}
+
+// записать символ count раз
+void OutputBuffer::Fill(char symbol, std::size_t count) {
+    while (count > 0) {
+        const std::size_t part = std::min(count, _buffer.size());
+        std::memset(Reserve(part), symbol, part);
+        _used += part;
+        count -= part;
+    }
+}
+
+// записать число как operator<<(double)
+void OutputBuffer::Number(double value) {
+    // "%g" с точностью 6 занимает не больше 13 символов: знак, 6 цифр, точка и порядок e-308
+    static const std::size_t max_length = 32;
+    char* begin = Reserve(max_length);
+    auto [end, ec] = std::to_chars(begin, begin + max_length, value, std::chars_format::general, 6);
+    if (ec != std::errc()) {
+        throw OutputException("ERROR::OutputBuffer::Number()::number does not fit::" + std::to_string(__LINE__));
+    }
+    _used += static_cast<std::size_t>(end - begin);
+}
+
+// записать ошибку формулы
+void OutputBuffer::Error(FormulaError error) {
+    Write(error.ToString());
+}
+
+// отдать накопленное приёмнику
+void OutputBuffer::Flush() {
+    // без приёмника вывод остаётся в памяти до Clear()
+    if (_used == 0 || (!_stream && _fd < 0)) {
+        return;
+    }
+
+    // буфер считается отданным и при ошибке, чтобы деструктор не повторял запись
+    const std::size_t count = std::exchange(_used, 0);
+
+    if (_stream) {
+        // об ошибке записи говорит состояние потока, как и при обычном выводе в него
+        _stream->write(_buffer.data(), static_cast<std::streamsize>(count));
+        return;
+    }
+
+    // write() может записать меньше запрошенного, дописываем остаток
+    const char* data = _buffer.data();
+    std::size_t left = count;
+    while (left > 0) {
+#if defined(_MSC_VER)
+        const int written = _write(_fd, data, static_cast<unsigned>(std::min<std::size_t>(left, INT_MAX)));
+#else
+        const auto written = ::write(_fd, data, left);
+#endif
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            throw OutputException("ERROR::OutputBuffer::Flush()::" + std::string(std::strerror(errno)) + "::" + std::to_string(__LINE__));
+        }
+        data += written;
+        left -= static_cast<std::size_t>(written);
+    }
+}
+
+// накопленные и ещё не отданные байты
+std::string_view OutputBuffer::View() const {
+    return { _buffer.data(), _used };
+}
+
+// забыть накопленное, память сохраняется
+void OutputBuffer::Clear() {
+    _used = 0;
+}
+
+// место под count байт, при нехватке сбрасывает либо растит буфер
+char* OutputBuffer::Reserve(std::size_t count) {
+    if (_buffer.size() - _used < count) {
+        if (_stream || _fd >= 0) {
+            Flush();
+        }
+        else {
+            _buffer.resize(std::max(_buffer.size() * 2, _used + count));
+        }
+    }
+    return _buffer.data() + _used;
+}
+
+// ----------------------------------- class OutputBuffer END --------------------------------------------
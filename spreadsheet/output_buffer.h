@@ -0,0 +1,54 @@
+﻿#pragma once
+
+#include "common.h"
+
+#include <cstddef>
+#include <ostream>
+#include <stdexcept>
+#include <string_view>
+#include <vector>
+
+// Исключение, выбрасываемое при ошибке записи накопленного вывода
+class OutputException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Буфер вывода печатной области. Байты копятся в собственном буфере и уходят приёмнику крупными
+// порциями: в поток через один write() или прямо в файловый дескриптор, минуя iostream.
+// Числа форматируются через std::to_chars, как "%g" с точностью 6 и независимо от локали,
+// поэтому вывод совпадает с operator<<(double) потока по умолчанию. Буфер можно переиспользовать
+// для нескольких выводов подряд, его память сохраняется между сбросами.
+// Буфер без приёмника накапливает весь вывод в памяти, растя по мере надобности: так части
+// выгрузки готовятся независимо и затем переписываются в общий вывод по порядку
+class OutputBuffer {
+public:
+    static const std::size_t DEFAULT_CAPACITY = std::size_t(1) << 16;                // 64 КиБ
+
+    OutputBuffer();                                                                   // вывод в память
+    explicit OutputBuffer(std::ostream& /*output*/, std::size_t capacity = DEFAULT_CAPACITY); // вывод в поток
+    explicit OutputBuffer(int /*fd*/, std::size_t capacity = DEFAULT_CAPACITY);      // вывод в открытый файловый дескриптор
+    ~OutputBuffer();                                                                  // сбрасывает остаток, ошибки глушатся
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    void Put(char /*symbol*/);                                                        // записать символ
+    void Write(std::string_view /*text*/);                                            // записать строку
+    void Fill(char /*symbol*/, std::size_t /*count*/);                                // записать символ count раз
+    void Number(double /*value*/);                                                    // записать число как operator<<(double)
+    void Error(FormulaError /*error*/);                                               // записать ошибку формулы
+
+    void Flush();                                                                     // отдать накопленное приёмнику
+
+    std::string_view View() const;                                                    // накопленные и ещё не отданные байты
+    void Clear();                                                                     // забыть накопленное, память сохраняется
+
+private:
+    std::vector<char> _buffer;                                                        // накопленные байты, ёмкость постоянна
+    std::size_t _used = 0;                                                            // занято байт буфера
+    std::ostream* _stream = nullptr;                                                  // приёмник-поток
+    int _fd = -1;                                                                     // приёмник-дескриптор
+
+    char* Reserve(std::size_t /*count*/);                                             // место под count байт, при нехватке сбрасывает либо растит буфер
+};
@@ -2,11 +2,20 @@
 
 #include "cell.h"
 #include "common.h"
+#include "snapshot.h"
+#include "worker_pool.h"
 
 #include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <fstream>
 #include <functional>
 #include <iostream>
+#include <iterator>
 #include <optional>
+#include <thread>
+#include <unordered_map>
+#include <utility>
 //#include <execution>
 
 using namespace std::literals;
@@ -14,42 +23,29 @@ using namespace std::literals;
 // ----------------------------------- class Sheet -------------------------------------------------------
 
 Sheet::~Sheet() {
-    for (auto& cell : _data) {
-        if (cell.second) {
-            cell.second.release()->~Cell();
-        }
-    }
+    // хранилище само разрушит свои ячейки. Блоки, общие с копиями, переживают лист,
+    // но их ячейки посчитаны и к листу не обращаются: связь больше не указывает на него
+    _data.Bind(nullptr);
 }
 
 // конструктор копирования
 Sheet::Sheet(const Sheet& other)
-    : _print(other._print), _ps_flag(other._ps_flag) {
-
-    for (const auto& item : other._data) {
-        SetCell(item.first, item.second->GetTextData());
-    }
+    : _data(other.SharedData())
+    , _formulas(other._formulas)
+    , _graph(other._graph)
+    , _version(other._version) {
+    // ячейки не копируются и формулы не разбираются: новые ячейки копии будут ссылаться на неё
+    _data.Bind(this);
 }
 // оператор присваивания
 Sheet& Sheet::operator=(const Sheet& other) {
 
     // исключаем самокопирование
-    if (*this != other && !IsEqual(other)) {
-
-        // для начала удаляем имеющиеся данные и освобождаем память
-        EraseSheet();
-
-        // перезабиваем таблицу по новой
-        for (const auto& item : other._data) {
-            SetCell(item.first, item.second->GetTextData());
-        }
-
-        // если у исходного с печатной областью всё ок, то берем её
-        // иначе всё равно придётся пересчитывать
-        if (other._ps_flag == PSizeFlag::actual) {
-            // перезаписываем размер печатной области
-            _print = other._print;
-            _ps_flag = PSizeFlag::actual;
-        }
+    if (this != &other) {
+        // копия строится до изменения таблицы и обменивается с ней, открытый пакет правок остаётся таблице
+        Sheet copy(other);
+        copy._batch = std::move(_batch);
+        SwapSheet(copy);
     }
     return *this;
 }
@@ -57,43 +53,563 @@ Sheet& Sheet::operator=(const Sheet& other) {
 // конструктор перемещения
 Sheet::Sheet(Sheet&& other) noexcept
     : _data(std::move(other._data))
-    , _print(std::move(other._print))
-    , _ps_flag(std::move(other._ps_flag)) {
+    , _formulas(std::move(other._formulas))
+    , _graph(std::move(other._graph))
+    , _batch(std::move(other._batch))
+    , _touched_bits(std::move(other._touched_bits))
+    , _touched(std::move(other._touched))
+    , _touched_all(other._touched_all)
+    , _version(other._version) {
+    // ячейки переезжают вместе со связью, связь теперь указывает на новую таблицу
+    _data.Bind(this);
 }
 // оператор перемещения
 Sheet& Sheet::operator=(Sheet&& other) noexcept {
 
     // исключаем самокопирование
-    if (*this != other && !IsEqual(other)) {
+    if (this != &other) {
         _data = std::move(other._data);
-
-        _print = std::move(other._print);
-        _ps_flag = std::move(other._ps_flag);
+        _data.Bind(this);
+        _formulas = std::move(other._formulas);
+        _graph = std::move(other._graph);
+        _batch = std::move(other._batch);
+        _touched_bits = std::move(other._touched_bits);
+        _touched = std::move(other._touched);
+        _touched_all = other._touched_all;
+        // номер состояния не убывает: опубликованные версии остаются у таблицы
+        _version = std::max(_version, other._version) + 1;
     }
     return *this;
 }
 
 // конструктор из вектора строк
 Sheet::Sheet(SheetData&& data)
-    : _data(std::move(data)) {
+    : _data(std::move(data))
+    , _touched_all(true) {
+    _data.Bind(this);
 }
 
 void Sheet::SetCell(Position pos, std::string text) {
 
-    // для начала проверяем может быть такая ячейка вообще есть
-    // внутренний метод IsValid() возвращает true, если ячейка существует, false, если нет
-    // и пробразывает исключение о выходе за пределы при out of limmit
-    if (!IsValid(pos)) {
-        // если же такой ячейки еще не было, то просто создаём новую
-        _data[pos] = std::make_unique<Cell>(*this, pos);
+    if (_batch) {
+        // в открытом пакете правка только запоминается, позиция проверяется сразу
+        if (!pos.IsValid()) {
+            throw InvalidPositionException("incoming POS is not Valid::" + std::to_string(__LINE__));
+        }
+        _batch->push_back({ pos, std::move(text) });
+        return;
     }
 
+    // берём существующую ячейку либо создаём новую, при выходе за пределы пробрасывается исключение
     // загружаем в неё данные, а там уже разберутся, что ресетить, что удалять и вообще как с этим быть
-    _data.at(pos)->SetData(text);
-    // также после имплементации, если всё окей, обновляем печатный размер
-    _ps_flag = PrintSizeManager(pos, OpFlag::set);
-    // также, после всех манипуляций, проверяем - а не была ли новая созданная ячейка в пуле на добавление зависимостей
-    UpdateFutureReferences(pos);
+    try {
+        GetOrCreateCell(pos)->SetData(text);
+    }
+    catch (...) {
+        // созданная под неудачную правку ячейка не должна расширять область печати
+        EraseIfRaw(pos);
+        throw;
+    }
+}
+
+// назначить ячейки пакетом
+void Sheet::SetCells(std::vector<CellUpdate> updates, unsigned threads) {
+    // размер пакета, начиная с которого строки разбираются параллельно
+    static const std::size_t parallel_min = 4096;
+
+    // позиции проверяются до любых изменений
+    for (const auto& update : updates) {
+        if (!update.first.IsValid()) {
+            throw InvalidPositionException("incoming POS is not Valid::" + std::to_string(__LINE__));
+        }
+    }
+
+    // разбор всех строк: исключение формулы выходит до изменения листа. Разбор ячеек независим,
+    // таблица формул потокобезопасна, поэтому крупный пакет разбирается на всех ядрах
+    std::vector<Cell::Draft> drafts(updates.size());
+    std::function<void(std::size_t)> parse = [&](std::size_t i) {
+        drafts[i] = Cell::Parse(*this, updates[i].first, std::move(updates[i].second));
+    };
+
+    // таблица формул листа создаётся до запуска потоков
+    GetFormulaPool();
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (updates.size() < parallel_min || threads == 1) {
+        for (std::size_t i = 0; i != updates.size(); ++i) {
+            parse(i);
+        }
+    }
+    else {
+        WorkerPool(threads).Run(updates.size(), parse);
+    }
+
+    std::vector<DependencyGraph::PrecedentsUpdate> links;
+    links.reserve(updates.size());
+    // позиции, у которых появится либо пропадёт зависимая: прежние и новые ссылки без общих
+    std::vector<Position> changed;
+    for (std::size_t i = 0; i != updates.size(); ++i) {
+        links.push_back({ updates[i].first, drafts[i].GetReferencedCells() });
+
+        std::vector<Position> current = std::as_const(*this).GetDependencyGraph().GetPrecedents(updates[i].first);
+        std::vector<Position> next = links.back().second;
+        std::sort(current.begin(), current.end());
+        std::sort(next.begin(), next.end());
+        next.erase(std::unique(next.begin(), next.end()), next.end());
+        std::set_symmetric_difference(current.begin(), current.end(), next.begin(), next.end(), std::back_inserter(changed));
+    }
+
+    // ссылки пакета заменяются в графе разом, цикл отменяет весь пакет
+    if (!GetDependencyGraph().SetPrecedents(links)) {
+        throw CircularDependencyException("IsCyclicDependency");
+    }
+
+    // ячейка блока, общего с копией, отвечает о зависимых по графу, с которым блок стал общим,
+    // поэтому блоки ячеек с изменившимися зависимыми лист забирает себе
+    for (Position pos : changed) {
+        _data.Own(pos);
+    }
+
+    // содержимое записывается по порядку, при повторе позиции остаётся последняя правка
+    for (std::size_t i = 0; i != drafts.size(); ++i) {
+        GetOrCreateCell(links[i].first)->Apply(std::move(drafts[i]));
+    }
+
+    // кеши зависимых сбрасываются, когда записан весь пакет: обход останавливается на уже сброшенных
+    for (const auto& link : links) {
+        GetDirectCell(link.first)->ClearCache();
+    }
+}
+
+// начать пакет правок
+void Sheet::BeginBatch() {
+    if (_batch) {
+        throw SheetError("ERROR::BeginBatch()::batch is already active::" + std::to_string(__LINE__));
+    }
+    _batch.emplace();
+}
+// применить пакет, при исключении он отбрасывается
+void Sheet::Commit() {
+    if (!_batch) {
+        throw SheetError("ERROR::Commit()::no active batch::" + std::to_string(__LINE__));
+    }
+    std::vector<CellUpdate> updates = std::move(*_batch);
+    _batch.reset();
+    SetCells(std::move(updates));
+}
+// отбросить накопленные правки
+void Sheet::Rollback() {
+    _batch.reset();
+}
+// флаг открытого пакета правок
+bool Sheet::IsBatchActive() const {
+    return _batch.has_value();
+}
+
+// загрузить ячейки из текста в формате PrintTexts()
+void Sheet::LoadTexts(std::istream& input, unsigned threads) {
+    // размер порции чтения
+    static const std::size_t read_size = std::size_t(1) << 20;
+
+    // текст читается порциями, минуя форматированный ввод. Порция разбирается до последнего переноса строки,
+    // незаконченная строка переходит в следующую порцию, поэтому весь текст в памяти не собирается
+    std::vector<CellUpdate> updates;
+    std::string chunk;
+    int row = 0;
+    while (input) {
+        const std::size_t used = chunk.size();
+        chunk.resize(used + read_size);
+        input.read(chunk.data() + used, static_cast<std::streamsize>(read_size));
+        chunk.resize(used + static_cast<std::size_t>(input.gcount()));
+
+        // в конце ввода разбирается весь остаток, строка длиннее порции копится дальше
+        std::size_t lines_end = chunk.size();
+        if (input) {
+            const std::size_t newline = chunk.rfind('\n');
+            lines_end = newline == std::string::npos ? 0 : newline + 1;
+        }
+        if (lines_end != 0) {
+            row += SplitTexts(std::string_view(chunk.data(), lines_end), row, threads, updates);
+            chunk.erase(0, lines_end);
+        }
+    }
+    if (input.bad()) {
+        throw SheetError("ERROR::LoadTexts()::input read failed::" + std::to_string(__LINE__));
+    }
+
+    ApplyTexts(std::move(updates), threads);
+}
+// загрузить ячейки из файла в формате PrintTexts()
+void Sheet::LoadTexts(const std::string& path, unsigned threads) {
+    // файл отображается в память и делится на куски прямо в отображении, без копирования текста
+    std::optional<MappedFile> file;
+    try {
+        file.emplace(path);
+    }
+    catch (const SnapshotException&) {
+        throw SheetError("ERROR::LoadTexts()::cannot open " + path + "::" + std::to_string(__LINE__));
+    }
+
+    std::vector<CellUpdate> updates;
+    SplitTexts(std::string_view(file->Data(), file->Size()), 0, threads, updates);
+    file.reset();
+
+    ApplyTexts(std::move(updates), threads);
+}
+// записать загруженные ячейки одним пакетом либо добавить их в открытый пакет
+void Sheet::ApplyTexts(std::vector<CellUpdate> updates, unsigned threads) {
+    if (_batch) {
+        // открытый пакет принимает загрузку как обычные правки
+        _batch->insert(_batch->end(), std::make_move_iterator(updates.begin()), std::make_move_iterator(updates.end()));
+        return;
+    }
+    SetCells(std::move(updates), threads);
+}
+
+// записать двоичный снимок листа
+void Sheet::SaveSnapshot(const std::string& path) const {
+    std::vector<snapshot::Formula> formulas;
+    std::vector<snapshot::Node> nodes;
+    std::vector<snapshot::Cell> cells;
+    std::vector<snapshot::Edge> edges;
+    std::string texts;
+
+    // формулы, разделяемые ячейками, записываются один раз
+    std::unordered_map<const FormulaInterface*, std::uint32_t> formula_index;
+    cells.reserve(_data.Size());
+
+    for (auto [pos, cell] : _data) {
+        if (cell->IsRaw()) {
+            continue;
+        }
+
+        snapshot::Cell record{};
+        record.row = pos.row;
+        record.col = pos.col;
+        record.text_offset = texts.size();
+        record.text_size = static_cast<std::uint32_t>(cell->GetTextData().size());
+        record.formula = snapshot::NO_FORMULA;
+        texts += cell->GetTextData();
+
+        if (const FormulaImpl* formula = cell->GetFormulaData()) {
+            auto [it, inserted] = formula_index.emplace(formula->GetFormula(), static_cast<std::uint32_t>(formulas.size()));
+            if (inserted) {
+                const std::vector<FormulaNode> formula_nodes = formula->GetFormula()->GetNodes();
+                formulas.push_back({ nodes.size(), static_cast<std::uint32_t>(formula_nodes.size()), 0 });
+                for (const FormulaNode& node : formula_nodes) {
+                    nodes.push_back({ node.number, node.cell.row, node.cell.col, static_cast<std::uint8_t>(node.kind), {} });
+                }
+            }
+            record.formula = it->second;
+            record.anchor_row = formula->GetAnchor().row;
+            record.anchor_col = formula->GetAnchor().col;
+
+            if (const auto& cache = formula->GetCache()) {
+                if (const double* value = std::get_if<double>(&*cache)) {
+                    record.cache = static_cast<std::uint8_t>(snapshot::CacheKind::number);
+                    record.value = *value;
+                }
+                else {
+                    record.cache = static_cast<std::uint8_t>(snapshot::CacheKind::error);
+                    record.error = static_cast<std::uint8_t>(std::get<FormulaError>(*cache).GetCategory());
+                }
+            }
+
+            GetDependencyGraph().ForEachPrecedent(pos, [&](Position precedent) {
+                edges.push_back({ precedent.row, precedent.col });
+                ++record.edge_count;
+            });
+        }
+        cells.push_back(record);
+    }
+
+    const Size print = GetPrintableSize();
+    snapshot::Header header{};
+    std::copy(std::begin(snapshot::MAGIC), std::end(snapshot::MAGIC), header.magic);
+    header.version = snapshot::VERSION;
+    header.byte_order = snapshot::ENDIAN_MARK;
+    header.rows = print.rows;
+    header.cols = print.cols;
+    header.formulas = formulas.size();
+    header.nodes = nodes.size();
+    header.cells = cells.size();
+    header.edges = edges.size();
+    header.text_bytes = texts.size();
+
+    std::ofstream output(path, std::ios::binary | std::ios::trunc);
+    auto write = [&output](const void* data, std::size_t size) {
+        output.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+    };
+    write(&header, sizeof(header));
+    write(formulas.data(), formulas.size() * sizeof(snapshot::Formula));
+    write(nodes.data(), nodes.size() * sizeof(snapshot::Node));
+    write(cells.data(), cells.size() * sizeof(snapshot::Cell));
+    write(edges.data(), edges.size() * sizeof(snapshot::Edge));
+    write(texts.data(), texts.size());
+    output.close();
+
+    if (!output) {
+        throw SnapshotException("ERROR::SaveSnapshot()::cannot write " + path + "::" + std::to_string(__LINE__));
+    }
+}
+
+// загрузить двоичный снимок листа
+void Sheet::LoadSnapshot(const std::string& path) {
+    if (_batch) {
+        throw SheetError("ERROR::LoadSnapshot()::batch is active::" + std::to_string(__LINE__));
+    }
+
+    MappedFile file(path);
+    auto corrupted = [&path](int line) {
+        return SnapshotException("ERROR::LoadSnapshot()::" + path + " is not a valid snapshot::" + std::to_string(line));
+    };
+
+    // заголовок и размеры массивов проверяются до любого обращения к записям
+    snapshot::Header header;
+    if (file.Size() < sizeof(header)) {
+        throw corrupted(__LINE__);
+    }
+    std::memcpy(&header, file.Data(), sizeof(header));
+    if (!std::equal(std::begin(snapshot::MAGIC), std::end(snapshot::MAGIC), header.magic)
+        || header.byte_order != snapshot::ENDIAN_MARK || header.version != snapshot::VERSION) {
+        throw SnapshotException("ERROR::LoadSnapshot()::" + path + " has unsupported format or version::" + std::to_string(__LINE__));
+    }
+
+    // каждый массив не длиннее файла, поэтому сумма размеров не переполняется
+    const std::uint64_t limit = file.Size();
+    if (header.formulas > limit / sizeof(snapshot::Formula) || header.nodes > limit / sizeof(snapshot::Node)
+        || header.cells > limit / sizeof(snapshot::Cell) || header.edges > limit / sizeof(snapshot::Edge)
+        || header.text_bytes > limit) {
+        throw corrupted(__LINE__);
+    }
+    const std::uint64_t formulas_at = sizeof(header);
+    const std::uint64_t nodes_at = formulas_at + header.formulas * sizeof(snapshot::Formula);
+    const std::uint64_t cells_at = nodes_at + header.nodes * sizeof(snapshot::Node);
+    const std::uint64_t edges_at = cells_at + header.cells * sizeof(snapshot::Cell);
+    const std::uint64_t texts_at = edges_at + header.edges * sizeof(snapshot::Edge);
+    if (texts_at + header.text_bytes != limit) {
+        throw corrupted(__LINE__);
+    }
+
+    // отображение выровнено по странице, записи - на 8 байт, поэтому массивы читаются на месте
+    const auto* formulas = reinterpret_cast<const snapshot::Formula*>(file.Data() + formulas_at);
+    const auto* nodes = reinterpret_cast<const snapshot::Node*>(file.Data() + nodes_at);
+    const auto* cells = reinterpret_cast<const snapshot::Cell*>(file.Data() + cells_at);
+    const auto* edges = reinterpret_cast<const snapshot::Edge*>(file.Data() + edges_at);
+    const char* texts = file.Data() + texts_at;
+
+    // формулы собираются из узлов, текст не разбирается
+    std::vector<std::shared_ptr<const FormulaInterface>> built(header.formulas);
+    std::vector<FormulaNode> formula_nodes;
+    for (std::uint64_t i = 0; i != header.formulas; ++i) {
+        if (formulas[i].first_node > header.nodes || formulas[i].node_count > header.nodes - formulas[i].first_node) {
+            throw corrupted(__LINE__);
+        }
+        formula_nodes.clear();
+        for (std::uint64_t n = formulas[i].first_node; n != formulas[i].first_node + formulas[i].node_count; ++n) {
+            // смещение ссылки короче размера листа, поэтому якорь со смещением не переполняет int
+            if (nodes[n].kind == static_cast<std::uint8_t>(FormulaNode::Kind::Cell)
+                && (nodes[n].row <= -Position::MAX_ROWS || nodes[n].row >= Position::MAX_ROWS
+                    || nodes[n].col <= -Position::MAX_COLS || nodes[n].col >= Position::MAX_COLS)) {
+                throw corrupted(__LINE__);
+            }
+            FormulaNode node;
+            node.kind = static_cast<FormulaNode::Kind>(nodes[n].kind);
+            node.cell = Position(nodes[n].row, nodes[n].col);
+            node.number = nodes[n].number;
+            formula_nodes.push_back(node);
+        }
+        try {
+            built[i] = BuildFormula(formula_nodes);
+        }
+        catch (const FormulaException&) {
+            throw corrupted(__LINE__);
+        }
+    }
+
+    // записи ячеек и рёбра графа
+    std::vector<DependencyGraph::PrecedentsUpdate> links;
+    std::vector<Position> stored;
+    std::unordered_map<Position, std::uint64_t, PositionHasher> records;              // позиция - номер записи
+    records.reserve(header.cells);
+    Size extent = { 0, 0 };
+    std::uint64_t edge = 0;
+    for (std::uint64_t i = 0; i != header.cells; ++i) {
+        const snapshot::Cell& record = cells[i];
+        const Position pos(record.row, record.col);
+        if (!pos.IsValid() || record.text_offset > header.text_bytes || record.text_size > header.text_bytes - record.text_offset
+            || (record.formula != snapshot::NO_FORMULA && record.formula >= header.formulas)
+            || record.edge_count > header.edges - edge) {
+            throw corrupted(__LINE__);
+        }
+        // кеш есть только у формулы, его вид и категория ошибки - из известных значений
+        if (record.cache > static_cast<std::uint8_t>(snapshot::CacheKind::error)
+            || (record.cache != static_cast<std::uint8_t>(snapshot::CacheKind::none) && record.formula == snapshot::NO_FORMULA)
+            || (record.cache == static_cast<std::uint8_t>(snapshot::CacheKind::error)
+                && record.error > static_cast<std::uint8_t>(FormulaError::Category::Div0))) {
+            throw corrupted(__LINE__);
+        }
+        // позиция встречается один раз, иначе вторая запись молча заменила бы первую
+        if (!records.emplace(pos, i).second) {
+            throw corrupted(__LINE__);
+        }
+        extent = { std::max(extent.rows, pos.row + 1), std::max(extent.cols, pos.col + 1) };
+
+        // рёбра не берутся на веру: они обязаны совпасть со ссылками восстановленной формулы от её якоря
+        std::vector<Position> precedents;
+        if (record.formula != snapshot::NO_FORMULA) {
+            const Position anchor(record.anchor_row, record.anchor_col);
+            if (!anchor.IsValid()) {
+                throw corrupted(__LINE__);
+            }
+            precedents = built[record.formula]->GetReferencedCells(anchor);
+        }
+        if (record.edge_count != precedents.size()) {
+            throw corrupted(__LINE__);
+        }
+
+        if (!precedents.empty()) {
+            stored.clear();
+            for (std::uint32_t e = 0; e != record.edge_count; ++e, ++edge) {
+                stored.push_back(Position(edges[edge].row, edges[edge].col));
+            }
+            std::sort(stored.begin(), stored.end());
+            if (stored != precedents) {
+                throw corrupted(__LINE__);
+            }
+            links.push_back({ pos, std::move(precedents) });
+        }
+    }
+    if (edge != header.edges || extent.rows != header.rows || extent.cols != header.cols) {
+        throw corrupted(__LINE__);
+    }
+
+    // формула посчитана только после своих влияющих формул: на этом держится сброс кешей зависимых при правке
+    const auto uncached_formula = [&](Position pos) {
+        auto found = records.find(pos);
+        return found != records.end() && cells[found->second].formula != snapshot::NO_FORMULA
+            && cells[found->second].cache == static_cast<std::uint8_t>(snapshot::CacheKind::none);
+    };
+    for (const auto& [pos, precedents] : links) {
+        if (cells[records.at(pos)].cache != static_cast<std::uint8_t>(snapshot::CacheKind::none)
+            && std::any_of(precedents.begin(), precedents.end(), uncached_formula)) {
+            throw corrupted(__LINE__);
+        }
+    }
+
+    // граф строится целиком с одной проверкой на циклы
+    DependencyGraph graph;
+    if (!graph.SetPrecedents(links)) {
+        throw corrupted(__LINE__);
+    }
+
+    // все проверки пройдены, старое содержимое заменяется
+    EraseSheet();
+    _graph = std::make_shared<DependencyGraph>(std::move(graph));
+    // ячейки снимка пишутся в хранилище напрямую, формулы без кеша подсчёт ищет по всему листу
+    _touched_all = true;
+    for (std::uint64_t i = 0; i != header.cells; ++i) {
+        const snapshot::Cell& record = cells[i];
+
+        std::optional<FormulaInterface::Value> cache;
+        if (record.cache == static_cast<std::uint8_t>(snapshot::CacheKind::number)) {
+            cache = record.value;
+        }
+        else if (record.cache == static_cast<std::uint8_t>(snapshot::CacheKind::error)) {
+            cache = FormulaError(static_cast<FormulaError::Category>(record.error));
+        }
+
+        const bool is_formula = record.formula != snapshot::NO_FORMULA;
+        _data.Emplace(Position(record.row, record.col), *this)->Apply(Cell::Restore(
+            std::string(texts + record.text_offset, record.text_size),
+            is_formula ? built[record.formula] : nullptr,
+            is_formula ? Position(record.anchor_row, record.anchor_col) : Position::NONE,
+            std::move(cache)));
+    }
+}
+
+// разбить строки текста PrintTexts() на правки ячеек начиная со строки листа first_row, вернуть число строк
+int Sheet::SplitTexts(std::string_view text, int first_row, unsigned threads, std::vector<CellUpdate>& updates) {
+    // наименьший кусок текста для отдельного потока и кусков на поток
+    static const std::size_t chunk_min = std::size_t(1) << 16;
+    static const std::size_t chunks_per_thread = 8;
+
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+
+    // куски начинаются с начала строки: граница сдвигается за ближайший перенос
+    const std::size_t chunks = std::max<std::size_t>(1, std::min(text.size() / chunk_min, threads * chunks_per_thread));
+    std::vector<std::size_t> bounds = { 0 };
+    for (std::size_t i = 1; i < chunks; ++i) {
+        std::size_t bound = std::max(bounds.back(), text.size() / chunks * i);
+        const void* newline = bound < text.size() ? std::memchr(text.data() + bound, '\n', text.size() - bound) : nullptr;
+        bound = newline ? static_cast<const char*>(newline) - text.data() + 1 : text.size();
+        if (bound != bounds.back()) {
+            bounds.push_back(bound);
+        }
+    }
+    bounds.push_back(text.size());
+
+    // кусок разбирается с номерами строк от своего начала, смещение добавляется после подсчёта строк всех кусков.
+    // Поиск разделителей - memchr, который стандартная библиотека реализует векторными инструкциями
+    std::vector<std::vector<CellUpdate>> parts(bounds.size() - 1);
+    std::vector<int> lines(parts.size(), 0);
+    std::function<void(std::size_t)> split = [&](std::size_t i) {
+        const char* cursor = text.data() + bounds[i];
+        const char* const end = text.data() + bounds[i + 1];
+
+        for (int row = 0; cursor != end; ++row) {
+            const char* line_end = static_cast<const char*>(std::memchr(cursor, '\n', end - cursor));
+            const char* next = line_end ? line_end + 1 : end;
+            if (!line_end) {
+                line_end = end;
+            }
+            if (line_end != cursor && line_end[-1] == '\r') {
+                --line_end;
+            }
+
+            for (int col = 0; ; ++col) {
+                const char* tab = static_cast<const char*>(std::memchr(cursor, '\t', line_end - cursor));
+                const char* field_end = tab ? tab : line_end;
+                if (field_end != cursor) {
+                    parts[i].push_back({ Position(row, col), std::string(cursor, field_end) });
+                }
+                if (!tab) {
+                    break;
+                }
+                cursor = tab + 1;
+            }
+
+            cursor = next;
+            lines[i] = row + 1;
+        }
+    };
+
+    if (parts.size() == 1) {
+        split(0);
+    }
+    else {
+        WorkerPool(threads).Run(parts.size(), split);
+    }
+
+    std::size_t total = updates.size();
+    for (const auto& part : parts) {
+        total += part.size();
+    }
+
+    updates.reserve(total);
+    int offset = first_row;
+    for (std::size_t i = 0; i != parts.size(); ++i) {
+        for (auto& update : parts[i]) {
+            update.first.row += offset;
+            updates.push_back(std::move(update));
+        }
+        offset += lines[i];
+        std::vector<CellUpdate>().swap(parts[i]);
+    }
+    return offset - first_row;
 }
 
 // скопировать ячейку из одной позиции в другую
@@ -105,32 +621,28 @@ void Sheet::CopyCell(Position from, Position to) {
         throw SheetError("ERROR::CopyCell()::POS from is not Valid::" + std::to_string(__LINE__));
     }
 
-    // внутренний метод IsValid() возвращает true, если ячейка существует, false, если нет
-    // и пробразывает исключение о выходе за пределы при out of limmit
-    if (!IsValid(to)) {
-        // если же такой ячейки еще не было, то просто создаём новую
-        _data[to] = std::make_unique<Cell>(*this, to);
-    }
-
     // копируем данные из одной в другую методом ячейки
-    _data.at(to)->Copy(*GetDirectCell(from));
-    // после имплементации, если всё окей, обновляем печатный размер
-    _ps_flag = PrintSizeManager(to, OpFlag::set);
+    try {
+        GetOrCreateCell(to)->Copy(*GetDirectCell(from));
+    }
+    catch (...) {
+        EraseIfRaw(to);
+        throw;
+    }
 }
 // переместить ячейку из одной позиции в другую
 void Sheet::MoveCell(Position from, Position to) {
 
-    // внутренний метод IsValid() возвращает true, если ячейка существует, false, если нет
-    // и пробразывает исключение о выходе за пределы при out of limmit
-    if (!IsValid(to)) {
-        // если же такой ячейки еще не было, то просто создаём новую
-        _data[to] = std::make_unique<Cell>(*this, to);
+    // переносим данные из одной в другую методом ячейки
+    try {
+        GetOrCreateCell(to)->Move(*GetDirectCell(from));
+        // исходная ячейка осталась без содержимого
+        _data.MarkChanged(from);
+    }
+    catch (...) {
+        EraseIfRaw(to);
+        throw;
     }
-
-    // копируем данные из одной в другую методом ячейки
-    _data.at(to)->Move(*GetDirectCell(from));
-    // после имплементации, если всё окей, обновляем печатный размер
-    _ps_flag = PrintSizeManager(to, OpFlag::set);
 }
 
 // выдаёт ячейку по позиции
@@ -151,18 +663,18 @@ const CellInterface* Sheet::GetCell(Position pos) const {
         ASSERT_EQUAL(sheet->GetCell("B2"_pos)->GetReferencedCells(), std::vector{ "B1"_pos });
 
         Мы создаём ячейку B2, которая ссылается на ещё не существующую ячейку B1, после чего у неё вызывается метод GetReferencedCells().
-        Данная реализация не позволяет это сделать, так как ячейки физически еще нет НО, упоминание о неё есть в FutureReferences _future_refs.
-        Таким образом поступим "хитро". В случае подобной ситуации можно будет вернуть "виртуальную" еще не существующую пустую ячейку _DUMMY
+        Ячейки физически еще нет НО, на её позицию ведут рёбра графа зависимостей.
+        Для такой позиции возвращается пустая ячейка-заглушка _pending без состояния, общая для всех ожидаемых позиций
     */
 
-    if (IsValid(pos)) {
-        // если позиция валидна - просто возвращаем ее
-        return _data.at(pos).get();
+    if (const Cell* cell = GetDirectCell(pos)) {
+        // если ячейка существует - просто возвращаем ее
+        return cell;
     }
 
-    else if (IsFutureDependendCell(pos)) {
-        // если позиция не валидна, но ожидаема - возвращаем загрушку
-        return const_cast<Sheet*>(this)->GetDummy(pos);
+    else if (GetDependencyGraph().HasDependents(pos)) {
+        // если ячейки нет, но на неё ссылаются - возвращаем загрушку
+        return &_pending;
     }
 
     else {
@@ -173,135 +685,309 @@ const CellInterface* Sheet::GetCell(Position pos) const {
 
 // выдаёт ячейку по позиции
 CellInterface* Sheet::GetCell(Position pos) {
-
-    if (IsValid(pos)) {
-        // если позиция валидна - просто возвращаем ее
-        return _data.at(pos).get();
-    }
-    else if (IsFutureDependendCell(pos)) {
-        // если позиция не валидна, но ожидаема - возвращаем загрушку
-        return const_cast<CellInterface*>(const_cast<Sheet*>(this)->GetDummy(pos));
-    }
-    else {
-        // иначе возвращаем nullptr
-        return nullptr;
-    }
+    // интерфейс ячейки только читает её, поэтому блок, общий с копией, не копируется
+    return const_cast<CellInterface*>(std::as_const(*this).GetCell(pos));
 }
 
 // выдаёт ячейку по позиции
 const Cell* Sheet::GetDirectCell(Position pos) const {
-    return IsValid(pos) ? _data.at(pos).get() : nullptr;
+    if (!pos.IsValid()) {
+        // если позиция в принципе не валидна то кидаем исключение
+        throw InvalidPositionException("incoming POS is not Valid::" + std::to_string(__LINE__));
+    }
+    return _data.Get(pos);
 }
 // выдаёт ячейку по позиции
 Cell* Sheet::GetDirectCell(Position pos) {
-    return IsValid(pos) ? _data.at(pos).get() : nullptr;
+    // позиция проверяется константной версией, ячейка блока, общего с копией, берётся из собственной копии блока
+    if (!std::as_const(*this).GetDirectCell(pos)) {
+        return nullptr;
+    }
+    // изменяемая ячейка может потерять кеш либо получить новую формулу
+    Touch(pos);
+    return _data.Own(pos);
 }
 
 // удаляет ячейку по позиции
 void Sheet::ClearCell(Position pos) {
-    if (IsValid(pos)) {
-        // если ячейка существует очищаем ее данные
-        _data.at(pos).release()->~Cell();
-        // удаляем позицию из массива данных, в целях экономии памяти
-        _data.erase(pos);
-        // обновляем флаг печатной области
-        PrintSizeManager(pos, OpFlag::clear);
+    if (Cell* cell = GetDirectCell(pos)) {
+        // ссылки ячейки уходят из графа и кеши зависимых сбрасываются до её удаления
+        cell->Clear();
+        // удаляем ячейку из хранилища, пустые блоки освобождаются в целях экономии памяти
+        // хранилище само сдвигает границы печатной области
+        _data.Erase(pos);
     }
 }
 
 // удаляет данные таблицы
 Sheet& Sheet::EraseSheet() {
-    _data.erase(_data.begin(), _data.end());
+    // вместе с ячейками уходят и все связи между ними, граф, общий с копией, остаётся ей
+    _graph = std::make_shared<DependencyGraph>();
+    _data.Clear();
+    ClearTouched();
+    ++_version;
     return *this;
 }
 
-// выдает размер печатной области
-Size Sheet::GetPrintableSize() const {
-    // если флаг указывает на неактуальность данных 
-    if (_ps_flag == PSizeFlag::not_actual) {
-        // снимаем константность и делаем пересчёт
-        const_cast<Sheet*>(this)->PrintSizeCalculate();
+// арена размещения ячеек
+SlabArena& Sheet::GetArena() {
+    return _data.GetArena();
+}
+
+// таблица интернирования формул
+FormulaPool& Sheet::GetFormulaPool() {
+    if (!_formulas) {
+        // таблица, из которой переместили данные, получает новый пул при первом обращении
+        _formulas = std::make_shared<FormulaPool>();
     }
+    return *_formulas;
+}
 
-    // возвращаем значение только при актуальном значении размера зоны печати
-    return _ps_flag == PSizeFlag::actual ? _print :
-        // иначе бросаем исключение, что что-то пошло не так
-        throw SheetError("ERROR::GetPrintableSize()::Print size calculation is incorrect::" + std::to_string(__LINE__));
+// граф зависимостей ячеек
+DependencyGraph& Sheet::GetDependencyGraph() {
+    if (!_graph) {
+        // таблица, из которой переместили данные, получает новый граф при первом обращении
+        _graph = std::make_shared<DependencyGraph>();
+    }
+    else if (_graph.use_count() > 1) {
+        // граф, общий с копией таблицы, копируется перед первой правкой
+        _graph = std::make_shared<DependencyGraph>(*_graph);
+    }
+    return *_graph;
+}
+// граф зависимостей ячеек
+const DependencyGraph& Sheet::GetDependencyGraph() const {
+    static const DependencyGraph empty;
+    return _graph ? *_graph : empty;
 }
-// вывод печатной области по значениям
-void Sheet::PrintValues(std::ostream& output) const {
 
-    // берем величину зоны печати, метод сам определит актуальна она или нет
-    Size print = GetPrintableSize();
-
-    // бежим по массиву передавая в печать строки
-    for (int i = 0; i != print.rows; ++i) 
-    {
-        bool IsFirst = true; // флаг первой ячейки в строке
-        for (int j = 0; j != print.cols; ++j)
-        {
-            Position pos(i, j);
-            if (IsFirst) 
-            {
-                if (IsValid(pos)) {
-                    // если позиция валидна, то печатаем
-                    _data.at(pos)->PrintValue(output);
-                }
-                IsFirst = false;
+// ячейки, на которые ссылается ячейка
+std::vector<Position> Sheet::GetPrecedents(Position pos) const {
+    return GetDependencyGraph().GetPrecedents(pos);
+}
+// ячейки, которые ссылаются на ячейку
+std::vector<Position> Sheet::GetDependents(Position pos) const {
+    return GetDependencyGraph().GetDependents(pos);
+}
+
+// посчитать все формулы без кеша
+std::size_t Sheet::Recalculate(unsigned threads) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    WorkerPool pool(threads);
+    return CalculatePending(pool);
+}
+
+// посчитать формулы без кеша по уровням на пуле потоков. Кеши формул изменяемы и в константной таблице,
+// значения ячеек при этом не меняются
+std::size_t Sheet::CalculatePending(WorkerPool& pool) const {
+    // размер задания, начиная с которого оно раздаётся пулу
+    static const std::size_t parallel_min = 64;
+
+    if (!_touched_all && _touched.empty()) {
+        // после полного подсчёта ячейки не менялись: формул без кеша нет и обходить лист не нужно
+        return 0;
+    }
+
+    // непосчитанные формулы листа и охватывающий их прямоугольник
+    std::vector<Cell*> cells;
+    std::vector<Position> positions;
+    Position first = { Position::MAX_ROWS, Position::MAX_COLS };
+    Position last = { -1, -1 };
+    auto collect = [&](Position pos, Cell& cell) {
+        if (cell.IsFormula() && !cell.IsCalculated()) {
+            cells.push_back(&cell);
+            positions.push_back(pos);
+            first = { std::min(first.row, pos.row), std::min(first.col, pos.col) };
+            last = { std::max(last.row, pos.row), std::max(last.col, pos.col) };
+        }
+    };
+    if (_touched_all) {
+        for (auto [pos, cell] : _data) {
+            collect(pos, *cell);
+        }
+    }
+    else {
+        // обходятся только блоки, изменённые после прошлого подсчёта
+        for (int index : _touched) {
+            const Position origin(index / SheetStorage::BLOCK_COLS * SheetStorage::BLOCK_SIZE,
+                                  index % SheetStorage::BLOCK_COLS * SheetStorage::BLOCK_SIZE);
+            _data.ForEachInRange({ origin, { SheetStorage::BLOCK_SIZE, SheetStorage::BLOCK_SIZE } }, collect);
+        }
+    }
+
+    if (cells.empty()) {
+        ClearTouched();
+        return 0;
+    }
+
+    // номер формулы по позиции. Обычно формулы плотно заполняют свой прямоугольник, тогда номера лежат
+    // в таблице по его клеткам и поиск не требует хеширования; разреженный лист использует хеш-таблицу
+    const std::size_t none = cells.size();
+    const std::size_t width = static_cast<std::size_t>(last.col - first.col + 1);
+    const std::size_t area = static_cast<std::size_t>(last.row - first.row + 1) * width;
+    std::vector<std::size_t> dense;
+    std::unordered_map<Position, std::size_t, PositionHasher> sparse;
+    if (area <= cells.size() * 4) {
+        dense.assign(area, none);
+        for (std::size_t i = 0; i != cells.size(); ++i) {
+            dense[(positions[i].row - first.row) * width + (positions[i].col - first.col)] = i;
+        }
+    }
+    else {
+        sparse.reserve(cells.size());
+        for (std::size_t i = 0; i != cells.size(); ++i) {
+            sparse.emplace(positions[i], i);
+        }
+    }
+
+    auto find = [&](Position pos) {
+        if (!dense.empty()) {
+            if (pos.row < first.row || pos.row > last.row || pos.col < first.col || pos.col > last.col) {
+                return none;
             }
-            else 
-            {
-                output << '\t';
-                if (IsValid(pos)) {
-                    // если позиция валидна, то печатаем
-                    _data.at(pos)->PrintValue(output);
-                }
+            return dense[(pos.row - first.row) * width + (pos.col - first.col)];
+        }
+        auto it = sparse.find(pos);
+        return it != sparse.end() ? it->second : none;
+    };
+
+    // небольшие задания выполняются вызывающим потоком, будить пул ради них дороже самих вычислений
+    auto run = [&pool](std::size_t count, const std::function<void(std::size_t)>& task) {
+        if (count < parallel_min) {
+            for (std::size_t i = 0; i != count; ++i) {
+                task(i);
             }
         }
-        output << '\n'; // на конец каждой строки добавляем перенос
+        else {
+            pool.Run(count, task);
+        }
+    };
+
+    // количество непосчитанных влияющих у каждой формулы, граф при подсчёте только читается
+    const DependencyGraph& graph = GetDependencyGraph();
+    std::vector<std::atomic<std::uint32_t>> pending(cells.size());
+    run(cells.size(), [&](std::size_t i) {
+        std::uint32_t count = 0;
+        graph.ForEachPrecedent(positions[i], [&](Position pos) {
+            count += find(pos) != none;
+        });
+        pending[i].store(count, std::memory_order_relaxed);
+    });
+
+    // нижний уровень - формулы без непосчитанных влияющих
+    std::vector<std::size_t> level;
+    for (std::size_t i = 0; i != cells.size(); ++i) {
+        if (pending[i].load(std::memory_order_relaxed) == 0) {
+            level.push_back(i);
+        }
+    }
+
+    // все влияющие формулы уровня уже в кеше, поэтому вычисление каждой из них не уходит вглубь и пишет
+    // только в свой кеш. Результаты уровня видны следующему через синхронизацию в WorkerPool::Run()
+    std::vector<std::size_t> next(cells.size());
+    std::atomic<std::size_t> next_size{ 0 };
+    std::function<void(std::size_t)> evaluate = [&](std::size_t i) {
+        const std::size_t index = level[i];
+        cells[index]->GetNumericValue();
+
+        // зависимая формула попадает в следующий уровень вместе с последней посчитанной влияющей
+        graph.ForEachDependent(positions[index], [&](Position pos) {
+            const std::size_t dependent = find(pos);
+            if (dependent != none && pending[dependent].fetch_sub(1, std::memory_order_relaxed) == 1) {
+                next[next_size.fetch_add(1, std::memory_order_relaxed)] = dependent;
+            }
+        });
+    };
+
+    while (!level.empty()) {
+        next_size.store(0, std::memory_order_relaxed);
+        run(level.size(), evaluate);
+        level.assign(next.begin(), next.begin() + next_size.load(std::memory_order_relaxed));
     }
+
+    ClearTouched();
+    return cells.size();
+}
+
+// выдает размер печатной области
+Size Sheet::GetPrintableSize() const {
+    // границы занятых строк и столбцов хранилище ведёт при каждой вставке и удалении
+    return _data.Extent();
+}
+// вывод печатной области по значениям
+void Sheet::PrintValues(std::ostream& output) const {
+    // поток получает вывод крупными порциями через промежуточный буфер
+    OutputBuffer buffer(output);
+    PrintValues(buffer);
+    buffer.Flush();
 }
 // вывод печатной области по текстовому представлению
 void Sheet::PrintTexts(std::ostream& output) const {
+    OutputBuffer buffer(output);
+    PrintTexts(buffer);
+    buffer.Flush();
+}
+// вывод значений в буфер вывода
+void Sheet::PrintValues(OutputBuffer& output, unsigned threads) const {
+    PrintCells(output, &Cell::PrintValue, threads);
+}
+// вывод текстов в буфер вывода
+void Sheet::PrintTexts(OutputBuffer& output, unsigned threads) const {
+    PrintCells(output, &Cell::PrintText, threads);
+}
 
-    // берем величину зоны печати, метод сам определит актуальна она или нет
-    Size print = GetPrintableSize();
-
-    // бежим по массиву передавая в печать строки
-    for (int i = 0; i != print.rows; ++i)
-    {
-        bool IsFirst = true; // флаг первой ячейки в строке
-        for (int j = 0; j != print.cols; ++j)
-        {
-            Position pos(i, j);
-            if (IsFirst)
-            {
-                if (IsValid(pos)) {
-                    // если позиция валидна, то печатаем
-                    _data.at(pos)->PrintText(output);
-                }
-                IsFirst = false;
-            }
-            else
-            {
-                output << '\t';
-                if (IsValid(pos)) {
-                    // если позиция валидна, то печатаем
-                    _data.at(pos)->PrintText(output);
-                }
-            }
-        }
-        output << '\n'; // на конец каждой строки добавляем перенос
+// номер состояния ячеек
+std::uint64_t Sheet::GetVersion() const {
+    return _version;
+}
+
+// опубликовать текущее состояние листа
+std::shared_ptr<const Sheet> Sheet::Publish() {
+    // слот версии меняет только писатель, поэтому сам он читает его без синхронизации
+    if (_published && _published->_version == _version) {
+        // после прошлой публикации ячейки не менялись
+        return _published;
+    }
+
+    // копия досчитывает формулы листа и делит с ним блоки, читатели версии будут только читать кеш
+    auto version = std::make_shared<const Sheet>(*this);
+    if (auto previous = std::atomic_exchange(&_published, version)) {
+        _retired.push_back(std::move(previous));
     }
+
+    // вынутую из слота версию новый читатель уже не получит: если её держит только список,
+    // она больше никому не нужна и разрушается здесь, в потоке писателя
+    _retired.erase(std::remove_if(_retired.begin(), _retired.end(), [](const std::shared_ptr<const Sheet>& retired) {
+        return retired.use_count() == 1;
+    }), _retired.end());
+    return version;
+}
+
+// последняя опубликованная версия листа
+std::shared_ptr<const Sheet> Sheet::Snapshot() const {
+    return std::atomic_load(&_published);
 }
 
 // свапает таблицы местами по ссылке
 Sheet& Sheet::SwapSheet(Sheet& other) {
 
-    // Copy and Swap
-    Sheet tmp(*this);                    // делаем копию текущей таблицы
-    *this = other;                       // присваиваем данные из второй таблицы
-    other = std::move(tmp);       // перемещаем данные из временной таблицы
+    // ячейки остаются на месте: таблицы обмениваются указателями на блоки, формулы и граф,
+    // а связи ячеек переназначаются новым владельцам
+    _data.Swap(other._data);
+    _data.Bind(this);
+    other._data.Bind(&other);
+
+    std::swap(_formulas, other._formulas);
+    std::swap(_graph, other._graph);
+    std::swap(_batch, other._batch);
+    std::swap(_touched_bits, other._touched_bits);
+    std::swap(_touched, other._touched);
+    std::swap(_touched_all, other._touched_all);
+
+    // опубликованные версии не переходят вместе с ячейками, поэтому обе таблицы получают новый номер состояния
+    _version = other._version = std::max(_version, other._version) + 1;
 
     return *this;
 }
@@ -311,94 +997,25 @@ Sheet& Sheet::SwapSheet(Sheet* other) {
     return *this;
 }
 
-// возвращает флаг того, что от данной ячейки завият
+// возвращает флаг того, что ячейки нет, но на неё ссылаются
 bool Sheet::IsFutureDependendCell(Position pos) const {
-    return _future_refs.count(pos);
-}
-
-// возвращает флаг пустоты пула отложенных ссылок
-bool Sheet::IsFutureRefsActual() const {
-    return !static_cast<bool>(_future_refs.size());
-}
-
-// добавить направление ссылки в пул
-void Sheet::AddFutureRefLine(Position from, Position to) {
-    _future_refs[from].insert(to);
-}
-
-// провести обновление ссылок
-void Sheet::UpdateFutureReferences() {
-    // чтобы потом удалить обновленные
-    FutureReferences new_pole;
-    // начинаем перебирать пул
-    for (const auto& line : _future_refs) {
-        // если появилась ячейка от которой зависят другие
-        if (IsValid(line.first)) {
-            // начинаем перебирать пул её зависимых
-            // так как сюда попадают только ячейки которые уже существуют, то пересохранять ничего не надо
-            for (const auto& pos : line.second) {
-                // говорим ячейке, что от неё зависит ячейка базового цикла
-                GetDirectCell(line.first)->AddDependentCell(pos);
-            }
-        }
-        // если условие не проходит, то откладываем на будущее
-        else {
-            new_pole[line.first] = line.second;
-        }
-    }
-    // в конце просто свапаем местами старый и новый пулы
-    std::swap(_future_refs, new_pole);
-}
-// провести обновление отложенных ссылок по позиции
-void Sheet::UpdateFutureReferences(Position pos) {
-    // работаем только в том случае, если ячейка есть в листе на будушее обновление
-    if (IsFutureDependendCell(pos)) {
-        for (const auto& cell : _future_refs.at(pos)) {
-            // говорим ячейке, что от неё зависит другая ячейка
-            GetDirectCell(pos)->AddDependentCell(cell);
-            // очищаем кеш ячейки после того, как у неё появился наконец сюзерен
-            GetDirectCell(cell)->ClearCache();
-        }
-        // удаляем запись о отложенном обновлении
-        _future_refs.erase(pos);
-    }
+    return !GetDirectCell(pos) && GetDependencyGraph().HasDependents(pos);
 }
 
 // возвращает флаг того, что таблица пуста
 bool Sheet::IsEmpty() const {
-    return _data.empty();
+    return _data.IsEmpty();
 }
 
 // флаг существующей доступной ячейки
 bool Sheet::IsValid(Position pos) const {
-    if (!pos.IsValid()) {
-        // если позиция в принципе не валидна то кидаем исключение
-        throw InvalidPositionException("incoming POS is not Valid::" + std::to_string(__LINE__));
-    }
-    return _data.count(pos);
+    // GetDirectCell() сам бросит исключение при невалидной позиции
+    return GetDirectCell(pos) != nullptr;
 }
 
-// флаг равенство таблиц по значениям
+// флаг равенство таблиц по значениям: хеш содержимого учитывает позиции, типы и тексты всех ячеек
 bool Sheet::IsEqual(const Sheet& other) const {
-    // если обе таблицы пустые - они равны по значениям
-    if (IsEmpty() && other.IsEmpty()) {
-        return true;
-    }
-    // если обе таблицы НЕ пустые
-    else if (!IsEmpty() && !other.IsEmpty()) {
-
-        // в случае равенства областей - отправляем в цикл сравнения
-        if (GetPrintableSize() == other.GetPrintableSize()) {
-            return SheetСomparison(other);
-        }
-        else {
-            return false;
-        }
-    }
-    // если одна строка сырая, а другая нет - не равны
-    else {
-        return false;
-    }
+    return _data.Size() == other._data.Size() && GetContentHash() == other.GetContentHash();
 }
 // флаг равенство таблиц по значениям
 bool Sheet::IsEqual(const Sheet* other) const {
@@ -414,116 +1031,177 @@ bool Sheet::IsEqual(const SheetInterface* other) const {
     return false;
 }
 
+// хеш содержимого всех ячеек листа
+std::uint64_t Sheet::GetContentHash() const {
+    return _data.Hash();
+}
+
+// позиции различающихся ячеек в построчном порядке
+std::vector<Position> Sheet::Diff(const Sheet& other) const {
+    return _data.Diff(other._data);
+}
+
 // базовый итератор доступа begin()
-auto Sheet::Begin() {
+Sheet::Iterator Sheet::Begin() {
     return _data.begin();
 }
 // базовый итератор доступа end()
-auto Sheet::End() {
+Sheet::Iterator Sheet::End() {
     return _data.end();
 }
 // константный итератор доступа begin()
-auto Sheet::Begin() const {
+Sheet::Iterator Sheet::Begin() const {
     return _data.begin();
 }
 // константный итератор доступа begin()
-auto Sheet::End() const {
+Sheet::Iterator Sheet::End() const {
     return _data.end();
 }
 // константный итератор доступа cbegin()
-auto Sheet::cBegin() const {
-    return _data.cbegin();
+Sheet::Iterator Sheet::cBegin() const {
+    return _data.begin();
 }
 // константный итератор доступа cend()
-auto Sheet::cEnd() const {
-    return _data.cend();
+Sheet::Iterator Sheet::cEnd() const {
+    return _data.end();
 }
 
-// возвращает виртуальную загрушку
-const CellInterface* Sheet::GetDummy(Position pos) {
-    if (!_DUMMY.get()) {
-        _DUMMY = std::make_unique<Cell>(*this, pos);
-        _DUMMY->SetData("");
-    }
-    return _DUMMY.get();
+// хранилище, в котором посчитаны все формулы. Копия делит с таблицей блоки, которые обе только читают,
+// поэтому кеш общих формул должен быть верен для обеих: правка в любой из них сбрасывает кеш зависимых
+// в собственных копиях блоков, а вычислять общие формулы заново не придётся
+const Sheet::SheetData& Sheet::CalculatedData() const {
+    WorkerPool pool(1);
+    CalculatePending(pool);
+    return _data;
 }
 
-// калькулятор области печати
-Sheet::PSizeFlag Sheet::PrintSizeCalculate() {
-    if (IsEmpty() && _print.cols == -1 && _print.rows == -1) {
-        // если таблица пуста 
-        return _ps_flag = PSizeFlag::actual;
-    }
+// посчитанное хранилище с замороженной связью: ячейки блоков, общих с копией, отвечают о зависимостях
+// по текущему графу и не обращаются к листу, который может измениться либо разрушиться раньше копии
+const Sheet::SheetData& Sheet::SharedData() const {
+    CalculatedData();
+    _data.Freeze(_graph);
+    return _data;
+}
 
-    for (const auto& cell : _data) {
+// возвращает ячейку, создавая её при отсутствии
+Cell* Sheet::GetOrCreateCell(Position pos) {
+    // GetDirectCell() пробразывает исключение о выходе за пределы при out of limmit
+    std::as_const(*this).GetDirectCell(pos);
 
-        if (cell.second) {
-            if (_print.cols <= cell.first.col) {
-                _print.cols = cell.first.col + 1;
-            }
+    // ячейку берут для записи содержимого: хранилище отдаёт существующую либо создаёт новую в арене
+    // и отмечает её слот для пересчёта хеша
+    Touch(pos);
+    return _data.Emplace(pos, *this);
+}
 
-            if (_print.rows <= cell.first.row) {
-                _print.rows = cell.first.row + 1;
-            }
-        }
+// отметить изменение ячейки: формулы её блока нужно досчитать, текущее состояние ещё не опубликовано
+void Sheet::Touch(Position pos) {
+    ++_version;
+    if (_touched_all) {
+        return;
+    }
+
+    const int index = pos.row / SheetStorage::BLOCK_SIZE * SheetStorage::BLOCK_COLS + pos.col / SheetStorage::BLOCK_SIZE;
+    if (_touched_bits.empty()) {
+        _touched_bits.assign(SheetStorage::BLOCK_ROWS * SheetStorage::BLOCK_COLS / 64, 0);
     }
-    return _ps_flag = PSizeFlag::actual;
+    const std::uint64_t bit = std::uint64_t(1) << (index % 64);
+    if (!(_touched_bits[index / 64] & bit)) {
+        _touched_bits[index / 64] |= bit;
+        _touched.push_back(index);
+    }
+}
+// все формулы посчитаны: изменённых блоков нет
+void Sheet::ClearTouched() const {
+    // карта остаётся выделенной, сбрасываются только её отмеченные слова
+    for (int index : _touched) {
+        _touched_bits[index / 64] = 0;
+    }
+    _touched.clear();
+    _touched_all = false;
 }
 
-// управление печатной областью
-Sheet::PSizeFlag Sheet::PrintSizeManager(Position pos, OpFlag flag) {
-    switch (flag)
-    {
-    case Sheet::set:
-        
-        // если координаты позиции превышают уже записанные
-        if (_print.rows <= pos.row || _print.cols <= pos.col) {
+// построчная печать области
+void Sheet::PrintCells(OutputBuffer& output, void (Cell::* printer)(OutputBuffer&) const, unsigned threads) const {
+    // ячеек в одной полосе строк и количество полос, печатаемых за один проход пула
+    static const std::size_t band_cells = std::size_t(1) << 16;
+    static const unsigned bands_per_thread = 2;
 
-            // проверяем строку
-            if (_print.rows <= pos.row) {
-                _print.rows = pos.row + 1;
-            }
-            // проверяем столбец
-            if (_print.cols <= pos.col) {
-                _print.cols = pos.col + 1;
-            }
-        }
+    // берем величину зоны печати
+    const Size print = GetPrintableSize();
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
 
-        return _ps_flag = PSizeFlag::actual;
+    const int band_rows = static_cast<int>(std::max<std::size_t>(1, band_cells / std::max(print.cols, 1)));
+    if (threads == 1 || print.rows <= band_rows) {
+        PrintBand(output, printer, print, 0, print.rows);
+        return;
+    }
 
-    case Sheet::clear:
-        // если удаляемая ячейка находится внутри зоны
-        if (_print.rows > pos.row + 1 && _print.cols > pos.col + 1) {
-            return _ps_flag = PSizeFlag::actual;
-        }
-        else {
-            // сбрасываем в нули
-            _print.cols = 0; _print.rows = 0;
-            return _ps_flag = PSizeFlag::not_actual;
-        }
+    WorkerPool pool(threads);
+    if (printer == &Cell::PrintValue) {
+        // во время печати формулы только читают кеш: всё непосчитанное считается заранее по уровням
+        CalculatePending(pool);
+    }
+
+    // полосы печатаются проходами, чтобы память под вывод не зависела от размера листа
+    std::vector<OutputBuffer> bands(pool.Size() * bands_per_thread);
+    for (int first = 0; first < print.rows; first += band_rows * static_cast<int>(bands.size())) {
+        const std::size_t count = std::min<std::size_t>(bands.size(), (print.rows - first + band_rows - 1) / band_rows);
 
-    default:
-        return _ps_flag;
+        pool.Run(count, [&](std::size_t i) {
+            const int begin = first + static_cast<int>(i) * band_rows;
+            bands[i].Clear();
+            PrintBand(bands[i], printer, print, begin, std::min(begin + band_rows, print.rows));
+        });
+
+        for (std::size_t i = 0; i != count; ++i) {
+            output.Write(bands[i].View());
+        }
     }
 }
 
-// прямое сравнение таблиц по ячейкам
-bool Sheet::SheetСomparison(const Sheet& other) const {
+// печать строк [first_row, end_row) области печати
+void Sheet::PrintBand(OutputBuffer& output, void (Cell::* printer)(OutputBuffer&) const, Size print, int first_row, int end_row) const {
 
-    // перебираем все значения в базе 
-    for (const auto& cell : _data) {
+    // позиция, на которой стоит вывод: строка и столбец последней выведенной ячейки
+    Position cursor(first_row, 0);
 
-        if (other.GetDirectCell(cell.first) == nullptr) {
-            // если такая позиция не встречается, то выходим с false
-            return false;
+    // серия разделителей пустых ячеек пишется в буфер одним заполнением
+    auto put_tabs = [&output](int count) {
+        if (count > 0) {
+            output.Fill('\t', static_cast<std::size_t>(count));
         }
-
-        if (cell.second->IsEqual(other.GetDirectCell(cell.first))) {
-            // если позиции не равны по значениям, то выходим с false
-            return false;
+    };
+
+    // обходим только заполненные ячейки, пустые места добиваются разделителями
+    ForEachInRange({ Position(first_row, 0), Size{ end_row - first_row, print.cols } }, [&](Position pos, const Cell& cell) {
+        // закрываем строки до строки текущей ячейки
+        for (; cursor.row < pos.row; ++cursor.row) {
+            put_tabs(print.cols - 1 - cursor.col);
+            output.Put('\n');        // на конец каждой строки добавляем перенос
+            cursor.col = 0;
         }
+
+        put_tabs(pos.col - cursor.col);
+        (cell.*printer)(output);
+        cursor.col = pos.col;
+        });
+
+    // закрываем оставшиеся строки полосы
+    for (; cursor.row < end_row; ++cursor.row) {
+        put_tabs(print.cols - 1 - cursor.col);
+        output.Put('\n');
+        cursor.col = 0;
+    }
+}
+
+// убирает ячейку, оставшуюся пустой после неудачной правки
+void Sheet::EraseIfRaw(Position pos) {
+    if (const Cell* cell = GetDirectCell(pos); cell && cell->IsRaw()) {
+        _data.Erase(pos);
     }
-    return true;
 }
 
 // ----------------------------------- class Sheet END ---------------------------------------------------
@@ -2,12 +2,23 @@
 
 #include "cell.h"
 #include "common.h"
+#include "dependency_graph.h"
+#include "formula_pool.h"
+#include "output_buffer.h"
+#include "storage.h"
 
+#include <cstdint>
 #include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
 #include <vector>
-#include <unordered_set>
 #include <unordered_map>
 
+class WorkerPool;
+
 // Описывает ошибки, которые могут возникнуть при работе с таблицей.
 class SheetError : public std::runtime_error {
 public:
@@ -16,25 +27,15 @@ public:
 
 class Sheet : public SheetInterface {
 public:
-    using SheetData = std::unordered_map<Position, std::unique_ptr<Cell>, PositionHasher>;
-    using FutureReferences = std::unordered_map<Position, std::unordered_set<Position, PositionHasher>, PositionHasher>;
-
-    // флаг выполняемой операции применяется при работе со вставкой и изменениями размера строки и таблицы
-    enum OpFlag
-    {
-        set, get, copy, move, swap, clear
-    };
-
-    // флаг завершения работы метода PrintSizeManager()
-    enum PSizeFlag
-    {
-        actual,                    // область печати в актуальном состоянии
-        not_actual                 // необходимо пересчитать область печати
-    };
+    using SheetData = SheetStorage;
+    using Iterator = SheetStorage::Iterator;
+    using CellUpdate = std::pair<Position, std::string>;
 
     Sheet() = default;                                                                // базовый конструктор пустой таблицы
     ~Sheet();
 
+    // копия делит с исходной таблицей блоки ячеек, формулы и граф зависимостей: блок либо граф копируется
+    // при первой правке в любой из таблиц. Формулы без кеша исходной таблицы перед этим считаются
     Sheet(const Sheet& /*other*/);                                                    // конструктор копирования
     Sheet& operator=(const Sheet& /*other*/);                                         // оператор присваивания
 
@@ -49,34 +50,92 @@ public:
     void CopyCell(Position /*from*/, Position /*to*/);                                // скопировать ячейку из одной позиции в другую
     void MoveCell(Position /*from*/, Position /*to*/);                                // переместить ячейку из одной позиции в другую
 
+    // назначить ячейки пакетом: все строки разбираются до изменения листа, ссылки заменяются в графе разом
+    // с одной проверкой на циклы, кеши сбрасываются один раз. При FormulaException или
+    // CircularDependencyException лист остаётся прежним. Повтор позиции в пакете - действует последняя правка.
+    // Крупный пакет разбирается на threads потоках вместе с вызывающим (0 - по числу ядер)
+    void SetCells(std::vector<CellUpdate> /*updates*/, unsigned threads = 0);
+
+    // правки SetCell между BeginBatch() и Commit() копятся и применяются одним пакетом SetCells(),
+    // до этого лист их не видит. Остальные операции выполняются сразу
+    void BeginBatch();                                                                // начать пакет правок
+    void Commit();                                                                    // применить пакет, при исключении он отбрасывается
+    void Rollback();                                                                  // отбросить накопленные правки
+    bool IsBatchActive() const;                                                       // флаг открытого пакета правок
+
+    // загрузить ячейки из текста в формате PrintTexts(): строки разделены '\n' (допускается "\r\n"), ячейки - '\t',
+    // пустые поля ячеек не создают. Поток читается порциями по границам строк, файл отображается в память.
+    // Текст делится на куски по границам строк, куски разбираются на threads потоках (0 - по числу ядер),
+    // и все ячейки записываются одним пакетом SetCells() либо добавляются в открытый пакет правок
+    void LoadTexts(std::istream& /*input*/, unsigned threads = 0);
+    void LoadTexts(const std::string& /*path*/, unsigned threads = 0);
+
+    // двоичный снимок листа: тексты ячеек, узлы различных формул, рёбра графа, кеши формул и печатная область.
+    // Загрузка отображает файл в память и заменяет им содержимое листа без разбора формул. Рёбра графа сверяются
+    // со ссылками восстановленных формул, циклы проверяются один раз на весь граф.
+    // Повреждённый снимок либо чужой формат - SnapshotException, лист при этом не меняется
+    void SaveSnapshot(const std::string& /*path*/) const;
+    void LoadSnapshot(const std::string& /*path*/);
+
     // можно добавить методы в зависимости от задания и необходимости
 
     const CellInterface* GetCell(Position pos) const override;                        // выдаёт ячейку по позиции
     CellInterface* GetCell(Position pos) override;                                    // выдаёт ячейку по позиции
 
     const Cell* GetDirectCell(Position pos) const;                                    // выдаёт ячейку по позиции
-    Cell* GetDirectCell(Position pos);                                                // выдаёт ячейку по позиции
+    Cell* GetDirectCell(Position pos);                                                // выдаёт ячейку для изменения, общий с копией блок копируется
 
     void ClearCell(Position pos) override;                                            // удаляет ячейку по позиции
     Sheet& EraseSheet();                                                              // удаляет данные таблицы
 
+    SlabArena& GetArena();                                                            // арена размещения ячеек
+    FormulaPool& GetFormulaPool();                                                    // таблица интернирования формул
+
+    DependencyGraph& GetDependencyGraph();                                            // граф зависимостей для изменения, общий с копией копируется
+    const DependencyGraph& GetDependencyGraph() const;                                // граф зависимостей ячеек
+
+    std::vector<Position> GetPrecedents(Position pos) const;                          // ячейки, на которые ссылается ячейка
+    std::vector<Position> GetDependents(Position pos) const;                          // ячейки, которые ссылаются на ячейку
+
+    // посчитать все формулы без кеша на threads потоках вместе с вызывающим (0 - по числу ядер).
+    // Формулы делятся на уровни: формула уровня k ссылается только на уже посчитанные формулы уровней ниже k,
+    // формулы одного уровня независимы и считаются параллельно. Возвращает количество посчитанных формул
+    std::size_t Recalculate(unsigned threads = 0);
+
     // --------------------------------------- блок вспомогательных методов класса ----------------------------------------------------
 
     Size GetPrintableSize() const override;                                           // выдает размер печатной области
 
     void PrintValues(std::ostream& output) const override;                            // вывод печатной области по значениям
     void PrintTexts(std::ostream& output) const override;                             // вывод печатной области по текстовому представлению
+    // вывод печатной области в буфер вывода на threads потоках вместе с вызывающим (0 - по числу ядер).
+    // Полосы строк печатаются параллельно в собственные буферы и переписываются в output по порядку,
+    // поэтому вывод совпадает с последовательным. Перед печатью значений формулы без кеша считаются по уровням
+    void PrintValues(OutputBuffer& /*output*/, unsigned threads = 1) const;
+    void PrintTexts(OutputBuffer& /*output*/, unsigned threads = 1) const;
 
-    Sheet& SwapSheet(Sheet& /*other*/);                                               // свапает таблицы местами по ссылке
+    Sheet& SwapSheet(Sheet& /*other*/);                                               // свапает таблицы местами по ссылке, без копирования ячеек
     Sheet& SwapSheet(Sheet* /*other*/);                                               // свапает таблицы местами по указателю
 
+    // --------------------------------------- блок версий для чтения из других потоков ----------------------------------------------
+
+    // Лист правит один поток-писатель, другие потоки читают опубликованные неизменяемые версии листа.
+    // Publish() вызывает писатель: версия - копия листа с посчитанными формулами, которая делит с ним блоки
+    // ячеек и граф, поэтому публикация стоит O(строк блоков), а правка после неё копирует только свой блок.
+    // Snapshot() можно вызывать из любого потока одновременно с правками: он атомарно берёт последнюю
+    // опубликованную версию (до первой публикации - nullptr). Версия читается константными методами листа
+    // сколько угодно долго и не видит последующих правок. Старые версии, которые больше никто не держит,
+    // освобождает писатель при следующей публикации, поэтому чтение не ждёт писателя и не разрушает версий.
+    // Опубликованные версии остаются у объекта листа: копирование, перемещение и обмен переносят только ячейки
+    std::uint64_t GetVersion() const;                                                 // номер состояния ячеек, растёт при изменениях
+    std::shared_ptr<const Sheet> Publish();                                           // опубликовать текущее состояние листа
+    std::shared_ptr<const Sheet> Snapshot() const;                                    // последняя опубликованная версия листа
+
     // --------------------------------------- блок работы с отложенными ссылками -----------------------------------------------------
+    // ссылка на ещё не созданную ячейку - обычное ребро графа, позиция без ячейки остаётся его вершиной-заглушкой.
+    // Появившаяся ячейка занимает эту вершину со всеми зависимыми, отдельного пула ожидающих ссылок нет
 
-    bool IsFutureDependendCell(Position /*pos*/) const;                               // возвращает флаг того, что от данной ячейки зависят
-    bool IsFutureRefsActual() const;                                                  // возвращает флаг пустоты пула отложенных ссылок
-    void AddFutureRefLine(Position /*from*/, Position /*to*/);                        // добавить направление ссылки на будущее обновление
-    void UpdateFutureReferences();                                                    // провести обновление всех возможных отложенных ссылок
-    void UpdateFutureReferences(Position /*pos*/);                                    // провести обновление отложенных ссылок по позиции
+    bool IsFutureDependendCell(Position /*pos*/) const;                               // возвращает флаг того, что ячейки нет, но на неё ссылаются
 
     // --------------------------------------- булевые флаги состояния класса ---------------------------------------------------------
 
@@ -87,29 +146,70 @@ public:
     bool IsEqual(const Sheet* /*other*/) const;                                       // флаг равенство таблиц по значениям
     bool IsEqual(const SheetInterface* /*other*/) const;                              // флаг равенство таблиц по значениям
 
+    // --------------------------------------- блок сравнения содержимого -------------------------------------------------------------
+    // Хранилище ведёт дерево хешей: ячейка - блок - лист. Правка меняет хеш только своей ячейки, поэтому
+    // IsEqual() сравнивает листы за O(1) по хешу и количеству ячеек, а Diff() спускается лишь в блоки с разными
+    // хешами. Хешируются позиция, тип и содержимое ячейки: у текста - строка, у формулы - дерево выражения
+    // с абсолютными адресами ссылок и точными битами чисел. Поэтому формулы сравниваются по дереву, а не по
+    // напечатанному тексту, как в Cell::IsEqual(): "=1+(2+3)" и "=1+2+3" печатаются одинаково, но различаются,
+    // а "=(A1)+1" и "=A1 + 1" равны.
+    // Разные хеши доказывают различие, совпадение хешей принимается за равенство без проверки ячеек: результат
+    // вероятностный, 64-битная сумма хешей слотов совпадает у разного содержимого с вероятностью порядка 2^-64.
+    // Хеш листа, который правят, запрашивается из потока правок, у опубликованной версии - из любого потока
+
+    std::uint64_t GetContentHash() const;                                             // хеш содержимого всех ячеек листа
+    std::vector<Position> Diff(const Sheet& /*other*/) const;                         // позиции различающихся ячеек в построчном порядке
+
     // --------------------------------------- итераторы доступа класса ---------------------------------------------------------------
 
-    auto Begin();                                                                     // базовый итератор доступа begin()
-    auto End();                                                                       // базовый итератор доступа end()
-    auto Begin() const;                                                               // константный итератор доступа begin()
-    auto End() const;                                                                 // константный итератор доступа begin()
-    auto cBegin() const;                                                              // константный итератор доступа cbegin()
-    auto cEnd() const;                                                                // константный итератор доступа cend()
+    Iterator Begin();                                                                 // базовый итератор доступа begin()
+    Iterator End();                                                                   // базовый итератор доступа end()
+    Iterator Begin() const;                                                           // константный итератор доступа begin()
+    Iterator End() const;                                                             // константный итератор доступа begin()
+    Iterator cBegin() const;                                                          // константный итератор доступа cbegin()
+    Iterator cEnd() const;                                                            // константный итератор доступа cend()
+
+    // обход только заполненных ячеек диапазона в построчном порядке, visitor(Position, const Cell&)
+    template <typename Visitor>
+    void ForEachInRange(CellRange range, Visitor visitor) const {
+        _data.ForEachInRange(range, [&visitor](Position pos, const Cell& cell) {
+            visitor(pos, cell);
+        });
+    }
 
 private:
 
-    SheetData _data;                                                                  // базовый двухмерный массив таблицы
-    Size _print = { 0, 0 };                                                           // величина печатной области
-    PSizeFlag _ps_flag = not_actual;                                                  // флаг состояния печатной области
-    FutureReferences _future_refs;                                                    // пул ссылок на отложенное обновление
+    SheetData _data;                                                                  // блочное хранилище ячеек таблицы
+    std::shared_ptr<FormulaPool> _formulas = std::make_shared<FormulaPool>();         // формулы листа, общие с его копиями
+    std::shared_ptr<DependencyGraph> _graph = std::make_shared<DependencyGraph>();    // ссылки между ячейками листа, общие с копиями до правки
+    std::optional<std::vector<CellUpdate>> _batch;                                    // правки открытого пакета
+
+    // формула теряет кеш только вместе с правкой своего блока, поэтому после полного подсчёта формул
+    // непосчитанные ищутся лишь в блоках, изменённых с тех пор. Пустой список - все формулы посчитаны
+    mutable std::vector<std::uint64_t> _touched_bits;                                 // битовая карта изменённых блоков
+    mutable std::vector<int> _touched;                                                // номера изменённых блоков
+    mutable bool _touched_all = false;                                                // изменённые блоки неизвестны, обходится весь лист
+    std::uint64_t _version = 0;                                                       // номер состояния ячеек
+
+    std::shared_ptr<const Sheet> _published;                                          // последняя версия, только через std::atomic_load/store
+    std::vector<std::shared_ptr<const Sheet>> _retired;                               // прежние версии, которые ещё могут читать
+
+    PendingCell _pending;                                                             // пустая ячейка ожидаемых позиций. Смотри метод GetCell(Position pos)
+
+    Cell* GetOrCreateCell(Position /*pos*/);                                          // возвращает ячейку, создавая её при отсутствии
+    void Touch(Position /*pos*/);                                                     // отметить изменение ячейки
+    void ClearTouched() const;                                                        // все формулы посчитаны
+    const SheetData& CalculatedData() const;                                          // хранилище, в котором посчитаны все формулы
+    const SheetData& SharedData() const;                                              // посчитанное хранилище с замороженной связью для копии
 
-    std::unique_ptr<Cell> _DUMMY;                                                     // виртуальная заглушка. Смотри метод GetCell(Position pos)
-    const CellInterface* GetDummy(Position /*pos*/);                                  // возвращает виртуальную загрушку
+    std::size_t CalculatePending(WorkerPool& /*pool*/) const;                         // посчитать формулы без кеша на пуле потоков
+    static int SplitTexts(std::string_view /*text*/, int /*first_row*/, unsigned /*threads*/, std::vector<CellUpdate>& /*updates*/); // разбить строки текста PrintTexts() на правки ячеек
+    void ApplyTexts(std::vector<CellUpdate> /*updates*/, unsigned /*threads*/);       // записать загруженные ячейки пакетом либо в открытый пакет
 
-    PSizeFlag PrintSizeCalculate();                                                   // калькулятор области печати
-    PSizeFlag PrintSizeManager(Position /*pos*/, OpFlag /*flag*/);                    // управление печатной областью
+    void PrintCells(OutputBuffer& /*output*/, void (Cell::*/*printer*/)(OutputBuffer&) const, unsigned /*threads*/) const; // печать области полосами строк
+    void PrintBand(OutputBuffer& /*output*/, void (Cell::*/*printer*/)(OutputBuffer&) const, Size /*print*/, int /*first_row*/, int /*end_row*/) const; // печать строк [first_row, end_row)
 
-    bool SheetСomparison(const Sheet& /*other*/) const;                               // прямое сравнение таблиц по ячейкам
+    void EraseIfRaw(Position /*pos*/);                                                // убирает ячейку, оставшуюся пустой после неудачной правки
 };
 
 // булевые флаги показывают только равенство/неравенство по расположению в памяти и размеру занимаемой области памяти!
@@ -0,0 +1,105 @@
+﻿#include "snapshot.h"
+
+#if defined(_WIN32)
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// ----------------------------------- class MappedFile --------------------------------------------------
+
+#if defined(_WIN32)
+
+MappedFile::MappedFile(const std::string& path) {
+    _file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (_file == INVALID_HANDLE_VALUE) {
+        _file = nullptr;
+        throw SnapshotException("ERROR::MappedFile()::cannot open " + path + "::" + std::to_string(__LINE__));
+    }
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(_file, &size)) {
+        CloseHandle(_file);
+        throw SnapshotException("ERROR::MappedFile()::cannot stat " + path + "::" + std::to_string(__LINE__));
+    }
+    _size = static_cast<std::size_t>(size.QuadPart);
+    if (_size == 0) {
+        // пустой файл не отображается, читать из него нечего
+        return;
+    }
+
+    _mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    _data = _mapping ? static_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+    if (!_data) {
+        if (_mapping) {
+            CloseHandle(_mapping);
+        }
+        CloseHandle(_file);
+        throw SnapshotException("ERROR::MappedFile()::cannot map " + path + "::" + std::to_string(__LINE__));
+    }
+}
+
+MappedFile::~MappedFile() {
+    if (_data) {
+        UnmapViewOfFile(_data);
+    }
+    if (_mapping) {
+        CloseHandle(_mapping);
+    }
+    if (_file) {
+        CloseHandle(_file);
+    }
+}
+
+#else
+
+MappedFile::MappedFile(const std::string& path) {
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        throw SnapshotException("ERROR::MappedFile()::cannot open " + path + "::" + std::to_string(__LINE__));
+    }
+
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        throw SnapshotException("ERROR::MappedFile()::cannot stat " + path + "::" + std::to_string(__LINE__));
+    }
+    _size = static_cast<std::size_t>(info.st_size);
+    if (_size == 0) {
+        close(fd);
+        return;
+    }
+
+    // отображение держит файл само, дескриптор больше не нужен
+    void* data = mmap(nullptr, _size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        throw SnapshotException("ERROR::MappedFile()::cannot map " + path + "::" + std::to_string(__LINE__));
+    }
+    _data = static_cast<const char*>(data);
+}
+
+MappedFile::~MappedFile() {
+    if (_data) {
+        munmap(const_cast<char*>(_data), _size);
+    }
+}
+
+#endif
+
+// начало отображения
+const char* MappedFile::Data() const {
+    return _data;
+}
+
+// размер файла
+std::size_t MappedFile::Size() const {
+    return _size;
+}
+
+// ----------------------------------- class MappedFile END ----------------------------------------------
@@ -0,0 +1,110 @@
+﻿#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+
+// Исключение, выбрасываемое при ошибке чтения или записи снимка листа
+class SnapshotException : public std::runtime_error {
+public:
+    using std::runtime_error::runtime_error;
+};
+
+// Двоичный снимок листа. Файл - заголовок и следующие за ним массивы записей фиксированного размера:
+// формулы, их узлы, ячейки, рёбра графа и тексты ячеек одним блоком. Все записи выровнены на 8 байт,
+// поэтому отображённый в память файл читается напрямую, без разбора. Числа хранятся в порядке байт
+// записавшей машины, чужой порядок и другая версия формата распознаются по заголовку
+namespace snapshot {
+
+    static const char MAGIC[8] = { 'S', 'H', 'E', 'E', 'T', 'S', 'N', 'P' };
+    static const std::uint32_t VERSION = 1;
+    static const std::uint32_t ENDIAN_MARK = 0x01020304;
+    static const std::uint32_t NO_FORMULA = UINT32_MAX;
+
+    // состояние кеша формулы в снимке
+    enum class CacheKind : std::uint8_t {
+        none,                          // формула не посчитана
+        number,                        // число в value
+        error                          // ошибка категории error
+    };
+
+    struct Header {
+        char magic[8];
+        std::uint32_t version;
+        std::uint32_t byte_order;
+        std::int32_t rows;                                                            // печатная область
+        std::int32_t cols;
+        std::uint64_t formulas;                                                       // количество записей каждого массива
+        std::uint64_t nodes;
+        std::uint64_t cells;
+        std::uint64_t edges;
+        std::uint64_t text_bytes;
+    };
+
+    // различная формула: отрезок массива узлов
+    struct Formula {
+        std::uint64_t first_node;
+        std::uint32_t node_count;
+        std::uint32_t reserved;
+    };
+
+    // узел формулы FormulaNode
+    struct Node {
+        double number;
+        std::int32_t row;
+        std::int32_t col;
+        std::uint8_t kind;
+        std::uint8_t reserved[7];
+    };
+
+    // ячейка: текст - отрезок блока текстов, рёбра ячейки идут подряд в порядке ячеек
+    struct Cell {
+        std::int32_t row;
+        std::int32_t col;
+        std::uint64_t text_offset;
+        std::uint32_t text_size;
+        std::uint32_t formula;                                                        // номер формулы либо NO_FORMULA
+        std::int32_t anchor_row;                                                      // якорь ссылок формулы
+        std::int32_t anchor_col;
+        std::uint32_t edge_count;                                                     // количество влияющих ячеек
+        std::uint8_t cache;                                                           // CacheKind
+        std::uint8_t error;                                                           // FormulaError::Category
+        std::uint8_t reserved[2];
+        double value;                                                                 // посчитанное число
+    };
+
+    // влияющая ячейка
+    struct Edge {
+        std::int32_t row;
+        std::int32_t col;
+    };
+
+    static_assert(sizeof(Header) == 64 && sizeof(Formula) == 16 && sizeof(Node) == 24 && sizeof(Cell) == 48
+        && sizeof(Edge) == 8, "snapshot records must keep their on-disk size");
+    static_assert(std::is_trivially_copyable_v<Header> && std::is_trivially_copyable_v<Cell>
+        && std::is_trivially_copyable_v<Node>, "snapshot records are copied as raw bytes");
+
+} // namespace snapshot
+
+// Файл, отображённый в память только для чтения
+class MappedFile {
+public:
+    explicit MappedFile(const std::string& /*path*/);                                 // бросает SnapshotException
+    ~MappedFile();
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    const char* Data() const;                                                         // начало отображения
+    std::size_t Size() const;                                                         // размер файла
+
+private:
+    const char* _data = nullptr;                                                      // начало отображения
+    std::size_t _size = 0;                                                            // размер файла
+#if defined(_WIN32)
+    void* _file = nullptr;                                                            // дескриптор файла
+    void* _mapping = nullptr;                                                         // дескриптор отображения
+#endif
+};
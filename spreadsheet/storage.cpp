@@ -0,0 +1,583 @@
+﻿#include "storage.h"
+
+// ----------------------------------- class SheetStorage::Iterator --------------------------------------
+
+SheetStorage::Iterator::Iterator(const SheetStorage* storage, int index)
+    : _storage(storage), _block(index) {
+    Seek();
+}
+
+SheetStorage::Entry SheetStorage::Iterator::operator*() const {
+    int block_row = _block / BLOCK_COLS;
+    int block_col = _block % BLOCK_COLS;
+    Position pos(block_row * BLOCK_SIZE + _slot / BLOCK_SIZE, block_col * BLOCK_SIZE + _slot % BLOCK_SIZE);
+
+    return { pos, _storage->_rows[block_row]->blocks[block_col]->_slots[_slot] };
+}
+
+SheetStorage::Iterator& SheetStorage::Iterator::operator++() {
+    ++_slot;
+    Seek();
+    return *this;
+}
+
+bool SheetStorage::Iterator::operator==(const Iterator& other) const {
+    return _storage == other._storage && _block == other._block && _slot == other._slot;
+}
+
+bool SheetStorage::Iterator::operator!=(const Iterator& other) const {
+    return !(*this == other);
+}
+
+// перейти к ближайшему занятому слоту
+void SheetStorage::Iterator::Seek() {
+    const int total = BLOCK_ROWS * BLOCK_COLS;
+
+    while (_block < total) {
+        const auto& row = _storage->_rows[_block / BLOCK_COLS];
+        if (!row) {
+            // строка блоков не создана - переходим сразу к следующей
+            _block = (_block / BLOCK_COLS + 1) * BLOCK_COLS;
+            _slot = 0;
+            continue;
+        }
+
+        const auto& block = row->blocks[_block % BLOCK_COLS];
+        if (block) {
+            // ищем занятый слот внутри блока
+            for (; _slot != BLOCK_SIZE * BLOCK_SIZE; ++_slot) {
+                if (block->_slots[_slot]) {
+                    return;
+                }
+            }
+        }
+
+        ++_block;
+        _slot = 0;
+    }
+    // позиция end()
+    _block = total;
+    _slot = 0;
+}
+
+// ----------------------------------- class SheetStorage::Iterator END ----------------------------------
+
+// ----------------------------------- class AxisOccupancy -----------------------------------------------
+
+void AxisOccupancy::Add(int index) {
+    if (_counts.size() <= static_cast<std::size_t>(index)) {
+        // счётчики растут с запасом, карта - до слова с нужным номером
+        _counts.resize(std::min<std::size_t>(LIMIT, std::max<std::size_t>(index + 1, _counts.size() * 2)));
+        _bits.resize((_counts.size() + 63) / 64);
+    }
+
+    if (_counts[index]++ == 0) {
+        const int word = index / 64;
+        _bits[word] |= std::uint64_t(1) << (index % 64);
+        _summary[word / 64] |= std::uint64_t(1) << (word % 64);
+        _extent = std::max(_extent, index + 1);
+    }
+}
+
+void AxisOccupancy::Remove(int index) {
+    if (--_counts[index] != 0) {
+        return;
+    }
+
+    const int word = index / 64;
+    _bits[word] &= ~(std::uint64_t(1) << (index % 64));
+    if (_bits[word] == 0) {
+        _summary[word / 64] &= ~(std::uint64_t(1) << (word % 64));
+    }
+
+    if (index + 1 != _extent) {
+        return;
+    }
+
+    // опустел последний номер - ищем новый по сводке сверху вниз
+    _extent = 0;
+    for (int top = SUMMARY_WORDS - 1; top >= 0; --top) {
+        if (_summary[top] != 0) {
+            const int last_word = top * 64 + detail::HighestBit(_summary[top]);
+            _extent = last_word * 64 + detail::HighestBit(_bits[last_word]) + 1;
+            break;
+        }
+    }
+}
+
+void AxisOccupancy::Clear() {
+    _counts.clear();
+    _bits.clear();
+    _summary.fill(0);
+    _extent = 0;
+}
+
+// ----------------------------------- class AxisOccupancy END -------------------------------------------
+
+// ----------------------------------- class SheetStorage::Block -----------------------------------------
+
+SheetStorage::Block::Block(std::shared_ptr<SheetLink> link)
+    : _link(std::move(link)) {
+}
+
+SheetStorage::Block::~Block() {
+    // здесь остаются ячейки блока, который был общим: последним его может отпустить другой лист в другом
+    // потоке, поэтому память не идёт в арену напрямую, а отдаётся в список возврата связи
+    std::vector<void*> released;
+    for (Slot cell : _slots) {
+        if (cell) {
+            cell->~Cell();
+            released.push_back(cell);
+        }
+    }
+    if (released.empty()) {
+        return;
+    }
+
+    SheetMemory& memory = *_link->memory;
+    std::lock_guard<std::mutex> guard(memory.returned_mutex);
+    memory.returned.insert(memory.returned.end(), released.begin(), released.end());
+    memory.has_returned.store(true, std::memory_order_release);
+}
+
+// ----------------------------------- class SheetStorage::Block END -------------------------------------
+
+// ----------------------------------- class SheetStorage ------------------------------------------------
+
+SheetStorage::SheetStorage()
+    : _link(std::make_shared<SheetLink>()) {
+}
+
+SheetStorage::~SheetStorage() {
+    // разрушаем свои ячейки, после чего арена освободит все слэбы разом
+    Clear();
+}
+
+// копия делит каталог и блоки с исходным хранилищем, новые ячейки размещаются в своей арене
+SheetStorage::SheetStorage(const SheetStorage& other)
+    : _link(std::make_shared<SheetLink>())
+    , _rows(other._rows)
+    , _size(other._size)
+    , _row_axis(other._row_axis)
+    , _col_axis(other._col_axis) {
+    // общие блоки больше не меняются, поэтому отложенные хеши исходного сводятся сейчас
+    other.UpdateHashes();
+    _hash = other._hash;
+}
+
+SheetStorage& SheetStorage::operator=(const SheetStorage& other) {
+    if (this != &other) {
+        SheetStorage copy(other);
+        Swap(copy);
+    }
+    return *this;
+}
+
+SheetStorage::SheetStorage(SheetStorage&& other) noexcept
+    : _link(std::move(other._link))
+    , _rows(std::move(other._rows))
+    , _size(std::exchange(other._size, 0))
+    , _row_axis(std::exchange(other._row_axis, {}))
+    , _col_axis(std::exchange(other._col_axis, {}))
+    , _hash(std::exchange(other._hash, 0))
+    , _changed(std::move(other._changed)) {
+    other._changed.clear();
+}
+
+SheetStorage& SheetStorage::operator=(SheetStorage&& other) noexcept {
+    if (this != &other) {
+        Clear();
+        _link = std::move(other._link);
+        _rows = std::move(other._rows);
+        _size = std::exchange(other._size, 0);
+        _row_axis = std::exchange(other._row_axis, {});
+        _col_axis = std::exchange(other._col_axis, {});
+        _hash = std::exchange(other._hash, 0);
+        _changed = std::move(other._changed);
+        other._changed.clear();
+    }
+    return *this;
+}
+
+// обменять содержимое вместе со связями: ячейки остаются на месте, меняются только указатели
+void SheetStorage::Swap(SheetStorage& other) noexcept {
+    std::swap(_link, other._link);
+    std::swap(_rows, other._rows);
+    std::swap(_size, other._size);
+    std::swap(_row_axis, other._row_axis);
+    std::swap(_col_axis, other._col_axis);
+    std::swap(_hash, other._hash);
+    std::swap(_changed, other._changed);
+}
+
+// назначить лист-владелец ячеек
+void SheetStorage::Bind(Sheet* sheet) {
+    if (_link) {
+        _link->sheet = sheet;
+    }
+}
+
+// заморозить связь перед копированием
+void SheetStorage::Freeze(std::shared_ptr<const DependencyGraph> graph) const {
+    if (!_link || _link.use_count() == 1) {
+        // связь держат только блоки, без них заморозить нечего
+        return;
+    }
+
+    // лист продолжает работу с новой связью над той же памятью: ячейки разрушенных общих блоков вернутся ему
+    auto link = std::make_shared<SheetLink>(SheetLink{ std::exchange(_link->sheet, nullptr), _link->memory, nullptr });
+    _link->graph = std::move(graph);
+    _link = std::move(link);
+}
+
+// ячейка по позиции либо nullptr
+Cell* SheetStorage::Get(Position pos) const {
+    const auto& row = _rows[pos.row / BLOCK_SIZE];
+    if (!row) {
+        return nullptr;
+    }
+
+    const auto& block = row->blocks[pos.col / BLOCK_SIZE];
+    return block ? block->At(pos.row % BLOCK_SIZE, pos.col % BLOCK_SIZE) : nullptr;
+}
+
+// ячейка для изменения либо nullptr
+Cell* SheetStorage::Own(Position pos) {
+    if (!Get(pos)) {
+        return nullptr;
+    }
+    Block* block = OwnBlock(OwnRow(pos.row / BLOCK_SIZE), pos.col / BLOCK_SIZE);
+    return block->At(pos.row % BLOCK_SIZE, pos.col % BLOCK_SIZE);
+}
+
+// ячейка по позиции, создаётся в арене при отсутствии
+Cell* SheetStorage::Emplace(Position pos, Sheet& sheet) {
+    if (!_link) {
+        // хранилище, из которого переместили данные, получает новую связь при первой вставке
+        _link = std::make_shared<SheetLink>();
+    }
+    _link->sheet = &sheet;
+    Reclaim();
+
+    BlockRow& row = OwnRow(pos.row / BLOCK_SIZE);
+    Block* block = OwnBlock(row, pos.col / BLOCK_SIZE);
+    if (!block) {
+        row.blocks[pos.col / BLOCK_SIZE] = std::make_shared<Block>(_link);
+        block = row.blocks[pos.col / BLOCK_SIZE].get();
+        ++row.count;
+    }
+
+    const int local_row = pos.row % BLOCK_SIZE;
+    const int local_col = pos.col % BLOCK_SIZE;
+
+    Slot& slot = block->At(local_row, local_col);
+    if (!slot) {
+        // создаём ячейку и отмечаем слот в индексе строки
+        slot = _link->memory->arena.Create<Cell>(*_link, pos);
+        block->_row_masks[local_row] |= std::uint64_t(1) << local_col;
+        ++row.row_counts[local_row];
+        ++block->_count;
+        ++_size;
+        _row_axis.Add(pos.row);
+        _col_axis.Add(pos.col);
+    }
+    // ячейку берут для записи содержимого
+    MarkChanged(pos);
+    return slot;
+}
+
+// освободить слот и пустые блоки
+void SheetStorage::Erase(Position pos) {
+    if (!Get(pos)) {
+        return;
+    }
+
+    const int block_row = pos.row / BLOCK_SIZE;
+    const int block_col = pos.col / BLOCK_SIZE;
+    const int local_row = pos.row % BLOCK_SIZE;
+    const int local_col = pos.col % BLOCK_SIZE;
+
+    // удаление тоже меняет блок: общие с копией строка и блок сначала копируются
+    BlockRow& row = OwnRow(block_row);
+    Block* block = OwnBlock(row, block_col);
+
+    // ячейку забираем из слота до удаления, чтобы во время её разрушения хранилище было согласованным
+    MarkChanged(pos);
+    Slot cell = std::exchange(block->At(local_row, local_col), nullptr);
+    block->_row_masks[local_row] &= ~(std::uint64_t(1) << local_col);
+    --row.row_counts[local_row];
+    --block->_count;
+    --_size;
+    _row_axis.Remove(pos.row);
+    _col_axis.Remove(pos.col);
+
+    // пустые блоки и строки блоков не держим в памяти
+    if (block->_count == 0) {
+        // хеш блока уходит из суммы вместе с ним, его место в списке изменённых пропустит сведение
+        _hash -= block->_hash;
+        row.blocks[block_col].reset();
+        if (--row.count == 0) {
+            _rows[block_row].reset();
+        }
+    }
+
+    // возвращаем ячейку в список свободных арены
+    _link->memory->arena.Destroy(cell);
+}
+
+// содержимое ячейки своего блока изменилось: слот отмечается, хеш пересчитается при сведении
+void SheetStorage::MarkChanged(Position pos) {
+    const auto& row = _rows[pos.row / BLOCK_SIZE];
+    Block* block = row ? row->blocks[pos.col / BLOCK_SIZE].get() : nullptr;
+    if (!block) {
+        return;
+    }
+
+    block->_changed[pos.row % BLOCK_SIZE] |= std::uint64_t(1) << (pos.col % BLOCK_SIZE);
+    if (!block->_has_changes) {
+        block->_has_changes = true;
+        _changed.push_back(pos.row / BLOCK_SIZE * BLOCK_COLS + pos.col / BLOCK_SIZE);
+    }
+}
+
+// арена ячеек
+SlabArena& SheetStorage::GetArena() {
+    if (!_link) {
+        // хранилище, из которого переместили данные, получает новую связь при первом обращении
+        _link = std::make_shared<SheetLink>();
+    }
+    return _link->memory->arena;
+}
+
+// блок по координатам каталога либо nullptr
+const SheetStorage::Block* SheetStorage::GetBlock(int block_row, int block_col) const {
+    const auto& row = _rows[block_row];
+    return row ? row->blocks[block_col].get() : nullptr;
+}
+
+// количество занятых слотов
+std::size_t SheetStorage::Size() const {
+    return _size;
+}
+
+// область печати: от A1 до последних занятых строки и столбца
+::Size SheetStorage::Extent() const {
+    return {_row_axis.Extent(), _col_axis.Extent()};
+}
+
+// флаг пустого хранилища
+bool SheetStorage::IsEmpty() const {
+    return _size == 0;
+}
+
+// удалить все блоки
+void SheetStorage::Clear() {
+    // каталог забираем целиком, чтобы разрушаемые ячейки видели уже пустое хранилище
+    auto rows = std::move(_rows);
+    _size = 0;
+    _row_axis.Clear();
+    _col_axis.Clear();
+    _hash = 0;
+    _changed.clear();
+
+    for (auto& row : rows) {
+        if (!row || row.use_count() > 1) {
+            // строка, общая с копией, остаётся ей целиком
+            continue;
+        }
+        for (auto& block : row->blocks) {
+            if (!block || !IsOwn(block)) {
+                continue;
+            }
+            // свои ячейки возвращают память в арену, общие блоки разрушит их последний владелец
+            for (Slot& cell : block->_slots) {
+                _link->memory->arena.Destroy(std::exchange(cell, nullptr));
+            }
+        }
+    }
+}
+
+// хеш содержимого хранилища
+std::uint64_t SheetStorage::Hash() const {
+    UpdateHashes();
+    return _hash;
+}
+
+// позиции, где ячейки хранилищ различаются
+std::vector<Position> SheetStorage::Diff(const SheetStorage& other) const {
+    std::vector<Position> result;
+    if (Hash() == other.Hash() && _size == other._size) {
+        return result;
+    }
+
+    std::vector<int> block_cols;
+    for (int block_row = 0; block_row != BLOCK_ROWS; ++block_row) {
+        const auto& lhs_row = _rows[block_row];
+        const auto& rhs_row = other._rows[block_row];
+        if (lhs_row == rhs_row) {
+            // общая строка блоков либо её нет у обоих
+            continue;
+        }
+
+        // различающиеся блоки строки: общий блок и блоки с равными хешами совпадают
+        block_cols.clear();
+        for (int block_col = 0; block_col != BLOCK_COLS; ++block_col) {
+            const Block* lhs = lhs_row ? lhs_row->blocks[block_col].get() : nullptr;
+            const Block* rhs = rhs_row ? rhs_row->blocks[block_col].get() : nullptr;
+            if (lhs != rhs && !(lhs && rhs && lhs->_hash == rhs->_hash)) {
+                block_cols.push_back(block_col);
+            }
+        }
+
+        // строки листа обходятся целиком через все различающиеся блоки, поэтому порядок построчный
+        for (int local_row = 0; local_row != BLOCK_SIZE && !block_cols.empty(); ++local_row) {
+            for (int block_col : block_cols) {
+                const Block* lhs = lhs_row ? lhs_row->blocks[block_col].get() : nullptr;
+                const Block* rhs = rhs_row ? rhs_row->blocks[block_col].get() : nullptr;
+                const std::uint64_t lhs_mask = lhs ? lhs->_row_masks[local_row] : 0;
+                const std::uint64_t rhs_mask = rhs ? rhs->_row_masks[local_row] : 0;
+
+                // ячейка только в одном хранилище отличается всегда, общие слоты - по хешу
+                std::uint64_t mask = lhs_mask ^ rhs_mask;
+                std::uint64_t common = lhs_mask & rhs_mask;
+                while (common) {
+                    const int local_col = detail::LowestBit(common);
+                    common &= common - 1;
+                    if (lhs->SlotHash(local_row, local_col) != rhs->SlotHash(local_row, local_col)) {
+                        mask |= std::uint64_t(1) << local_col;
+                    }
+                }
+                while (mask) {
+                    const int local_col = detail::LowestBit(mask);
+                    mask &= mask - 1;
+                    result.emplace_back(block_row * BLOCK_SIZE + local_row, block_col * BLOCK_SIZE + local_col);
+                }
+            }
+        }
+    }
+    return result;
+}
+
+SheetStorage::Iterator SheetStorage::begin() const {
+    return Iterator(this, 0);
+}
+
+SheetStorage::Iterator SheetStorage::end() const {
+    return Iterator(this, BLOCK_ROWS * BLOCK_COLS);
+}
+
+// строка блоков для изменения: общая с копией строка копируется, это только указатели на блоки и счётчики
+SheetStorage::BlockRow& SheetStorage::OwnRow(int block_row) {
+    auto& row = _rows[block_row];
+    if (!row) {
+        row = std::make_shared<BlockRow>();
+    }
+    else if (row.use_count() > 1) {
+        row = std::make_shared<BlockRow>(*row);
+    }
+    return *row;
+}
+
+// блок строки для изменения либо nullptr. Строка уже своя, поэтому счётчик ссылок блока показывает,
+// делит ли его кто-то ещё. Общий блок и блок, оставшийся от другого листа, копируются в свою арену
+SheetStorage::Block* SheetStorage::OwnBlock(BlockRow& row, int block_col) {
+    auto& block = row.blocks[block_col];
+    if (!block || IsOwn(block)) {
+        return block.get();
+    }
+    if (block.use_count() == 1 && block->_link->memory == _link->memory) {
+        // блок замороженной связи этого листа, копии его больше не держат: ячейки переходят к своей связи
+        for (Slot cell : block->_slots) {
+            if (cell) {
+                cell->Rebind(*_link);
+            }
+        }
+        block->_link = _link;
+        return block.get();
+    }
+
+    Reclaim();
+    auto copy = std::make_shared<Block>(_link);
+    for (int local_row = 0; local_row != BLOCK_SIZE; ++local_row) {
+        std::uint64_t mask = block->_row_masks[local_row];
+        while (mask) {
+            const int local_col = detail::LowestBit(mask);
+            mask &= mask - 1;
+            copy->At(local_row, local_col) = _link->memory->arena.Create<Cell>(*_link, *block->At(local_row, local_col));
+        }
+    }
+    copy->_row_masks = block->_row_masks;
+    copy->_count = block->_count;
+    // общий блок сведён, хеши копии верны
+    copy->_hashes = block->_hashes;
+    copy->_hash = block->_hash;
+
+    block = std::move(copy);
+    return block.get();
+}
+
+// вернуть в арену память ячеек общих блоков, разрушенных другими владельцами. Вызывается перед размещением
+// ячеек: арену меняет только поток, который правит это хранилище
+void SheetStorage::Reclaim() {
+    SheetMemory& memory = *_link->memory;
+    if (!memory.has_returned.load(std::memory_order_acquire)) {
+        return;
+    }
+
+    std::vector<void*> released;
+    {
+        std::lock_guard<std::mutex> guard(memory.returned_mutex);
+        released.swap(memory.returned);
+        memory.has_returned.store(false, std::memory_order_relaxed);
+    }
+    for (void* cell : released) {
+        memory.arena.Deallocate(cell, sizeof(Cell));
+    }
+}
+
+// свести хеши изменённых слотов: хеш слота заменяется, его разность прибавляется к блоку и хранилищу.
+// Отмечены только слоты своих блоков, поэтому общие блоки не меняются
+void SheetStorage::UpdateHashes() const {
+    if (_changed.empty()) {
+        // сведённое хранилище только читается, поэтому неизменяемую копию можно спрашивать из любого потока
+        return;
+    }
+
+    for (int index : _changed) {
+        const int block_row = index / BLOCK_COLS;
+        const int block_col = index % BLOCK_COLS;
+        const auto& row = _rows[block_row];
+        Block* block = row ? row->blocks[block_col].get() : nullptr;
+        if (!block || !block->_has_changes) {
+            // блок удалён либо уже сведён по более раннему номеру в списке
+            continue;
+        }
+
+        for (int local_row = 0; local_row != BLOCK_SIZE; ++local_row) {
+            std::uint64_t mask = std::exchange(block->_changed[local_row], 0);
+            while (mask) {
+                const int local_col = detail::LowestBit(mask);
+                mask &= mask - 1;
+
+                const int slot = local_row * BLOCK_SIZE + local_col;
+                std::uint64_t hash = 0;
+                if (const Cell* cell = block->_slots[slot]) {
+                    const Position pos(block_row * BLOCK_SIZE + local_row, block_col * BLOCK_SIZE + local_col);
+                    hash = CombineHash(PositionHasher()(pos), cell->GetContentHash());
+                }
+                block->_hash += hash - block->_hashes[slot];
+                _hash += hash - block->_hashes[slot];
+                block->_hashes[slot] = hash;
+            }
+        }
+        block->_has_changes = false;
+    }
+    _changed.clear();
+}
+
+// флаг блока, который меняет только это хранилище
+bool SheetStorage::IsOwn(const std::shared_ptr<Block>& block) const {
+    return block.use_count() == 1 && block->_link == _link;
+}
+
+// ----------------------------------- class SheetStorage END --------------------------------------------
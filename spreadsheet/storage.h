@@ -0,0 +1,295 @@
+﻿#pragma once
+
+#include "arena.h"
+#include "cell.h"
+#include "common.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Прямоугольная область таблицы: левый верхний угол и размер
+struct CellRange {
+    Position origin;
+    Size size;
+};
+
+namespace detail {
+
+    // номер младшего установленного бита ненулевой маски
+    inline int LowestBit(std::uint64_t mask) {
+#if defined(_MSC_VER)
+        unsigned long index = 0;
+        _BitScanForward64(&index, mask);
+        return static_cast<int>(index);
+#else
+        return __builtin_ctzll(mask);
+#endif
+    }
+
+    // номер старшего установленного бита ненулевой маски
+    inline int HighestBit(std::uint64_t mask) {
+#if defined(_MSC_VER)
+        unsigned long index = 0;
+        _BitScanReverse64(&index, mask);
+        return static_cast<int>(index);
+#else
+        return 63 - __builtin_clzll(mask);
+#endif
+    }
+
+} // namespace detail
+
+// Занятость одной оси листа (строк либо столбцов): количество ячеек на каждом номере и двухуровневая
+// битовая карта непустых номеров - слово карты на 64 номера и сводка непустых слов. Граница оси
+// (последний непустой номер плюс один) хранится готовой. Она растёт при добавлении и ищется заново,
+// только когда пустеет последний номер: старший бит сводки, затем старший бит найденного слова
+class AxisOccupancy {
+public:
+    static const int LIMIT = Position::MAX_ROWS;                                      // номеров на оси
+    static const int WORDS = LIMIT / 64;                                              // слов битовой карты
+    static const int SUMMARY_WORDS = (WORDS + 63) / 64;                               // слов сводки
+
+    void Add(int index);                                                              // на номере появилась ячейка
+    void Remove(int index);                                                           // с номера ушла ячейка
+    void Clear();                                                                     // ось без ячеек
+
+    int Extent() const {                                                              // последний непустой номер плюс один
+        return _extent;
+    }
+
+private:
+    std::vector<std::uint32_t> _counts;                                               // ячеек на номере, растёт по мере надобности
+    std::vector<std::uint64_t> _bits;                                                 // непустые номера
+    std::array<std::uint64_t, SUMMARY_WORDS> _summary{};                              // непустые слова карты
+    int _extent = 0;                                                                  // граница оси
+};
+
+static_assert(Position::MAX_ROWS == Position::MAX_COLS, "AxisOccupancy assumes a square sheet limit");
+
+// Блочное (тайловое) хранилище ячеек таблицы.
+// Лист разбивается на блоки BLOCK_SIZE x BLOCK_SIZE, блок создаётся только при появлении в нём первой ячейки.
+// Внутри блока ячейки лежат построчно в непрерывном массиве, поэтому обход строки идёт по соседним адресам.
+// Каталог блоков двухуровневый: строка блоков также создаётся лениво, что сохраняет малый вес разреженных таблиц.
+// Для каждой строки листа ведётся индекс занятых столбцов: битовая маска строки в каждом блоке и счётчик
+// занятых слотов строки в строке блоков. По нему обход диапазона посещает только заполненные ячейки.
+// Сами ячейки размещаются в слэб-арене связи хранилища, при разрушении связи память слэбов освобождается разом.
+// Копия хранилища делит с исходным строки блоков и блоки вместе с ячейками. Изменение ячейки сначала копирует
+// общую строку блоков (только указатели) и общий блок (его ячейки - в свою арену), поэтому копирование
+// хранилища стоит O(строк блоков), а правка после него - не больше одного блока. Ячейки общего блока
+// никто не меняет, и их кеш должен быть верен для всех владельцев: лист считает формулы до копирования.
+// Память ячеек общего блока, который последним отпустил другой владелец, возвращается в арену при следующем
+// размещении ячеек, поэтому поочерёдные копии и правки не растят арену.
+// Содержимое хешируется деревом: хеш слота (позиция, тип и текст ячейки) хранится в блоке, хеш блока - сумма
+// хешей его слотов, хеш хранилища - сумма хешей блоков. Сумма обновляется разностью старого и нового хеша
+// слота, поэтому правка пересчитывает только свои слоты. Вставка и удаление отмечают слот изменённым, а
+// хеши сводятся при запросе и перед копированием: общий блок всегда сведён и копиями не меняется
+class SheetStorage {
+public:
+    static const int BLOCK_SIZE = 64;                                                 // сторона квадратного блока
+    static const int BLOCK_ROWS = Position::MAX_ROWS / BLOCK_SIZE;                    // количество строк блоков
+    static const int BLOCK_COLS = Position::MAX_COLS / BLOCK_SIZE;                    // количество столбцов блоков
+
+    using Slot = Cell*;
+
+    // Блок ячеек с построчным размещением слотов. Блок держит связь, в арене которой лежат его ячейки
+    class Block {
+    public:
+        explicit Block(std::shared_ptr<SheetLink> /*link*/);
+        ~Block();                                                                     // разрушает оставшиеся ячейки, память отдаёт связи
+
+        Block(const Block&) = delete;
+        Block& operator=(const Block&) = delete;
+
+        Slot& At(int row, int col) {
+            return _slots[row * BLOCK_SIZE + col];
+        }
+        const Slot& At(int row, int col) const {
+            return _slots[row * BLOCK_SIZE + col];
+        }
+
+        int Count() const {
+            return _count;
+        }
+
+        // маска занятых столбцов строки блока
+        std::uint64_t RowMask(int row) const {
+            return _row_masks[row];
+        }
+
+        // хеш содержимого блока и его слота, верны после SheetStorage::Hash()
+        std::uint64_t Hash() const {
+            return _hash;
+        }
+        std::uint64_t SlotHash(int row, int col) const {
+            return _hashes[row * BLOCK_SIZE + col];
+        }
+
+    private:
+        friend class SheetStorage;
+
+        std::array<Slot, BLOCK_SIZE * BLOCK_SIZE> _slots{};                           // слоты ячеек блока
+        std::array<std::uint64_t, BLOCK_SIZE> _row_masks{};                           // занятые столбцы каждой строки блока
+        int _count = 0;                                                               // количество занятых слотов
+        std::shared_ptr<SheetLink> _link;                                             // связь ячеек блока
+
+        std::array<std::uint64_t, BLOCK_SIZE * BLOCK_SIZE> _hashes{};                 // хеши слотов, у пустого слота ноль
+        std::array<std::uint64_t, BLOCK_SIZE> _changed{};                             // изменённые после сведения хешей слоты строк
+        std::uint64_t _hash = 0;                                                      // сумма хешей слотов
+        bool _has_changes = false;                                                    // блок стоит в списке изменённых хранилища
+    };
+
+    // Строка блоков каталога
+    struct BlockRow {
+        std::array<std::shared_ptr<Block>, BLOCK_COLS> blocks;                        // блоки строки, общие с копиями
+        std::array<int, BLOCK_SIZE> row_counts{};                                     // количество занятых слотов каждой строки листа
+        int count = 0;                                                                // количество созданных блоков
+    };
+
+    // Элемент обхода хранилища: позиция и указатель на ячейку
+    using Entry = std::pair<Position, Cell*>;
+
+    // Итератор обхода занятых слотов. Порядок: строки блоков, блоки строки, слоты блока построчно
+    class Iterator {
+    public:
+        Iterator() = default;
+        Iterator(const SheetStorage* storage, int index);
+
+        Entry operator*() const;
+        Iterator& operator++();
+
+        bool operator==(const Iterator& other) const;
+        bool operator!=(const Iterator& other) const;
+
+    private:
+        const SheetStorage* _storage = nullptr;
+        int _block = 0;                                                               // линейный номер блока в каталоге
+        int _slot = 0;                                                                // номер слота в блоке
+
+        void Seek();                                                                  // перейти к ближайшему занятому слоту
+    };
+
+    SheetStorage();
+    ~SheetStorage();
+
+    SheetStorage(const SheetStorage& /*other*/);                                      // копия делит блоки с исходным, связь своя
+    SheetStorage& operator=(const SheetStorage& /*other*/);
+    SheetStorage(SheetStorage&& /*other*/) noexcept;
+    SheetStorage& operator=(SheetStorage&& /*other*/) noexcept;
+
+    void Swap(SheetStorage& /*other*/) noexcept;                                      // обменять содержимое вместе со связями
+    void Bind(Sheet* /*sheet*/);                                                      // назначить лист-владелец ячеек
+    // заморозить связь перед копированием: ячейки блоков, которые станут общими, запоминают граф, а хранилище
+    // получает новую связь. Связь без блоков не меняется, поэтому неизменяемую копию можно копировать из любого потока
+    void Freeze(std::shared_ptr<const DependencyGraph> /*graph*/) const;
+
+    // --------------------------------------- доступ к ячейкам ----------------------------------------------------------------------
+
+    Cell* Get(Position pos) const;                                                    // ячейка по позиции либо nullptr, только для чтения
+    Cell* Own(Position pos);                                                          // ячейка для изменения либо nullptr, общий блок копируется
+    Cell* Emplace(Position pos, Sheet& sheet);                                        // ячейка для изменения, создаётся в арене при отсутствии
+    void Erase(Position pos);                                                         // разрушить ячейку и освободить пустые блоки
+    void MarkChanged(Position pos);                                                   // содержимое ячейки своего блока изменилось
+
+    SlabArena& GetArena();                                                            // арена ячеек
+
+    const Block* GetBlock(int block_row, int block_col) const;                        // блок по координатам каталога либо nullptr
+
+    // обход занятых ячеек диапазона в построчном порядке, visitor(Position, Cell&)
+    template <typename Visitor>
+    void ForEachInRange(CellRange range, Visitor visitor) const;
+
+    // --------------------------------------- состояние хранилища -------------------------------------------------------------------
+
+    std::size_t Size() const;                                                         // количество занятых слотов
+    ::Size Extent() const;                                                            // от A1 до последних занятых строки и столбца
+    bool IsEmpty() const;                                                             // флаг пустого хранилища
+    void Clear();                                                                     // удалить все блоки
+
+    // хеш содержимого, перед этим сводятся хеши изменённых слотов. Меняет только свои блоки, поэтому у
+    // хранилища, которое правят, вызывается из потока правок, у неизменяемой копии - из любого
+    std::uint64_t Hash() const;
+    // позиции, где ячейки хранилищ различаются, в построчном порядке. Общие строки блоков и блоки с равными
+    // хешами пропускаются, слоты сравниваются по хешам только в различающихся блоках: слот с совпавшим
+    // хешем считается равным, смотри Sheet::Diff()
+    std::vector<Position> Diff(const SheetStorage& /*other*/) const;
+
+    Iterator begin() const;
+    Iterator end() const;
+
+private:
+    // связь держится по указателю: адрес не меняется при перемещении хранилища и переживает его в общих блоках
+    mutable std::shared_ptr<SheetLink> _link;                                         // лист-владелец и память ячеек
+    std::array<std::shared_ptr<BlockRow>, BLOCK_ROWS> _rows;                          // каталог строк блоков, общих с копиями
+    std::size_t _size = 0;                                                            // количество занятых слотов
+    AxisOccupancy _row_axis;                                                          // занятость строк листа
+    AxisOccupancy _col_axis;                                                          // занятость столбцов листа
+    mutable std::uint64_t _hash = 0;                                                  // сумма хешей блоков
+    mutable std::vector<int> _changed;                                                // номера блоков с изменёнными слотами
+
+    BlockRow& OwnRow(int /*block_row*/);                                              // строка блоков для изменения, создаётся при отсутствии
+    Block* OwnBlock(BlockRow& /*row*/, int /*block_col*/);                            // блок строки для изменения либо nullptr
+    bool IsOwn(const std::shared_ptr<Block>& /*block*/) const;                        // флаг блока, который меняет только это хранилище
+    void Reclaim();                                                                   // вернуть в арену память из списка возврата связи
+    void UpdateHashes() const;                                                        // свести хеши изменённых слотов в блоки и хранилище
+};
+
+template <typename Visitor>
+void SheetStorage::ForEachInRange(CellRange range, Visitor visitor) const {
+    if (range.size.rows <= 0 || range.size.cols <= 0) {
+        return;
+    }
+
+    const int max_rows = Position::MAX_ROWS;
+    const int max_cols = Position::MAX_COLS;
+
+    const int first_row = std::max(range.origin.row, 0);
+    const int last_row = std::min(range.origin.row + range.size.rows, max_rows) - 1;
+    const int first_col = std::max(range.origin.col, 0);
+    const int last_col = std::min(range.origin.col + range.size.cols, max_cols) - 1;
+
+    for (int block_row = first_row / BLOCK_SIZE; block_row <= last_row / BLOCK_SIZE; ++block_row) {
+        const auto& row = _rows[block_row];
+        if (!row) {
+            // в строке блоков нет ни одной ячейки
+            continue;
+        }
+
+        const int row_begin = std::max(first_row, block_row * BLOCK_SIZE);
+        const int row_end = std::min(last_row, block_row * BLOCK_SIZE + BLOCK_SIZE - 1);
+
+        for (int r = row_begin; r <= row_end; ++r) {
+            const int local_row = r % BLOCK_SIZE;
+            if (row->row_counts[local_row] == 0) {
+                // пустая строка листа пропускается целиком
+                continue;
+            }
+
+            for (int block_col = first_col / BLOCK_SIZE; block_col <= last_col / BLOCK_SIZE; ++block_col) {
+                const auto& block = row->blocks[block_col];
+                if (!block) {
+                    continue;
+                }
+
+                // отсекаем столбцы блока, не попадающие в диапазон
+                const int col_begin = std::max(first_col, block_col * BLOCK_SIZE) - block_col * BLOCK_SIZE;
+                const int col_end = std::min(last_col, block_col * BLOCK_SIZE + BLOCK_SIZE - 1) - block_col * BLOCK_SIZE;
+                std::uint64_t mask = block->_row_masks[local_row]
+                    & (~std::uint64_t(0) << col_begin) & (~std::uint64_t(0) >> (BLOCK_SIZE - 1 - col_end));
+
+                while (mask) {
+                    const int local_col = detail::LowestBit(mask);
+                    mask &= mask - 1;
+                    visitor(Position(r, block_col * BLOCK_SIZE + local_col), *block->At(local_row, local_col));
+                }
+            }
+        }
+    }
+}
@@ -1,6 +1,8 @@
 #include "common.h"
 
 #include <cctype>
+#include <charconv>
+#include <cstdlib>
 #include <sstream>
 #include <cassert>
 #include <iostream>
@@ -51,6 +53,62 @@ std::string_view FormulaError::ToString() const {
 
 // ---------------------------------------- class FormulaError END ----------------------------------------
 
+// ---------------------------------------- class CellInterface -------------------------------------------
+
+// разбор значения текстовой ячейки как числа для формул
+std::optional<double> ParseCellNumber(std::string_view text) {
+	if (text.empty()) {
+		// пустой текст трактуется как ноль
+		return 0.0;
+	}
+
+	// как и потоковый ввод, пропускаем ведущие пробельные символы
+	std::size_t begin = 0;
+	while (begin != text.size() && std::isspace(static_cast<unsigned char>(text[begin]))) {
+		++begin;
+	}
+	// from_chars не принимает плюс, пропускаем его сами, но только если за ним не следует ещё один знак
+	if (begin != text.size() && text[begin] == '+'
+		&& (begin + 1 == text.size() || (text[begin + 1] != '+' && text[begin + 1] != '-'))) {
+		++begin;
+	}
+
+	double value = 0.0;
+	const char* first = text.data() + begin;
+	const char* last = text.data() + text.size();
+	auto [ptr, ec] = std::from_chars(first, last, value);
+
+	if (ec == std::errc::result_out_of_range && ptr == last) {
+		// при выходе за диапазон from_chars не даёт значения, а потоковый ввод отвергает только переполнение,
+		// слишком малые числа он принимает. Этот редкий случай разбираем через strtod
+		value = std::strtod(std::string(first, last).c_str(), nullptr);
+		ec = std::errc();
+	}
+
+	// строка должна быть числом целиком, бесконечность и nan потоковый ввод тоже не принимает
+	if (ec != std::errc() || ptr != last || !std::isfinite(value)) {
+		return std::nullopt;
+	}
+	return value;
+}
+
+// значение ячейки в виде числа для вычисления формул
+std::variant<double, FormulaError> CellInterface::GetNumericValue() const {
+	Value value = GetValue();
+	if (const double* number = std::get_if<double>(&value)) {
+		return *number;
+	}
+	if (const FormulaError* error = std::get_if<FormulaError>(&value)) {
+		return *error;
+	}
+	if (auto number = ParseCellNumber(std::get<std::string>(value))) {
+		return *number;
+	}
+	return FormulaError(FormulaError::Category::Value);
+}
+
+// ---------------------------------------- class CellInterface END ---------------------------------------
+
 namespace detail {
 
 	// блок статик расчётов при компиляции
@@ -829,7 +887,7 @@ bool Position::operator==(const Position rhs) const {
 }
 
 bool Position::operator!=(const Position rhs) const {
-	return this->col != rhs.col && this->row != rhs.row;
+	return !(*this == rhs);
 }
 
 bool Position::operator<(const Position rhs) const {
@@ -1,25 +1,1916 @@
 ﻿#include "unit_test_system.h"
 #include "test_runner_p.h"
+#include "FormulaAST.h"
+#include "snapshot.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace unit_tests {
+
+	namespace detail {
+
+		// лучшее время выполнения функции в миллисекундах из нескольких запусков
+		template <typename Func>
+		double MeasureBest(int runs, Func func) {
+			double best = std::numeric_limits<double>::max();
+			for (int i = 0; i != runs; ++i) {
+				auto start = std::chrono::steady_clock::now();
+				func();
+				std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+				best = std::min(best, elapsed.count());
+			}
+			return best;
+		}
+
+		// случайное синтаксически корректное выражение заданной глубины
+		std::string RandomExpression(std::mt19937& random, int depth) {
+			static const std::vector<std::string> atoms = { "1", "25", "0.5", ".75", "3e2", "4E-1", "1.5e+1", "A1", "B12", "AA7", "XFD16384" };
+			static const std::vector<std::string> operations = { "+", "-", "*", "/" };
+
+			int choice = depth > 0 ? static_cast<int>(random() % 5) : 0;
+			switch (choice)
+			{
+			case 0:
+				return atoms[random() % atoms.size()];
+			case 1:
+				return (random() % 2 ? "-" : "+") + RandomExpression(random, depth - 1);
+			case 2:
+				return "(" + RandomExpression(random, depth - 1) + ")";
+			default:
+				return RandomExpression(random, depth - 1) + (random() % 3 ? "" : " ")
+					+ operations[random() % operations.size()] + RandomExpression(random, depth - 1);
+			}
+		}
+
+		// заполнение таблицы rows x cols вперемешку числами, текстом, формулами со ссылками и ошибками
+		void FillMixedSheet(Sheet& sheet, int rows, int cols) {
+			for (int row = 0; row != rows; ++row) {
+				for (int col = 0; col != cols; ++col) {
+					Position pos(row, col);
+					switch ((row + col) % 4)
+					{
+					case 0:
+						sheet.SetCell(pos, std::to_string(row * col));
+						break;
+					case 1:
+						sheet.SetCell(pos, "word" + std::to_string(col));
+						break;
+					case 2:
+						sheet.SetCell(pos, col ? "=" + Position(row, col - 1).ToString() + "+1" : "=1");
+						break;
+					default:
+						sheet.SetCell(pos, "=1/" + std::to_string(row % 3));
+						break;
+					}
+				}
+			}
+		}
+
+	} // namespace detail
+
+	namespace parser_tests {
+
+		// сверка рукописного парсера с ANTLR
+		void ParserDifferentialTest() {
+
+			// описание результата разбора: структура дерева, печать формулы и ссылки либо отказ
+			auto describe = [](auto parse, const std::string& text) -> std::optional<std::string> {
+				try {
+					FormulaAST ast = parse(text);
+					std::ostringstream out;
+					ast.Print(out);
+					out << '|';
+					ast.PrintFormula(out);
+					out << '|';
+					ast.PrintReferenceCells(out);
+					return out.str();
+				}
+				catch (const std::exception&) {
+					return std::nullopt;
+				}
+			};
+			auto direct = [](const std::string& text) {
+				return ParseFormulaAST(text);
+			};
+			auto reference = [](const std::string& text) {
+				return ParseFormulaASTReference(text);
+			};
+			auto check = [&](const std::string& text) {
+				assert(describe(direct, text) == describe(reference, text));
+			};
+
+			{
+				// граничные случаи лексера и приоритетов
+				const std::vector<std::string> samples = {
+					"1", " 1 ", "1+2*3", "(1+2)*3", "1-2-3", "8/4/2", "-1*2", "-(1*2)", "--1", "+-1", "1--2", "1*-2",
+					"-A1+ +B2", "((A1))", "1e5", "1E5", "1e+5", "1e-5", ".5", "1.5e3", "1.", "1e", "1E", "1e+", "e1",
+					"1.5.5", "A", "a1", "A1B2", "1 2", "1A1", "A1 1", "(", ")", "()", "(1", "1)", "1+", "*1", "",
+					" ", "1\t+\r\n2", "1e400", "1e-400", "XFD16384", "XFE1", "A16385", "ZZZZ1", "1$", "1,5", "A01"
+				};
+				for (const std::string& sample : samples) {
+					check(sample);
+				}
+			}
+
+			{
+				// случайные корректные выражения
+				std::mt19937 random(42);
+				for (int i = 0; i != 2000; ++i) {
+					std::string text = detail::RandomExpression(random, 6);
+					assert(describe(direct, text).has_value());
+					check(text);
+				}
+			}
+
+			{
+				// случайные последовательности лексем, в основном некорректные
+				const std::vector<std::string> tokens = {
+					"1", "2.5", ".5", "1e3", "A1", "B12", "+", "-", "*", "/", "(", ")", " ", "1.", "e", "E", "XFE1", "Z"
+				};
+				std::mt19937 random(7);
+				for (int i = 0; i != 5000; ++i) {
+					std::string text;
+					for (int length = 1 + random() % 8; length != 0; --length) {
+						text += tokens[random() % tokens.size()];
+					}
+					check(text);
+				}
+			}
+		}
+
+	} // namespace parser_tests
+
+	namespace graph_tests {
+
+		// хранение связей ячеек в графе зависимостей листа
+		void DependencyGraphTest() {
+
+			{
+				// малая вершина хранит рёбра на месте, крупная - в хеш-таблице, поведение одинаковое
+				EdgeSet edges;
+				for (int row = 0; row != 100; ++row) {
+					assert(edges.Insert({ row, 0 }));
+					assert(!edges.Insert({ row, 0 }));
+				}
+				assert(edges.Size() == 100 && edges.Contains({ 42, 0 }));
+				for (int row = 0; row != 100; row += 2) {
+					assert(edges.Erase({ row, 0 }));
+				}
+				assert(!edges.Erase({ 0, 0 }) && edges.Size() == 50);
+				assert(edges.ToVector().front() == Position(1, 0));
+			}
+
+			{
+				// замена ссылок убирает прежние рёбра, пустые вершины не остаются в графе
+				DependencyGraph graph;
+				graph.SetPrecedents({ 0, 2 }, { { 0, 0 }, { 0, 1 } });
+				graph.SetPrecedents({ 1, 2 }, { { 0, 0 } });
+				assert(graph.EdgeCount() == 3);
+				assert((graph.GetDependents({ 0, 0 }) == std::vector<Position>{ { 0, 2 }, { 1, 2 } }));
+
+				graph.SetPrecedents({ 0, 2 }, { { 0, 1 } });
+				assert((graph.GetDependents({ 0, 0 }) == std::vector<Position>{ { 1, 2 } }));
+				assert(graph.EdgeCount() == 2);
+
+				graph.ClearPrecedents({ 0, 2 });
+				graph.ClearPrecedents({ 1, 2 });
+				assert(graph.EdgeCount() == 0 && graph.NodeCount() == 0);
+			}
+
+			{
+				// лист: зависимые формулы перечисляются, смена формулы не оставляет устаревших связей
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "2");
+				sheet.SetCell({ 0, 1 }, "=A1*3");
+				sheet.SetCell({ 1, 1 }, "=A1+B1");
+				assert((sheet.GetDependents({ 0, 0 }) == std::vector<Position>{ { 0, 1 }, { 1, 1 } }));
+				assert((sheet.GetPrecedents({ 1, 1 }) == std::vector<Position>{ { 0, 0 }, { 0, 1 } }));
+				assert(std::get<double>(sheet.GetCell({ 1, 1 })->GetValue()) == 8.0);
+
+				sheet.SetCell({ 0, 1 }, "=C1");
+				assert((sheet.GetDependents({ 0, 0 }) == std::vector<Position>{ { 1, 1 } }));
+				assert((sheet.GetDependents({ 0, 2 }) == std::vector<Position>{ { 0, 1 } }));
+
+				// смена текстовой ячейки сбрасывает кеш зависимых формул по всей цепочке
+				assert(std::get<double>(sheet.GetCell({ 1, 1 })->GetValue()) == 2.0);
+				sheet.SetCell({ 0, 2 }, "5");
+				sheet.SetCell({ 0, 0 }, "10");
+				assert(std::get<double>(sheet.GetCell({ 1, 1 })->GetValue()) == 15.0);
+
+				// формула, ставшая текстом, больше ни на что не ссылается
+				sheet.SetCell({ 0, 1 }, "text");
+				assert(sheet.GetPrecedents({ 0, 1 }).empty());
+				assert(sheet.GetDependents({ 0, 2 }).empty());
+
+				// удалённая ячейка теряет свои ссылки, ссылки на неё остаются
+				sheet.ClearCell({ 1, 1 });
+				assert(sheet.GetDependents({ 0, 0 }).empty());
+				sheet.SetCell({ 1, 1 }, "=A1");
+				sheet.ClearCell({ 0, 0 });
+				assert((sheet.GetDependents({ 0, 0 }) == std::vector<Position>{ { 1, 1 } }));
+				assert(std::get<double>(sheet.GetCell({ 1, 1 })->GetValue()) == 0.0);
+			}
+
+			{
+				// ячейка-концентратор: тысячи зависимых формул, каждая добавляется и удаляется за O(1)
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "1");
+				for (int row = 1; row != 5000; ++row) {
+					sheet.SetCell({ row, 1 }, "=A1+" + std::to_string(row));
+				}
+				assert(sheet.GetDependents({ 0, 0 }).size() == 4999);
+				for (int row = 1; row < 5000; row += 2) {
+					sheet.SetCell({ row, 1 }, "0");
+				}
+				assert(sheet.GetDependents({ 0, 0 }).size() == 2499);
+				assert(sheet.GetDependencyGraph().EdgeCount() == 2499);
+			}
+		}
+
+		// поддержка топологического порядка и отказ от рёбер, замыкающих цикл
+		void TopologicalOrderTest() {
+
+			{
+				// случайные вставки сверяются с прямым поиском пути, порядок после каждой вставки верный
+				std::mt19937 random(12);
+				DependencyGraph graph;
+				const int size = 40;
+				std::vector<std::vector<Position>> references(size);
+
+				auto reachable = [&](int from, int to) {
+					// путь от from по ссылкам к to
+					std::vector<bool> seen(size);
+					std::vector<int> stack{ from };
+					while (!stack.empty()) {
+						int current = stack.back();
+						stack.pop_back();
+						if (current == to) {
+							return true;
+						}
+						if (!seen[current]) {
+							seen[current] = true;
+							for (Position ref : references[current]) {
+								stack.push_back(ref.row);
+							}
+						}
+					}
+					return false;
+				};
+
+				for (int step = 0; step != 2000; ++step) {
+					int cell = static_cast<int>(random() % size);
+					std::vector<Position> refs;
+					for (int count = static_cast<int>(random() % 4); count != 0; --count) {
+						refs.push_back({ static_cast<int>(random() % size), 0 });
+					}
+
+					// цикл образуется, если ячейка достижима из какой-то из новых ссылок без её прежних рёбер
+					std::vector<Position> previous = std::exchange(references[cell], {});
+					bool cycle = std::any_of(refs.begin(), refs.end(), [&](Position ref) {
+						return reachable(ref.row, cell);
+					});
+
+					assert(graph.SetPrecedents({ cell, 0 }, refs) == !cycle);
+					references[cell] = cycle ? previous : refs;
+					assert(graph.GetPrecedents({ cell, 0 }).size() == std::set<Position>(references[cell].begin(), references[cell].end()).size());
+
+					std::vector<Position> order = graph.GetTopologicalOrder();
+					for (std::size_t i = 0; i != order.size(); ++i) {
+						for (Position ref : graph.GetPrecedents(order[i])) {
+							assert(std::find(order.begin(), order.begin() + i, ref) != order.begin() + i);
+						}
+					}
+				}
+			}
+
+			{
+				// формулы вводятся снизу вверх, порядок перестраивается, цикл через всю цепочку находится
+				Sheet sheet;
+				for (int row = 999; row != 0; --row) {
+					sheet.SetCell({ row, 0 }, "=A" + std::to_string(row) + "+1");
+				}
+				sheet.SetCell({ 0, 0 }, "1");
+				assert(std::get<double>(sheet.GetCell({ 999, 0 })->GetValue()) == 1000.0);
+
+				try {
+					sheet.SetCell({ 0, 0 }, "=A1000");
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+				assert(sheet.GetCell({ 0, 0 })->GetText() == "1");
+				assert(sheet.GetPrecedents({ 0, 0 }).empty());
+
+				// перемещение формулы туда, где она сослалась бы на себя, не меняет ни одну из ячеек
+				sheet.SetCell({ 0, 1 }, "=B2*2");
+				try {
+					sheet.MoveCell({ 0, 1 }, { 1, 1 });
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+				assert((sheet.GetPrecedents({ 0, 1 }) == std::vector<Position>{ { 1, 1 } }));
+				assert(sheet.GetCell({ 0, 1 })->GetText() == "=B2*2");
+			}
+		}
+
+		// сброс кешей зависимых формул после правки
+		void CacheInvalidationTest() {
+
+			auto value_of = [](const Sheet& sheet, Position pos) {
+				return std::get<double>(sheet.GetCell(pos)->GetValue());
+			};
+
+			{
+				// цепочка в сто тысяч формул: сброс идёт без рекурсии
+				const int length = 100000;
+				auto chain = [](int index) {
+					return Position(index % 16000, index / 16000);
+				};
+
+				Sheet sheet;
+				sheet.SetCell(chain(0), "1");
+				for (int i = 1; i != length; ++i) {
+					sheet.SetCell(chain(i), "=" + chain(i - 1).ToString() + "+1");
+					// чтение по порядку заполняет кеши, каждая формула берёт готовое значение предыдущей
+					assert(value_of(sheet, chain(i)) == i + 1);
+				}
+
+				sheet.SetCell(chain(0), "10");
+				for (int i = 1; i < length; i += 997) {
+					// проверки идут от начала цепочки, поэтому вычисление не уходит вглубь
+					for (int j = std::max(1, i - 996); j <= i; ++j) {
+						value_of(sheet, chain(j));
+					}
+					assert(value_of(sheet, chain(i)) == i + 10);
+				}
+			}
+
+			{
+				// ромб: к нижним ячейкам ведут 2^40 путей, каждая ячейка сбрасывается один раз
+				const int layers = 40;
+				auto bottom = [layers](double a, double b) {
+					// значение нижней ячейки столбца A, посчитанное напрямую
+					for (int row = 1; row != layers; ++row) {
+						double next = a + b;
+						b = a - b;
+						a = next;
+					}
+					return a;
+				};
+
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "1");
+				sheet.SetCell({ 0, 1 }, "0");
+				for (int row = 1; row != layers; ++row) {
+					const std::string r = std::to_string(row);
+					sheet.SetCell({ row, 0 }, "=A" + r + "+B" + r);
+					sheet.SetCell({ row, 1 }, "=A" + r + "-B" + r);
+					value_of(sheet, { row, 0 });
+					value_of(sheet, { row, 1 });
+				}
+				assert(value_of(sheet, { layers - 1, 0 }) == bottom(1, 0));
+
+				sheet.SetCell({ 0, 0 }, "2");
+				assert(value_of(sheet, { layers - 1, 0 }) == bottom(2, 0));
+
+				// правка второй входной ячейки доходит до тех же формул другими путями
+				sheet.SetCell({ 0, 1 }, "2");
+				assert(value_of(sheet, { 1, 1 }) == 0.0);
+				assert(value_of(sheet, { layers - 1, 0 }) == bottom(2, 2));
+			}
+		}
+
+		// вычисление глубоких цепочек без роста стека
+		void DeepChainEvaluationTest() {
+
+			{
+				// цепочка в двести тысяч формул читается сразу с конца
+				const int length = 200000;
+				auto chain = [](int index) {
+					return Position(index % 16000, index / 16000);
+				};
+
+				Sheet sheet;
+				sheet.SetCell(chain(0), "1");
+				for (int i = 1; i != length; ++i) {
+					sheet.SetCell(chain(i), "=" + chain(i - 1).ToString() + "+1");
+				}
+				assert(std::get<double>(sheet.GetCell(chain(length - 1))->GetValue()) == length);
+
+				// после правки начала цепочка снова считается целиком с конца
+				sheet.SetCell(chain(0), "=-5");
+				assert(std::get<double>(sheet.GetCell(chain(length - 1))->GetValue()) == length - 6);
+			}
+
+			{
+				// ошибки и ссылки на пустые ячейки проходят по цепочке так же, как при рекурсивном вычислении
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "=1/0");
+				sheet.SetCell({ 0, 1 }, "=Z1+1");
+				for (int row = 1; row != 1000; ++row) {
+					const std::string r = std::to_string(row);
+					sheet.SetCell({ row, 0 }, "=A" + r + "*2");
+					sheet.SetCell({ row, 1 }, "=B" + r + "+A" + r);
+				}
+				auto value = sheet.GetCell({ 999, 1 })->GetValue();
+				assert(std::get<FormulaError>(value) == FormulaError::Category::Div0);
+
+				sheet.SetCell({ 0, 0 }, "0");
+				assert(std::get<double>(sheet.GetCell({ 999, 1 })->GetValue()) == 1.0);
+			}
+		}
+
+		// пересчёт по уровням на нескольких потоках
+		void ParallelRecalculationTest() {
+
+			// модель из столбцов формул, каждая ссылается на соседние строки предыдущего столбца, на текст,
+			// на пустую ячейку и на ячейку, которой ещё нет; в начале одного столбца - деление на ноль
+			const int rows = 3000;
+			const int columns = 12;
+			auto build = [&](Sheet& sheet) {
+				for (int row = 0; row != rows; ++row) {
+					sheet.SetCell({ row, 0 }, std::to_string(row % 17));
+				}
+				sheet.SetCell({ 0, columns + 1 }, "3.5");
+				for (int col = 1; col != columns; ++col) {
+					const std::string prev = Position(0, col - 1).ToString();
+					const std::string letter = prev.substr(0, prev.size() - 1);
+					for (int row = 0; row != rows; ++row) {
+						const std::string r = std::to_string(row + 1);
+						const std::string below = std::to_string((row + 1) % rows + 1);
+						sheet.SetCell({ row, col }, "=" + letter + r + "*0.5+" + letter + below + "-N1+ZZ" + r + "*ZY1");
+					}
+				}
+				sheet.SetCell({ 0, 4 }, "=D1/0");
+			};
+
+			auto same = [](const CellInterface::Value& lhs, const CellInterface::Value& rhs) {
+				if (lhs.index() != rhs.index()) {
+					return false;
+				}
+				if (const double* value = std::get_if<double>(&lhs)) {
+					return *value == std::get<double>(rhs);
+				}
+				return std::get<FormulaError>(lhs) == std::get<FormulaError>(rhs);
+			};
+
+			Sheet parallel;
+			Sheet lazy;
+			build(parallel);
+			build(lazy);
+			// ZY1 появляется позже формул, которые на неё ссылаются
+			parallel.SetCell({ 0, 700 }, "1");
+			lazy.SetCell({ 0, 700 }, "1");
+
+			const std::size_t formulas = static_cast<std::size_t>(rows) * (columns - 1);
+			assert(parallel.Recalculate(4) == formulas);
+			assert(parallel.Recalculate(4) == 0);
+			for (int col = 1; col != columns; ++col) {
+				for (int row = 0; row != rows; ++row) {
+					assert(same(parallel.GetCell({ row, col })->GetValue(), lazy.GetCell({ row, col })->GetValue()));
+				}
+			}
+			assert(std::get<FormulaError>(parallel.GetCell({ 0, columns - 1 })->GetValue()) == FormulaError::Category::Div0);
+
+			// правка входной ячейки сбрасывает кеш только зависимых от неё формул, их и пересчитываем
+			parallel.SetCell({ 10, 0 }, "-100");
+			lazy.SetCell({ 10, 0 }, "-100");
+			const std::size_t dirty = parallel.Recalculate(3);
+			assert(dirty > 0 && dirty < formulas);
+			for (int col = 1; col != columns; ++col) {
+				for (int row = 0; row != rows; ++row) {
+					assert(same(parallel.GetCell({ row, col })->GetValue(), lazy.GetCell({ row, col })->GetValue()));
+				}
+			}
+
+			{
+				// однопоточный пересчёт цепочки: по одной формуле на уровень
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "1");
+				for (int row = 1; row != 16000; ++row) {
+					sheet.SetCell({ row, 0 }, "=A" + std::to_string(row) + "+1");
+				}
+				assert(sheet.Recalculate(1) == 15999);
+				assert(sheet.GetDirectCell({ 15999, 0 })->IsCalculated());
+				assert(std::get<double>(sheet.GetCell({ 15999, 0 })->GetValue()) == 16000.0);
+			}
+		}
+
+		// пакетная запись ячеек и её откат
+		void BatchSetCellsTest() {
+
+			auto value_of = [](const Sheet& sheet, Position pos) {
+				return std::get<double>(sheet.GetCell(pos)->GetValue());
+			};
+
+			{
+				// ссылки внутри пакета разрешаются в самом пакете, кеш зависимых сбрасывается
+				Sheet sheet;
+				sheet.SetCell({ 0, 3 }, "=A1*2");
+				assert(value_of(sheet, { 0, 3 }) == 0.0);
+
+				sheet.SetCells({ { { 0, 0 }, "=B1+C1" }, { { 0, 1 }, "2" }, { { 0, 2 }, "=B1*10" } });
+				assert(value_of(sheet, { 0, 0 }) == 22.0);
+				assert(value_of(sheet, { 0, 3 }) == 44.0);
+				assert(!sheet.IsFutureDependendCell({ 0, 0 }) && !sheet.IsFutureDependendCell({ 0, 1 }));
+				assert(sheet.GetPrintableSize() == (Size{ 1, 4 }));
+
+				// повтор позиции: действует последняя правка
+				sheet.SetCells({ { { 0, 1 }, "=E1" }, { { 0, 1 }, "5" } });
+				assert(sheet.GetPrecedents({ 0, 1 }).empty());
+				assert(value_of(sheet, { 0, 3 }) == 110.0);
+			}
+
+			{
+				// цикл или ошибка разбора в любой ячейке пакета оставляют лист прежним
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "1");
+				sheet.SetCell({ 0, 1 }, "=A1+1");
+				assert(value_of(sheet, { 0, 1 }) == 2.0);
+
+				try {
+					sheet.SetCells({ { { 5, 5 }, "7" }, { { 0, 0 }, "=B1" } });
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+				try {
+					sheet.SetCells({ { { 5, 5 }, "7" }, { { 0, 0 }, "=C1" }, { { 0, 2 }, "=1+" } });
+					assert(false);
+				}
+				catch (const FormulaException&) {
+				}
+				assert(sheet.GetCell({ 5, 5 }) == nullptr);
+				assert(sheet.GetCell({ 0, 0 })->GetText() == "1");
+				assert(sheet.GetPrecedents({ 0, 0 }).empty());
+				assert(value_of(sheet, { 0, 1 }) == 2.0);
+				assert(sheet.GetDependencyGraph().EdgeCount() == 1);
+			}
+
+			{
+				// крупный пакет проверяется на циклы одним обходом, порядок графа после него верен
+				const int length = 5000;
+				std::vector<Sheet::CellUpdate> updates;
+				for (int row = 1; row != length; ++row) {
+					updates.push_back({ { row, 0 }, "=A" + std::to_string(row) + "+1" });
+				}
+				updates.push_back({ { 0, 0 }, "=A" + std::to_string(length) });
+
+				Sheet sheet;
+				try {
+					sheet.SetCells(updates);
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+				assert(sheet.IsEmpty() && sheet.GetDependencyGraph().EdgeCount() == 0);
+
+				updates.back().second = "1";
+				sheet.SetCells(updates);
+				assert(value_of(sheet, { length - 1, 0 }) == length);
+
+				const DependencyGraph& graph = sheet.GetDependencyGraph();
+				std::vector<Position> order = graph.GetTopologicalOrder();
+				std::unordered_map<Position, std::size_t, PositionHasher> index;
+				for (std::size_t i = 0; i != order.size(); ++i) {
+					index[order[i]] = i;
+				}
+				for (Position pos : order) {
+					graph.ForEachPrecedent(pos, [&](Position ref) {
+						assert(index.at(ref) < index.at(pos));
+					});
+				}
+
+				// небольшой пакет в большом графе вставляется по одной ячейке и так же откатывается
+				try {
+					sheet.SetCells({ { { 0, 1 }, "=A10" }, { { 0, 2 }, "=A100" }, { { 10, 0 }, "=C1" } });
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+				assert(graph.EdgeCount() == static_cast<std::size_t>(length - 1));
+				assert(sheet.GetCell({ 0, 1 }) == nullptr);
+				assert(sheet.GetCell({ 10, 0 })->GetText() == "=A10+1");
+
+				// ссылка на себя в крупном пакете
+				Sheet self;
+				try {
+					self.SetCells({ { { 0, 0 }, "=A1" } });
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+				assert(self.IsEmpty());
+			}
+
+			{
+				// правки открытого пакета не видны до Commit(), отменённый пакет не оставляет следов
+				Sheet sheet;
+				sheet.BeginBatch();
+				assert(sheet.IsBatchActive());
+				sheet.SetCell({ 0, 0 }, "=B1*2");
+				sheet.SetCell({ 0, 1 }, "4");
+				assert(sheet.GetCell({ 0, 0 }) == nullptr);
+				sheet.Commit();
+				assert(!sheet.IsBatchActive());
+				assert(value_of(sheet, { 0, 0 }) == 8.0);
+
+				sheet.BeginBatch();
+				sheet.SetCell({ 0, 1 }, "=A1");
+				try {
+					sheet.Commit();
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+				assert(!sheet.IsBatchActive());
+				assert(sheet.GetCell({ 0, 1 })->GetText() == "4");
+
+				sheet.BeginBatch();
+				sheet.SetCell({ 0, 1 }, "100");
+				sheet.Rollback();
+				assert(!sheet.IsBatchActive());
+				assert(value_of(sheet, { 0, 0 }) == 8.0);
+
+				try {
+					sheet.BeginBatch();
+					sheet.SetCell(Position::NONE, "1");
+					assert(false);
+				}
+				catch (const InvalidPositionException&) {
+				}
+				sheet.Rollback();
+			}
+		}
+
+		// ссылки на ещё не созданные ячейки
+		void PendingReferencesTest() {
+
+			Sheet sheet;
+			sheet.SetCell({ 0, 1 }, "=A1*2");
+			sheet.SetCell({ 1, 1 }, "=A1+A2");
+
+			// ожидаемая позиция выглядит пустой ячейкой без ссылок, неупомянутая позиция - отсутствующей
+			const CellInterface* pending = sheet.GetCell({ 0, 0 });
+			assert(pending != nullptr && sheet.GetDirectCell({ 0, 0 }) == nullptr);
+			assert(pending->GetText().empty() && pending->GetReferencedCells().empty());
+			assert(std::get<std::string>(pending->GetValue()).empty());
+			assert(sheet.IsFutureDependendCell({ 0, 0 }) && sheet.IsFutureDependendCell({ 1, 0 }));
+			assert(sheet.GetCell({ 2, 0 }) == nullptr && !sheet.IsFutureDependendCell({ 2, 0 }));
+			assert(std::get<double>(sheet.GetCell({ 1, 1 })->GetValue()) == 0.0);
+
+			// появившаяся ячейка занимает вершину графа вместе с зависимыми и сбрасывает их кеш
+			sheet.SetCell({ 0, 0 }, "3");
+			assert(!sheet.IsFutureDependendCell({ 0, 0 }));
+			assert((sheet.GetDependents({ 0, 0 }) == std::vector<Position>{ { 0, 1 }, { 1, 1 } }));
+			assert(std::get<double>(sheet.GetCell({ 0, 1 })->GetValue()) == 6.0);
+			assert(std::get<double>(sheet.GetCell({ 1, 1 })->GetValue()) == 3.0);
+
+			// удалённая ячейка снова становится ожидаемой, зависимые видят ноль
+			sheet.ClearCell({ 0, 0 });
+			assert(sheet.IsFutureDependendCell({ 0, 0 }));
+			assert(std::get<double>(sheet.GetCell({ 0, 1 })->GetValue()) == 0.0);
+
+			// позиция, на которую больше никто не ссылается, исчезает вместе с вершиной
+			sheet.SetCell({ 1, 1 }, "=A1");
+			assert(sheet.GetCell({ 1, 0 }) == nullptr);
+			assert(sheet.GetDependencyGraph().NodeCount() == 3);
+		}
+
+	} // namespace graph_tests
+
+	namespace position_tests {
+
+		// запуск всех тестов структуры позиции
+		void PositionCompleteTests() {
+			Position pos(0,0);
+			pos.RunAllTest();
+		}
+
+	} // namespace position_tests 
+
+	namespace storage_tests {
+
+		// размещение ячеек по блокам хранилища
+		void SheetStorageBlocksTest() {
+
+			{
+				Sheet sheet;
+				SheetStorage storage;
+
+				// ячейки на границах блоков и в разных строках блоков
+				const std::vector<Position> positions = { {0, 0}, {0, 63}, {0, 64}, {63, 0}, {64, 64}, {16383, 16383} };
+				for (const auto& pos : positions) {
+					storage.Emplace(pos, sheet);
+				}
+				assert(storage.Size() == positions.size());
+
+				// обход идёт по строкам блоков, внутри блока построчно
+				std::vector<Position> visited;
+				for (const auto& item : storage) {
+					assert(storage.Get(item.first) == item.second);
+					visited.push_back(item.first);
+				}
+				const std::vector<Position> expected = { {0, 0}, {0, 63}, {63, 0}, {0, 64}, {64, 64}, {16383, 16383} };
+				assert(visited == expected);
+
+				// удаление последней ячейки блока освобождает блок
+				storage.Erase({ 16383, 16383 });
+				assert(storage.Get({ 16383, 16383 }) == nullptr);
+				assert(storage.GetBlock(255, 255) == nullptr);
+				assert(storage.GetBlock(0, 0)->Count() == 3);
+
+				storage.Clear();
+				assert(storage.IsEmpty());
+				assert(storage.begin() == storage.end());
+			}
+
+			{
+				Sheet a;
+				a.SetCell({ 0, 0 }, "=XFD16384");
+				a.SetCell({ 16383, 16383 }, "2");
+				assert(a.GetPrintableSize() == Size(16384, 16384));
+				assert(a.GetCell({ 0, 0 })->GetValue() == CellInterface::Value(2.0));
+
+				a.ClearCell({ 16383, 16383 });
+				assert(a.GetPrintableSize() == Size(1, 1));
+			}
+		}
+
+
+		// обход заполненных ячеек диапазона
+		void SheetRangeVisitTest() {
+			Sheet a;
+			a.SetCell({ 0, 0 }, "A1");
+			a.SetCell({ 2, 70 }, "BS3");
+			a.SetCell({ 2, 5 }, "F3");
+			a.SetCell({ 100, 3 }, "D101");
+			a.SetCell({ 16383, 16383 }, "XFD16384");
+
+			// полный обход идёт в построчном порядке
+			std::vector<std::string> visited;
+			a.ForEachInRange({ Position(0, 0), Size(Position::MAX_ROWS, Position::MAX_COLS) }, [&](Position, const Cell& cell) {
+				visited.push_back(cell.GetText());
+				});
+			assert((visited == std::vector<std::string>{ "A1", "F3", "BS3", "D101", "XFD16384" }));
+
+			// обход части области отсекает ячейки за её границами
+			std::vector<Position> inner;
+			a.ForEachInRange({ Position(1, 4), Size(100, 67) }, [&](Position pos, const Cell&) {
+				inner.push_back(pos);
+				});
+			assert((inner == std::vector<Position>{ { 2, 5 }, { 2, 70 } }));
+
+			// пустой диапазон ничего не посещает
+			bool touched = false;
+			a.ForEachInRange({ Position(3, 0), Size(97, 3) }, [&](Position, const Cell&) { touched = true; });
+			assert(!touched);
+		}
+
+
+		// переиспользование памяти слэб-арены
+		void SlabArenaTest() {
+
+			{
+				SlabArena arena;
+
+				// объекты одного класса размера нарезаются из одного слэба
+				std::vector<std::string*> strings;
+				for (int i = 0; i != 100; ++i) {
+					strings.push_back(arena.Create<std::string>(std::to_string(i)));
+				}
+				assert(arena.SlabCount() == 1);
+				assert(*strings[42] == "42");
+
+				// освобождённый адрес уходит в список свободных и выдаётся повторно
+				std::string* freed = strings[10];
+				arena.Destroy(freed);
+				strings[10] = arena.Create<std::string>("again");
+				assert(strings[10] == freed);
+
+				for (auto* str : strings) {
+					arena.Destroy(str);
+				}
+				assert(arena.SlabCount() == 1);
+			}
+
+			{
+				// очистка ячеек таблицы возвращает память в арену
+				Sheet a;
+				for (int i = 0; i != 1000; ++i) {
+					a.SetCell({ i, 0 }, "text");
+				}
+				std::size_t slabs = a.GetArena().SlabCount();
+
+				for (int round = 0; round != 3; ++round) {
+					for (int i = 0; i != 1000; ++i) {
+						a.ClearCell({ i, 0 });
+					}
+					for (int i = 0; i != 1000; ++i) {
+						a.SetCell({ i, 0 }, "=1+2");
+					}
+				}
+				assert(a.GetArena().SlabCount() <= slabs + 1);
+			}
+		}
+
+		void PrintableAreaTest() {
+
+			{
+				Sheet a;
+				assert(a.GetPrintableSize() == (Size{ 0, 0 }));
+
+				a.SetCell(Position::FromString("B2"), "1");
+				a.SetCell(Position::FromString("E3"), "text");
+				a.SetCell(Position::FromString("C9"), "=B2");
+				assert(a.GetPrintableSize() == (Size{ 9, 5 }));
+
+				// удаление внутренней ячейки границ не сдвигает
+				a.ClearCell(Position::FromString("B2"));
+				assert(a.GetPrintableSize() == (Size{ 9, 5 }));
+
+				// граница отступает до следующей занятой строки или столбца
+				a.ClearCell(Position::FromString("C9"));
+				assert(a.GetPrintableSize() == (Size{ 3, 5 }));
+				a.ClearCell(Position::FromString("E3"));
+				assert(a.GetPrintableSize() == (Size{ 0, 0 }));
+			}
+
+			{
+				// соседние слова битовой карты и дальние углы листа
+				Sheet a;
+				a.SetCell({ 63, 64 }, "a");
+				a.SetCell({ 64, 63 }, "b");
+				a.SetCell({ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 }, "c");
+				assert(a.GetPrintableSize() == (Size{ Position::MAX_ROWS, Position::MAX_COLS }));
+
+				a.ClearCell({ Position::MAX_ROWS - 1, Position::MAX_COLS - 1 });
+				assert(a.GetPrintableSize() == (Size{ 65, 65 }));
+				a.ClearCell({ 64, 63 });
+				assert(a.GetPrintableSize() == (Size{ 64, 65 }));
+				a.ClearCell({ 63, 64 });
+				assert(a.GetPrintableSize() == (Size{ 0, 0 }));
+			}
+
+			{
+				// неудачная правка не оставляет пустую ячейку за границами области
+				Sheet a;
+				a.SetCell(Position::FromString("A1"), "=B1");
+				try {
+					a.SetCell(Position::FromString("Z20"), "=A1+");
+					assert(false);
+				}
+				catch (const FormulaException&) {
+				}
+				try {
+					a.SetCell(Position::FromString("B1"), "=A1");
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+				assert(a.GetPrintableSize() == (Size{ 1, 1 }));
+				assert(a.GetCell(Position::FromString("Z20")) == nullptr);
+
+				// копия и перемещённый лист получают ту же область
+				a.SetCell(Position::FromString("C4"), "x");
+				Sheet b(a);
+				assert(b.GetPrintableSize() == (Size{ 4, 3 }));
+				Sheet c(std::move(b));
+				assert(c.GetPrintableSize() == (Size{ 4, 3 }));
+			}
+		}
+
+		void SnapshotTest() {
+			const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_snapshot_test.bin").string();
+
+			Sheet sheet;
+			sheet.SetCell({ 0, 0 }, "2");
+			sheet.SetCell({ 0, 1 }, "'=escaped");
+			sheet.SetCell({ 0, 2 }, "");
+			sheet.SetCell({ 1, 0 }, "=+A1*(3-1)");
+			sheet.SetCell({ 1, 1 }, "=-A2/0");
+			sheet.SetCell({ 1, 2 }, "=Z9+B1");
+			for (int row = 2; row != 50; ++row) {
+				// заполненный столбец разделяет одну формулу
+				sheet.SetCell({ row, 0 }, "=A" + std::to_string(row) + "+1");
+			}
+			// часть формул посчитана до сохранения, часть - нет
+			assert(std::get<double>(sheet.GetCell({ 1, 0 })->GetValue()) == 4.0);
+			sheet.GetCell({ 1, 1 })->GetValue();
+			sheet.GetCell({ 1, 2 })->GetValue();
+			sheet.SaveSnapshot(path);
+
+			std::ostringstream texts;
+			sheet.PrintTexts(texts);
+			std::ostringstream values;
+			sheet.PrintValues(values);
+
+			{
+				// загрузка заменяет прежнее содержимое листа
+				Sheet loaded;
+				loaded.SetCell({ 70, 7 }, "old");
+				loaded.LoadSnapshot(path);
+				assert(loaded.GetCell({ 70, 7 }) == nullptr);
+				assert(loaded.GetPrintableSize() == sheet.GetPrintableSize());
+
+				// кеш посчитанных формул восстановлен, остальные считаются при чтении
+				const Cell* computed = loaded.GetDirectCell({ 1, 0 });
+				assert(computed->IsCalculated() && !loaded.GetDirectCell({ 49, 0 })->IsCalculated());
+				assert(computed->GetText() == "=+A1*(3-1)");
+				assert(std::get<FormulaError>(loaded.GetCell({ 1, 1 })->GetValue()) == FormulaError(FormulaError::Category::Div0));
+
+				// рёбра графа и ожидаемые позиции
+				auto sorted = [](std::vector<Position> positions) {
+					std::sort(positions.begin(), positions.end());
+					return positions;
+				};
+				assert((sorted(loaded.GetPrecedents({ 1, 2 })) == std::vector<Position>{ { 0, 1 }, { 8, 25 } }));
+				assert(loaded.GetCell({ 8, 25 }) != nullptr && loaded.GetCell({ 8, 25 })->GetText().empty());
+				assert((sorted(loaded.GetDependents({ 1, 0 })) == std::vector<Position>{ { 2, 0 }, { 1, 1 } }));
+
+				std::ostringstream loaded_texts;
+				loaded.PrintTexts(loaded_texts);
+				assert(loaded_texts.str() == texts.str());
+				std::ostringstream loaded_values;
+				loaded.PrintValues(loaded_values);
+				assert(loaded_values.str() == values.str());
+
+				// правка загруженного листа сбрасывает восстановленные кеши зависимых
+				loaded.SetCell({ 0, 0 }, "10");
+				assert(std::get<double>(loaded.GetCell({ 1, 0 })->GetValue()) == 20.0);
+				assert(std::get<double>(loaded.GetCell({ 49, 0 })->GetValue()) == 68.0);
+				try {
+					loaded.SetCell({ 0, 0 }, "=A50");
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+			}
+
+			{
+				// обрезанный файл и чужой формат отвергаются, лист остаётся прежним
+				std::string bytes;
+				{
+					std::ifstream input(path, std::ios::binary);
+					bytes.assign(std::istreambuf_iterator<char>(input), {});
+				}
+				Sheet loaded;
+				loaded.SetCell({ 0, 0 }, "keep");
+
+				auto rejects = [&](const std::string& content) {
+					{
+						std::ofstream output(path, std::ios::binary | std::ios::trunc);
+						output << content;
+					}
+					try {
+						loaded.LoadSnapshot(path);
+					}
+					catch (const SnapshotException&) {
+						return true;
+					}
+					return false;
+				};
+
+				assert(rejects(bytes.substr(0, bytes.size() - 1)));
+				assert(rejects(bytes.substr(0, 10)));
+				assert(rejects("not a snapshot at all, just some text"));
+				std::string version = bytes;
+				version[8] = 2;
+				assert(rejects(version));
+
+				// рёбра, якоря и смещения ссылок сверяются с формулами: подмена любого поля отвергается
+				snapshot::Header header;
+				std::memcpy(&header, bytes.data(), sizeof(header));
+				const std::size_t nodes_at = sizeof(header) + header.formulas * sizeof(snapshot::Formula);
+				const std::size_t cells_at = nodes_at + header.nodes * sizeof(snapshot::Node);
+				const std::size_t edges_at = cells_at + header.cells * sizeof(snapshot::Cell);
+				auto patched = [](std::string content, std::size_t at, auto value) {
+					std::memcpy(content.data() + at, &value, sizeof(value));
+					return content;
+				};
+				auto record_at = [&](Position pos) {
+					for (std::size_t at = cells_at; ; at += sizeof(snapshot::Cell)) {
+						snapshot::Cell record;
+						std::memcpy(&record, bytes.data() + at, sizeof(record));
+						if (record.row == pos.row && record.col == pos.col) {
+							return at;
+						}
+					}
+				};
+
+				std::size_t formula_cell_at = cells_at;
+				for (snapshot::Cell record; ; formula_cell_at += sizeof(record)) {
+					std::memcpy(&record, bytes.data() + formula_cell_at, sizeof(record));
+					if (record.formula != snapshot::NO_FORMULA) {
+						break;
+					}
+				}
+				std::size_t cell_node_at = nodes_at;
+				for (snapshot::Node node; ; cell_node_at += sizeof(node)) {
+					std::memcpy(&node, bytes.data() + cell_node_at, sizeof(node));
+					if (node.kind == static_cast<std::uint8_t>(FormulaNode::Kind::Cell)) {
+						break;
+					}
+				}
+
+				assert(rejects(patched(bytes, edges_at + offsetof(snapshot::Edge, row), 16000)));
+				assert(rejects(patched(bytes, formula_cell_at + offsetof(snapshot::Cell, anchor_row), 100)));
+				assert(rejects(patched(bytes, formula_cell_at + offsetof(snapshot::Cell, anchor_row), std::numeric_limits<std::int32_t>::max())));
+				assert(rejects(patched(bytes, cell_node_at + offsetof(snapshot::Node, row), std::numeric_limits<std::int32_t>::max())));
+				assert(rejects(patched(bytes, cell_node_at + offsetof(snapshot::Node, col), std::numeric_limits<std::int32_t>::min())));
+
+				// кеш: неизвестный вид, неизвестная категория ошибки, кеш у текста
+				const std::size_t div0_at = record_at({ 1, 1 });
+				assert(rejects(patched(bytes, div0_at + offsetof(snapshot::Cell, cache), std::uint8_t(7))));
+				assert(rejects(patched(bytes, div0_at + offsetof(snapshot::Cell, error), std::uint8_t(9))));
+				const std::size_t number_at = record_at({ 0, 0 });
+				assert(rejects(patched(bytes, number_at + offsetof(snapshot::Cell, cache), static_cast<std::uint8_t>(snapshot::CacheKind::number))));
+
+				// повтор позиции: текст B1 записан поверх A1
+				const std::size_t escaped_at = record_at({ 0, 1 });
+				assert(rejects(patched(bytes, escaped_at + offsetof(snapshot::Cell, col), std::int32_t(0))));
+
+				// посчитанная B2 при непосчитанной влияющей формуле A2 - кеш B2 устарел бы после правки A1
+				assert(rejects(patched(bytes, record_at({ 1, 0 }) + offsetof(snapshot::Cell, cache), static_cast<std::uint8_t>(snapshot::CacheKind::none))));
+
+				assert(loaded.GetCell({ 0, 0 })->GetText() == "keep");
+				assert(loaded.GetPrintableSize() == (Size{ 1, 1 }));
+
+				// неизменённый файл по-прежнему загружается
+				assert(!rejects(bytes));
+			}
+
+			std::remove(path.c_str());
+		}
+
+		void CopyOnWriteTest() {
+			auto texts = [](const Sheet& sheet) {
+				std::ostringstream out;
+				sheet.PrintTexts(out);
+				return out.str();
+			};
+			auto values = [](const Sheet& sheet) {
+				std::ostringstream out;
+				sheet.PrintValues(out);
+				return out.str();
+			};
+			auto number = [](const Sheet& sheet, Position pos) {
+				return std::get<double>(sheet.GetCell(pos)->GetValue());
+			};
+
+			// цепочка формул через границы блоков и ссылка на ещё не созданную ячейку
+			Sheet sheet;
+			for (int row = 0; row != 200; ++row) {
+				sheet.SetCell({ row, 0 }, std::to_string(row));
+				sheet.SetCell({ row, 1 }, row ? "=B" + std::to_string(row) + "+A" + std::to_string(row + 1) : "=A1");
+			}
+			sheet.SetCell({ 0, 100 }, "=B200*2+CZ300");
+			sheet.SetCell({ 150, 70 }, "text");
+			const std::string original_texts = texts(sheet);
+
+			{
+				// копия не создаёт ячеек, делит формулы и считает формулы исходного листа
+				Sheet copy(sheet);
+				assert(copy.GetArena().SlabCount() == 0);
+				assert(&copy.GetFormulaPool() == &sheet.GetFormulaPool());
+				assert(sheet.GetDirectCell({ 199, 1 })->IsCalculated());
+				assert(texts(copy) == original_texts && values(copy) == values(sheet));
+				assert(copy.GetPrintableSize() == sheet.GetPrintableSize());
+
+				// правка исходного листа не видна копии, и наоборот
+				const std::string copy_values = values(copy);
+				sheet.SetCell({ 0, 0 }, "1000");
+				assert(number(sheet, { 199, 1 }) == 19900.0 + 1000.0);
+				assert(number(copy, { 199, 1 }) == 19900.0);
+				assert(values(copy) == copy_values);
+
+				copy.SetCell({ 199, 0 }, "=A199+1");
+				copy.ClearCell({ 150, 70 });
+				assert(number(copy, { 0, 100 }) == (19900.0 - 199.0 + 199.0) * 2);
+				assert(number(sheet, { 0, 100 }) == 20900.0 * 2);
+				assert(sheet.GetCell({ 150, 70 })->GetText() == "text" && copy.GetCell({ 150, 70 }) == nullptr);
+				assert((copy.GetPrecedents({ 199, 0 }) == std::vector<Position>{ { 198, 0 } }));
+				assert(sheet.GetPrecedents({ 199, 0 }).empty());
+
+				// новая ячейка на месте ожидаемой ссылки видна только своему листу
+				copy.SetCell(Position::FromString("CZ300"), "1");
+				assert(number(copy, { 0, 100 }) == 19900.0 * 2 + 1.0);
+				assert(number(sheet, { 0, 100 }) == 20900.0 * 2);
+				assert(sheet.GetDirectCell(Position::FromString("CZ300")) == nullptr);
+
+				// копия переживает исходный лист
+				Sheet survivor(copy);
+				copy = Sheet();
+				assert(number(survivor, { 0, 100 }) == 19900.0 * 2 + 1.0);
+				survivor.SetCell({ 0, 0 }, "=1+1");
+				assert(number(survivor, { 0, 100 }) == 19902.0 * 2 + 1.0);
+				assert(number(sheet, { 199, 1 }) == 20900.0);
+			}
+
+			{
+				// ячейка общего блока отвечает о зависимостях так же, как граф листа, через который её читают
+				Sheet source;
+				source.SetCell({ 0, 1 }, "5");
+				source.SetCell({ 0, 0 }, "=B1");
+				Sheet copy(source);
+				const Sheet& view = copy;
+
+				copy.SetCell({ 200, 200 }, "=B1*2");
+				assert(copy.GetDependents({ 0, 1 }).size() == 2);
+				assert(view.GetDirectCell({ 0, 1 })->GetDependent().size() == 2 && view.GetDirectCell({ 0, 1 })->IsRoot());
+				assert(std::as_const(source).GetDirectCell({ 0, 1 })->GetDependent().size() == 1);
+
+				source.SetCell({ 5, 0 }, "=B1+1");
+				source.SetCell({ 0, 0 }, "text");
+				assert((std::as_const(source).GetDirectCell({ 0, 1 })->GetDependent() == std::vector<Position>{ { 5, 0 } }));
+				assert(!std::as_const(source).GetDirectCell({ 0, 0 })->IsReference());
+				assert(view.GetDirectCell({ 0, 1 })->GetDependent().size() == 2 && view.GetDirectCell({ 0, 0 })->IsReference());
+
+				// копию спрашивают после разрушения исходного листа
+				auto origin = std::make_unique<Sheet>();
+				origin->SetCell({ 0, 1 }, "5");
+				origin->SetCell({ 0, 0 }, "=B1");
+				Sheet orphan(*origin);
+				origin.reset();
+				const Sheet& orphan_view = orphan;
+				assert(orphan_view.GetDirectCell({ 0, 0 })->IsReference() && orphan_view.GetDirectCell({ 0, 0 })->IsDependsFromCell({ 0, 1 }));
+				assert((orphan_view.GetDirectCell({ 0, 1 })->GetDependent() == std::vector<Position>{ { 0, 0 } }));
+				orphan.SetCell({ 0, 2 }, "=B1");
+				assert(orphan_view.GetDirectCell({ 0, 1 })->GetDependent().size() == 2 && number(orphan, { 0, 2 }) == 5.0);
+			}
+
+			{
+				// обмен и перемещение не копируют ячеек, ячейки продолжают считаться по новому листу
+				Sheet other;
+				other.SetCell({ 0, 0 }, "5");
+				other.SetCell({ 0, 1 }, "=A1*2");
+				const std::string sheet_texts = texts(sheet);
+
+				sheet.SwapSheet(other);
+				assert(texts(other) == sheet_texts);
+				assert(number(sheet, { 0, 1 }) == 10.0);
+				sheet.SetCell({ 0, 0 }, "6");
+				assert(number(sheet, { 0, 1 }) == 12.0);
+				other.SetCell({ 0, 0 }, "0");
+				assert(number(other, { 199, 1 }) == 19900.0);
+
+				Sheet moved(std::move(other));
+				moved.SetCell({ 0, 0 }, "1");
+				assert(number(moved, { 199, 1 }) == 19901.0);
+				assert(texts(moved) != original_texts);
+
+				// присваивание копией, исходный лист после этого правится независимо
+				Sheet assigned;
+				assigned.SetCell({ 5, 5 }, "old");
+				assigned = moved;
+				assert(texts(assigned) == texts(moved) && assigned.GetCell({ 5, 5 }) == nullptr);
+				moved.SetCell({ 0, 0 }, "2");
+				assert(number(assigned, { 199, 1 }) == 19901.0 && number(moved, { 199, 1 }) == 19902.0);
+			}
+		}
+
+		// публикация версий листа и чтение их из других потоков во время правок
+		void PublishedVersionTest() {
+			auto number = [](const Sheet& sheet, Position pos) {
+				return std::get<double>(sheet.GetDirectCell(pos)->GetNumericValue());
+			};
+
+			{
+				// версия - неизменяемый посчитанный лист, правки писателя видны только в следующей версии
+				Sheet sheet;
+				assert(sheet.Snapshot() == nullptr);
+				sheet.SetCell({ 0, 0 }, "2");
+				sheet.SetCell({ 0, 1 }, "=A1*10");
+
+				auto first = sheet.Publish();
+				assert(sheet.Snapshot() == first && sheet.Publish() == first);
+				assert(first->GetVersion() == sheet.GetVersion());
+				assert(first->GetDirectCell({ 0, 1 })->IsCalculated());
+
+				sheet.SetCell({ 0, 0 }, "3");
+				sheet.SetCell({ 5, 5 }, "new");
+				assert(sheet.Snapshot() == first && number(*first, { 0, 1 }) == 20.0);
+				assert(first->GetCell({ 5, 5 }) == nullptr);
+
+				auto second = sheet.Publish();
+				assert(second != first && second->GetVersion() > first->GetVersion());
+				assert(number(*second, { 0, 1 }) == 30.0 && number(*first, { 0, 1 }) == 20.0);
+
+				// удерживаемая читателем версия переживает лист
+				sheet = Sheet();
+				assert(sheet.Snapshot() == second && sheet.GetVersion() > second->GetVersion());
+				auto empty = sheet.Publish();
+				assert(empty->IsEmpty() && number(*second, { 0, 1 }) == 30.0);
+			}
+
+			{
+				// чередование правок и публикаций не растит арену: память блоков старых версий возвращается писателю
+				Sheet sheet;
+				for (int row = 0; row != SheetStorage::BLOCK_SIZE; ++row) {
+					sheet.SetCell({ row, 0 }, std::to_string(row));
+					sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+				}
+
+				std::size_t slabs = 0;
+				for (int step = 0; step != 200; ++step) {
+					sheet.SetCell({ step % SheetStorage::BLOCK_SIZE, 0 }, std::to_string(step));
+					sheet.Publish();
+					if (step == 20) {
+						slabs = sheet.GetArena().SlabCount();
+					}
+				}
+				assert(sheet.GetArena().SlabCount() == slabs);
+			}
+
+			{
+				// писатель правит и публикует, читатели в это время видят только целые версии
+				const int rows = 2 * SheetStorage::BLOCK_SIZE;
+				const int steps = 300;
+				Sheet sheet;
+				for (int row = 0; row != rows; ++row) {
+					sheet.SetCell({ row, 0 }, "0");
+				}
+				sheet.SetCell({ 0, 1 }, "=A1+A" + std::to_string(rows));
+				sheet.Publish();
+
+				std::atomic<bool> done = false;
+				std::atomic<int> failures = 0;
+				std::vector<std::thread> readers;
+				for (int i = 0; i != 4; ++i) {
+					readers.emplace_back([&]() {
+						std::uint64_t last_version = 0;
+						double last_value = 0;
+						while (!done.load()) {
+							auto version = sheet.Snapshot();
+							const double value = number(*version, { 0, 0 });
+							bool whole = version->GetVersion() >= last_version && value >= last_value
+								&& number(*version, { rows - 1, 0 }) == value && number(*version, { 0, 1 }) == value * 2;
+
+							// печать версии тоже видит одно состояние: столбец A одинаков во всех строках
+							std::ostringstream out;
+							version->PrintValues(out);
+							std::istringstream lines(out.str());
+							std::string line, first;
+							int count = 0;
+							while (std::getline(lines, line)) {
+								line = line.substr(0, line.find('\t'));
+								first = count++ ? first : line;
+								whole = whole && line == first;
+							}
+							whole = whole && count == rows;
+							if (!whole) {
+								++failures;
+							}
+							last_version = version->GetVersion();
+							last_value = value;
+						}
+					});
+				}
+
+				for (int step = 1; step <= steps; ++step) {
+					for (int row = 0; row != rows; ++row) {
+						sheet.SetCell({ row, 0 }, std::to_string(step));
+					}
+					sheet.Publish();
+				}
+				done = true;
+				for (auto& reader : readers) {
+					reader.join();
+				}
+				assert(failures == 0);
+				assert(number(*sheet.Snapshot(), { 0, 1 }) == steps * 2.0);
+			}
+		}
+
+		// хеши содержимого: равенство листов и список различающихся ячеек
+		void ContentHashTest() {
+			{
+				// одинаковое содержимое, набранное по-разному и в другом порядке, равно по значениям
+				Sheet lhs, rhs;
+				assert(lhs.IsEqual(rhs) && lhs.GetContentHash() == 0 && lhs.Diff(rhs).empty());
+
+				lhs.SetCell({ 0, 0 }, "1");
+				lhs.SetCell({ 1, 0 }, "=A1 + 1");
+				lhs.SetCell({ 300, 200 }, "text");
+				lhs.SetCell({ 2, 0 }, "");
+				rhs.SetCell({ 300, 200 }, "text");
+				rhs.SetCell({ 2, 0 }, "");
+				rhs.SetCell({ 1, 0 }, "=(A1)+1");
+				rhs.SetCell({ 0, 0 }, "1");
+				assert(lhs.IsEqual(rhs) && rhs.IsEqual(lhs) && lhs.Diff(rhs).empty());
+
+				// формула, разделённая с другой ячейкой по абсолютному ключу, хешируется по своим адресам
+				lhs.SetCell({ 7, 2 }, "=A1*3");
+				rhs.SetCell({ 9, 9 }, "=A1*3");
+				rhs.SetCell({ 7, 2 }, "=A1*3");
+				rhs.ClearCell({ 9, 9 });
+				assert(lhs.IsEqual(rhs));
+
+				// формулы сравниваются по дереву выражения: одинаково напечатанные формулы с разной группировкой
+				// различаются, хотя Cell::IsEqual() сравнивает их по тексту
+				lhs.SetCell({ 3, 0 }, "=1+(2+3)");
+				rhs.SetCell({ 3, 0 }, "=1+2+3");
+				assert(lhs.GetCell({ 3, 0 })->GetText() == rhs.GetCell({ 3, 0 })->GetText());
+				assert(lhs.GetDirectCell({ 3, 0 })->IsEqual(rhs.GetDirectCell({ 3, 0 })));
+				assert(!lhs.IsEqual(rhs) && (lhs.Diff(rhs) == std::vector<Position>{ { 3, 0 } }));
+				rhs.SetCell({ 3, 0 }, "=1+(2+3)");
+				assert(lhs.IsEqual(rhs));
+
+				// текст и формула с одинаковым значением различаются, как и лишняя ячейка
+				rhs.SetCell({ 0, 0 }, "=1");
+				rhs.SetCell({ 5000, 5000 }, "extra");
+				assert(!lhs.IsEqual(rhs) && !rhs.IsEqual(lhs));
+				assert((lhs.Diff(rhs) == std::vector<Position>{ { 0, 0 }, { 5000, 5000 } }));
+				assert((rhs.Diff(lhs) == std::vector<Position>{ { 0, 0 }, { 5000, 5000 } }));
+
+				// возврат прежнего содержимого возвращает прежний хеш
+				rhs.SetCell({ 0, 0 }, "1");
+				rhs.ClearCell({ 5000, 5000 });
+				assert(rhs.GetContentHash() == lhs.GetContentHash() && rhs.Diff(lhs).empty());
+			}
+
+			{
+				// копия равна исходному листу, Diff() находит только правки копии в построчном порядке
+				Sheet sheet;
+				for (int row = 0; row != 200; ++row) {
+					sheet.SetCell({ row, 0 }, std::to_string(row));
+					sheet.SetCell({ row, 1 }, "=A" + std::to_string(row + 1) + "*2");
+				}
+				sheet.SetCell({ 0, 100 }, "far");
+
+				Sheet copy(sheet);
+				assert(copy.IsEqual(sheet) && copy.GetContentHash() == sheet.GetContentHash());
+
+				copy.SetCell({ 70, 0 }, "-1");
+				copy.SetCell({ 0, 100 }, "near");
+				copy.SetCell({ 0, 3 }, "new");
+				copy.MoveCell({ 150, 0 }, { 150, 2 });
+				copy.ClearCell({ 199, 1 });
+				const std::vector<Position> expected{ { 0, 3 }, { 0, 100 }, { 70, 0 }, { 150, 0 }, { 150, 2 }, { 199, 1 } };
+				assert(!copy.IsEqual(sheet) && copy.Diff(sheet) == expected && sheet.Diff(copy) == expected);
+
+				// исходный лист не изменился и равен своей новой копии
+				assert(Sheet(sheet).IsEqual(sheet) && Sheet(sheet).Diff(sheet).empty());
+			}
+
+			{
+				// загрузка снимка и вывода PrintTexts() даёт равный лист
+				Sheet sheet;
+				detail::FillMixedSheet(sheet, 300, 8);
+
+				const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_hash_test.bin").string();
+				sheet.SaveSnapshot(path);
+				Sheet loaded;
+				loaded.LoadSnapshot(path);
+				std::remove(path.c_str());
+				assert(loaded.IsEqual(sheet) && loaded.Diff(sheet).empty());
+
+				std::stringstream texts;
+				sheet.PrintTexts(texts);
+				Sheet parsed;
+				parsed.LoadTexts(texts);
+				assert(parsed.IsEqual(sheet));
+			}
+
+			{
+				// опубликованные версии сравниваются в других потоках, пока писатель правит лист
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "0");
+				sheet.SetCell({ 100, 100 }, "=A1+1");
+				auto first = sheet.Publish();
+
+				std::atomic<bool> done = false;
+				std::atomic<int> failures = 0;
+				std::vector<std::thread> readers;
+				for (int i = 0; i != 2; ++i) {
+					readers.emplace_back([&]() {
+						while (!done.load()) {
+							// версия равна первой, только пока в A1 снова ноль
+							auto version = sheet.Snapshot();
+							const bool zero = version->GetDirectCell({ 0, 0 })->GetTextData() == "0";
+							if (version->IsEqual(*first) != zero || version->Diff(*first).size() != (zero ? 0u : 1u)) {
+								++failures;
+							}
+						}
+					});
+				}
+
+				for (int step = 1; step <= 300; ++step) {
+					sheet.SetCell({ 0, 0 }, std::to_string(step % 3));
+					sheet.Publish();
+				}
+				done = true;
+				for (auto& reader : readers) {
+					reader.join();
+				}
+				assert(failures == 0 && sheet.IsEqual(*first));
+			}
+		}
+
+	} // namespace storage_tests
+
+	namespace value_tests {
+
+		// разбор числа из текста ячейки для формул
+		void TextNumberParseTest() {
+
+			{
+				// результат совпадает с разбором через поток, которым пользовались формулы раньше
+				auto stream_parse = [](const std::string& str) -> std::optional<double> {
+					double value = 0;
+					if (!str.empty()) {
+						std::istringstream in(str);
+						if (!(in >> value) || !in.eof()) {
+							return std::nullopt;
+						}
+					}
+					return value;
+				};
+
+				const std::vector<std::string> samples = {
+					"", "0", "5", "-5", "+5", "3.25", ".5", "5.", "1e3", "1E-2", "-1.5e+2", " 7", "\t 7",
+					"7 ", "+-5", "-+5", "++5", "--5", "+", "-", ".", "e5", "1e", "1e+", "abc", "5abc", "0x10",
+					"inf", "nan", "-inf", "1e400", "-1e400", "1e-400", "-2e-324", "4e-324", " ", "1 2", "007", "1,5"
+				};
+				for (const std::string& sample : samples) {
+					assert(ParseCellNumber(sample) == stream_parse(sample));
+				}
+			}
+
+			{
+				// формулы читают заранее разобранное значение текстовых ячеек
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "'12");
+				sheet.SetCell({ 0, 1 }, " 3");
+				sheet.SetCell({ 0, 2 }, "text");
+				sheet.SetCell({ 0, 3 }, "'");
+				sheet.SetCell({ 1, 0 }, "=A1+B1");
+				sheet.SetCell({ 1, 1 }, "=C1+1");
+				sheet.SetCell({ 1, 2 }, "=D1+1");
+
+				assert(std::get<double>(sheet.GetCell({ 1, 0 })->GetValue()) == 15.0);
+				assert(std::get<FormulaError>(sheet.GetCell({ 1, 1 })->GetValue()) == FormulaError::Category::Value);
+				assert(std::get<double>(sheet.GetCell({ 1, 2 })->GetValue()) == 1.0);
+
+				assert(std::get<double>(sheet.GetCell({ 0, 0 })->GetNumericValue()) == 12.0);
+				assert(std::get<FormulaError>(sheet.GetCell({ 0, 2 })->GetNumericValue()) == FormulaError::Category::Value);
+			}
+		}
 
-#include <deque>
-#include <vector>
+		// вычисление формул на стековой машине
+		void FormulaProgramTest() {
 
-namespace unit_tests {
+			auto value_of = [](Sheet& sheet, Position pos) {
+				return sheet.GetCell(pos)->GetValue();
+			};
 
-	namespace detail {
+			{
+				// постфиксный порядок операций и унарные операторы
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "2");
+				sheet.SetCell({ 1, 0 }, "=1-2-3");
+				sheet.SetCell({ 1, 1 }, "=8/(4/2)");
+				sheet.SetCell({ 1, 2 }, "=-(A1*3)+ +A1");
+				sheet.SetCell({ 1, 3 }, "=--A1/-4");
+
+				assert(std::get<double>(value_of(sheet, { 1, 0 })) == -4.0);
+				assert(std::get<double>(value_of(sheet, { 1, 1 })) == 4.0);
+				assert(std::get<double>(value_of(sheet, { 1, 2 })) == -4.0);
+				assert(std::get<double>(value_of(sheet, { 1, 3 })) == -0.5);
+
+				// печать по-прежнему строится по дереву
+				assert(sheet.GetCell({ 1, 2 })->GetText() == "=-A1*3++A1");
+			}
 
+			{
+				// глубокое выражение не помещается в стек кадра функции
+				std::string expression = "=1";
+				for (int i = 0; i != 100; ++i) {
+					expression = "=1+(" + expression.substr(1) + ")";
+				}
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, expression);
+				assert(std::get<double>(value_of(sheet, { 0, 0 })) == 101.0);
+			}
 
-	} // namespace detail
+			{
+				// переполнение промежуточного результата даёт #DIV/0!, как и при проверке каждой операции
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "text");
+				sheet.SetCell({ 1, 0 }, "=1e308*10-1e308*10");
+				sheet.SetCell({ 1, 1 }, "=1/(1e308*10)");
+				sheet.SetCell({ 1, 2 }, "=(1e308*10)+A1");
+				sheet.SetCell({ 1, 3 }, "=A1+(1e308*10)");
+				sheet.SetCell({ 1, 4 }, "=1e308*10*0");
+				sheet.SetCell({ 1, 5 }, "=1/0");
+
+				const FormulaError div0 = FormulaError::Category::Div0;
+				assert(std::get<FormulaError>(value_of(sheet, { 1, 0 })) == div0);
+				assert(std::get<FormulaError>(value_of(sheet, { 1, 1 })) == div0);
+				assert(std::get<FormulaError>(value_of(sheet, { 1, 2 })) == div0);
+				assert(std::get<FormulaError>(value_of(sheet, { 1, 3 })) == FormulaError::Category::Value);
+				assert(std::get<FormulaError>(value_of(sheet, { 1, 4 })) == div0);
+				assert(std::get<FormulaError>(value_of(sheet, { 1, 5 })) == div0);
+			}
+		}
 
-	namespace position_tests {
+		// разделение одинаковых формул между ячейками
+		void FormulaPoolTest() {
 
-		// запуск всех тестов структуры позиции
-		void PositionCompleteTests() {
-			Position pos(0,0);
-			pos.RunAllTest();
+			{
+				// одна формула на исходный текст и на все записи с тем же деревом выражения
+				FormulaPool pool;
+				auto first = pool.Intern("A1*B1").formula;
+				auto spaced = pool.Intern(" A1 * B1 ").formula;
+				auto braced = pool.Intern("(A1)*(B1)").formula;
+				auto other = pool.Intern("A1+B1").formula;
+
+				assert(first == spaced && first == braced);
+				assert(first != other);
+				assert(pool.Size() == 2);
+
+				// таблица не держит формулы, которые больше никому не нужны
+				first.reset();
+				spaced.reset();
+				braced.reset();
+				assert(pool.Size() == 1);
+
+				// некорректная формула в таблицу не попадает
+				try {
+					pool.Intern("A1*");
+					assert(false);
+				}
+				catch (const FormulaException&) {
+				}
+				assert(pool.Size() == 1);
+			}
+
+			{
+				// ключ - дерево выражения: числа сравниваются точно, порядок сложения сохраняется
+				FormulaPool pool;
+				assert(pool.Intern("0.1234567").formula != pool.Intern("0.1234568").formula);
+				assert(pool.Intern("0.1+(0.2+0.3)").formula != pool.Intern("0.1+0.2+0.3").formula);
+
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "=0.1234567");
+				sheet.SetCell({ 0, 1 }, "=0.1234568");
+				sheet.SetCell({ 1, 0 }, "=0.1+(0.2+0.3)");
+				sheet.SetCell({ 1, 1 }, "=0.1+0.2+0.3");
+				assert(std::get<double>(sheet.GetCell({ 0, 1 })->GetValue()) == 0.1234568);
+				assert(std::get<double>(sheet.GetCell({ 1, 0 })->GetValue()) == 0.1 + (0.2 + 0.3));
+				assert(std::get<double>(sheet.GetCell({ 1, 1 })->GetValue()) == 0.1 + 0.2 + 0.3);
+			}
+
+			{
+				// ячейки разделяют формулу, но кешируют результат каждая сама
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "2");
+				sheet.SetCell({ 0, 1 }, "3");
+				for (int row = 1; row != 100; ++row) {
+					sheet.SetCell({ row, 2 }, "=A1*B1+" + std::to_string(row % 4));
+				}
+				sheet.CopyCell({ 1, 2 }, { 0, 5 });
+				assert(sheet.GetFormulaPool().Size() == 4);
+
+				assert(std::get<double>(sheet.GetCell({ 1, 2 })->GetValue()) == 7.0);
+				assert(std::get<double>(sheet.GetCell({ 4, 2 })->GetValue()) == 6.0);
+				assert(std::get<double>(sheet.GetCell({ 0, 5 })->GetValue()) == 7.0);
+				assert(sheet.GetCell({ 0, 5 })->GetText() == "=A1*B1+1");
+
+				sheet.SetCell({ 0, 5 }, "=A1/B1");
+				assert(sheet.GetFormulaPool().Size() == 5);
+
+				// копия листа пользуется теми же формулами
+				Sheet copy(sheet);
+				assert(&copy.GetFormulaPool() == &sheet.GetFormulaPool());
+				assert(std::get<double>(copy.GetCell({ 2, 2 })->GetValue()) == 8.0);
+			}
+
+			{
+				// заполненный столбец разделяет одну формулу со смещениями, адреса у каждой ячейки свои
+				Sheet sheet;
+				for (int row = 0; row != 1000; ++row) {
+					sheet.SetCell({ row, 1 }, std::to_string(row));
+					sheet.SetCell({ row, 2 }, "2");
+					sheet.SetCell({ row, 3 }, "=B" + std::to_string(row + 1) + "*C" + std::to_string(row + 1));
+				}
+				assert(sheet.GetFormulaPool().Size() == 1);
+				assert(std::get<double>(sheet.GetCell({ 0, 3 })->GetValue()) == 0.0);
+				assert(std::get<double>(sheet.GetCell({ 999, 3 })->GetValue()) == 1998.0);
+				assert(sheet.GetCell({ 500, 3 })->GetText() == "=B501*C501");
+				assert((sheet.GetCell({ 500, 3 })->GetReferencedCells() == std::vector<Position>{ { 500, 1 }, { 500, 2 } }));
+
+				// запись без пробелов и со скобками попадает в ту же группу через ключ дерева
+				sheet.SetCell({ 1000, 3 }, "=(B1001) * C1001");
+				assert(sheet.GetFormulaPool().Size() == 1);
+
+				// абсолютная копия разделяет формулу по адресам, но сохраняет их
+				sheet.CopyCell({ 10, 3 }, { 0, 7 });
+				assert(sheet.GetFormulaPool().Size() == 1);
+				assert(sheet.GetCell({ 0, 7 })->GetText() == "=B11*C11");
+				assert(std::get<double>(sheet.GetCell({ 0, 7 })->GetValue()) == 20.0);
+
+				// сдвинутая формула читает ячейки по абсолютным адресам своей строки
+				sheet.SetCell({ 998, 1 }, "1");
+				assert(std::get<double>(sheet.GetCell({ 998, 3 })->GetValue()) == 2.0);
+			}
+
+			{
+				// относительный ключ сохраняет порядок сложения: сдвинутые суммы с другой группировкой не совпадают
+				Sheet sheet;
+				for (int col = 0; col != 2; ++col) {
+					sheet.SetCell({ 1, col }, "0.1");
+					sheet.SetCell({ 2, col }, "0.2");
+					sheet.SetCell({ 3, col }, "0.3");
+				}
+				sheet.SetCell({ 0, 0 }, "=A2+(A3+A4)");
+				sheet.SetCell({ 0, 1 }, "=B2+B3+B4");
+				assert(sheet.GetFormulaPool().Size() == 2);
+				assert(std::get<double>(sheet.GetCell({ 0, 0 })->GetValue()) == 0.1 + (0.2 + 0.3));
+				assert(std::get<double>(sheet.GetCell({ 0, 1 })->GetValue()) == 0.1 + 0.2 + 0.3);
+			}
+
+			{
+				// ключи записывают числа точно: близкие, но разные константы формулу не разделяют
+				FormulaPool pool;
+				auto coarse = pool.Intern("A1*1").formula;
+				auto fine = pool.Intern("A1*1.0000001").formula;
+				assert(coarse != fine);
+				assert(coarse == pool.Intern("A1*1.0").formula);
+				assert(pool.Size() == 2);
+
+				// одинаковый текст в разных ячейках - одни и те же адреса, якорем остаётся первая ячейка
+				auto at_a1 = pool.Intern("B2+1", { 0, 0 });
+				auto at_c5 = pool.Intern("B2+1", { 4, 2 });
+				assert(at_a1.formula == at_c5.formula && at_c5.anchor == Position(0, 0));
+
+				// сдвинутый текст в другой ячейке - та же формула от якоря этой ячейки
+				auto shifted = pool.Intern("C3+1", { 1, 1 });
+				assert(shifted.formula == at_a1.formula && shifted.anchor == Position(1, 1));
+				assert(shifted.formula->GetExpression(shifted.anchor) == "C3+1");
+			}
 		}
 
-	} // namespace position_tests 
+		// буферизованный вывод совпадает с выводом в поток
+		void OutputBufferTest() {
+
+			{
+				// числа форматируются так же, как operator<<(double) потока по умолчанию
+				const std::vector<double> numbers = { 0.0, -0.0, 1.0, -1.0, 0.5, 1.0 / 3.0, 2.0 / 3.0, 123456.0, 1234567.0,
+					999999.5, 0.0001, 0.00001234567, 1e100, -1e-100, 5e-324, std::numeric_limits<double>::max(), 3.14159265 };
+
+				std::ostringstream expected;
+				std::ostringstream actual;
+				{
+					// маленькая ёмкость заставляет буфер сбрасываться посреди записи
+					OutputBuffer buffer(actual, 16);
+					for (double number : numbers) {
+						expected << number << '\t';
+						buffer.Number(number);
+						buffer.Put('\t');
+					}
+					expected << FormulaError(FormulaError::Category::Div0);
+					buffer.Error(FormulaError(FormulaError::Category::Div0));
+					expected << std::string(100, '\t') << "long text that does not fit into a single buffer";
+					buffer.Fill('\t', 100);
+					buffer.Write("long text that does not fit into a single buffer");
+				}
+				assert(actual.str() == expected.str());
+			}
+
+			{
+				// печать листа через буфер повторяет содержимое ячеек
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "'=escaped");
+				sheet.SetCell({ 0, 2 }, "=1/3");
+				sheet.SetCell({ 2, 1 }, "=1/0");
+				sheet.SetCell({ 3, 3 }, "=A1+2");
+				sheet.SetCell({ 1, 1 }, "text");
+
+				std::ostringstream values;
+				sheet.PrintValues(values);
+				assert(values.str() == "=escaped\t\t0.333333\t\n\ttext\t\t\n\t#DIV/0!\t\t\n\t\t\t#VALUE!\n");
+
+				std::ostringstream texts;
+				{
+					OutputBuffer buffer(texts, 8);
+					sheet.PrintTexts(buffer);
+				}
+				assert(texts.str() == "'=escaped\t\t=1/3\t\n\ttext\t\t\n\t=1/0\t\t\n\t\t\t=A1+2\n");
+			}
+		}
+
+		// печать полосами строк совпадает с последовательной
+		void ParallelPrintTest() {
+			// широкая последняя колонка делает полосы короткими, цепочка формул проходит через все полосы
+			Sheet sheet;
+			const int rows = 1000;
+			for (int row = 0; row != rows; ++row) {
+				switch (row % 5)
+				{
+				case 0:
+					sheet.SetCell({ row, 0 }, std::to_string(row));
+					break;
+				case 1:
+					sheet.SetCell({ row, 1 }, "'=text" + std::to_string(row));
+					break;
+				case 2:
+					sheet.SetCell({ row, 2 }, "=1/" + std::to_string(row % 3));
+					break;
+				case 3:
+					// пустая строка внутри полосы
+					break;
+				default:
+					sheet.SetCell({ row, 0 }, row < 5 ? "=A1/7" : "=A" + std::to_string(row - 3) + "/7+A" + std::to_string(row - 4));
+					break;
+				}
+			}
+			sheet.SetCell({ rows / 2, 2047 }, "edge");
+
+			for (unsigned threads : { 0u, 2u, 4u }) {
+				// формулы без кеша считаются перед параллельной печатью
+				Sheet copy(sheet);
+				std::ostringstream parallel;
+				{
+					OutputBuffer buffer(parallel);
+					copy.PrintValues(buffer, threads);
+				}
+				std::ostringstream serial;
+				sheet.PrintValues(serial);
+				assert(parallel.str() == serial.str());
+
+				std::ostringstream parallel_texts;
+				{
+					OutputBuffer buffer(parallel_texts);
+					copy.PrintTexts(buffer, threads);
+				}
+				std::ostringstream serial_texts;
+				sheet.PrintTexts(serial_texts);
+				assert(parallel_texts.str() == serial_texts.str());
+			}
+		}
+
+		// загрузка листа из вывода PrintTexts
+		void LoadTextsTest() {
+
+			{
+				// текст, экранирование, формулы и пустые поля переживают круг печать - загрузка
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "'=escaped");
+				sheet.SetCell({ 0, 3 }, "=A2*2");
+				sheet.SetCell({ 1, 0 }, "21");
+				sheet.SetCell({ 3, 1 }, "=1/0");
+				sheet.SetCell({ 4, 2 }, "last");
+
+				std::ostringstream texts;
+				sheet.PrintTexts(texts);
+
+				Sheet loaded;
+				std::istringstream input(texts.str());
+				loaded.LoadTexts(input);
+				assert(loaded.GetPrintableSize() == sheet.GetPrintableSize());
+				assert(loaded.GetCell({ 2, 2 }) == nullptr);
+				assert(std::get<double>(loaded.GetCell({ 0, 3 })->GetValue()) == 42.0);
+
+				std::ostringstream loaded_texts;
+				loaded.PrintTexts(loaded_texts);
+				assert(loaded_texts.str() == texts.str());
+			}
+
+			{
+				// переводы строк "\r\n" и последняя строка без переноса
+				Sheet sheet;
+				std::istringstream input("1\t2\r\n\t=A1+B1\r\n\t\tend");
+				sheet.LoadTexts(input, 1);
+				assert(sheet.GetCell({ 0, 1 })->GetText() == "2");
+				assert(std::get<double>(sheet.GetCell({ 1, 1 })->GetValue()) == 3.0);
+				assert(sheet.GetCell({ 2, 2 })->GetText() == "end");
+				assert(sheet.GetPrintableSize() == (Size{ 3, 3 }));
+			}
+
+			{
+				// ошибка в формуле либо цикл не меняют лист
+				Sheet sheet;
+				sheet.SetCell({ 0, 0 }, "keep");
+				try {
+					std::istringstream input("=B1\t=A1\n");
+					sheet.LoadTexts(input);
+					assert(false);
+				}
+				catch (const CircularDependencyException&) {
+				}
+				try {
+					std::istringstream input("x\n=1+\n");
+					sheet.LoadTexts(input);
+					assert(false);
+				}
+				catch (const FormulaException&) {
+				}
+				assert(sheet.GetCell({ 0, 0 })->GetText() == "keep");
+				assert(sheet.GetPrintableSize() == (Size{ 1, 1 }));
+
+				// в открытом пакете загрузка копится вместе с остальными правками
+				sheet.BeginBatch();
+				std::istringstream input("\t=A1\n");
+				sheet.LoadTexts(input);
+				assert(sheet.GetCell({ 0, 1 }) == nullptr);
+				sheet.Commit();
+				assert(sheet.GetCell({ 0, 1 })->GetText() == "=A1");
+			}
+
+			{
+				// крупный текст делится на куски по границам строк и разбирается на нескольких потоках
+				Sheet sheet;
+				for (int row = 0; row != 4000; ++row) {
+					const std::string r = std::to_string(row + 1);
+					sheet.SetCell({ row, 0 }, std::to_string(row));
+					sheet.SetCell({ row, 1 }, "text number " + r);
+					if (row % 7 != 0) {
+						sheet.SetCell({ row, 2 }, "=A" + r + "*2+" + (row ? "C" + std::to_string(row) : "0"));
+					}
+				}
+
+				std::ostringstream texts;
+				sheet.PrintTexts(texts);
+				std::ostringstream values;
+				sheet.PrintValues(values);
+
+				for (unsigned threads : { 1u, 4u }) {
+					Sheet loaded;
+					std::istringstream input(texts.str());
+					loaded.LoadTexts(input, threads);
+
+					std::ostringstream loaded_texts;
+					loaded.PrintTexts(loaded_texts);
+					assert(loaded_texts.str() == texts.str());
+					std::ostringstream loaded_values;
+					loaded.PrintValues(loaded_values);
+					assert(loaded_values.str() == values.str());
+				}
+			}
+
+			{
+				// поток длиннее порции чтения: строки на границах порций и строка длиннее порции не теряются
+				std::string texts = "head\t" + std::string(std::size_t(3) << 19, 'x') + "\n";
+				const std::string padding(64, '.');
+				for (int row = 1; row != 16000; ++row) {
+					texts += "row " + std::to_string(row) + padding + (row % 3 ? "\t=A1\n" : "\tx\n");
+				}
+				texts += "\ttail";
+
+				Sheet streamed;
+				std::istringstream input(texts);
+				streamed.LoadTexts(input);
+				assert(streamed.GetCell({ 0, 1 })->GetText().size() == std::size_t(3) << 19);
+				assert(streamed.GetCell({ 15999, 0 })->GetText() == "row 15999" + padding);
+				assert(streamed.GetCell({ 16000, 1 })->GetText() == "tail");
+
+				std::ostringstream streamed_texts;
+				streamed.PrintTexts(streamed_texts);
+				assert(streamed_texts.str() == texts + "\n");
+
+				// файл отображается в память и даёт тот же лист
+				const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_texts_test.txt").string();
+				{
+					std::ofstream file(path, std::ios::binary);
+					file << texts;
+				}
+				Sheet mapped;
+				mapped.LoadTexts(path);
+				std::remove(path.c_str());
+				assert(mapped.IsEqual(streamed));
+
+				try {
+					mapped.LoadTexts(path);
+					assert(false);
+				}
+				catch (const SheetError&) {
+				}
+			}
+		}
+
+	} // namespace value_tests
 
 	namespace final_tests {
 
@@ -348,12 +2239,706 @@ namespace unit_tests {
 	} //namespace final_tests
 
 
+	namespace benchmarks {
+
+		// печать значений большой смешанной таблицы
+		void PrintValuesBenchmark() {
+			Sheet sheet;
+			detail::FillMixedSheet(sheet, 2000, 100);
+
+			// первая печать вычисляет и кеширует формулы, замеряется только сам вывод
+			std::size_t bytes = 0;
+			{
+				std::ostringstream out;
+				sheet.PrintValues(out);
+				bytes = out.str().size();
+			}
+
+			double best = detail::MeasureBest(10, [&sheet]() {
+				std::ostringstream out;
+				sheet.PrintValues(out);
+			});
+
+			std::cerr << "PrintValuesBenchmark: 2000x100 mixed cells, " << bytes << " bytes, best " << best << " ms" << std::endl;
+		}
+
+		// вычисление формул, читающих числовой текст
+		void TextReferenceBenchmark() {
+			const int rows = 10000;
+			const int cols = 10;
+
+			Sheet sheet;
+			std::vector<std::unique_ptr<FormulaInterface>> formulas;
+			for (int row = 0; row != rows; ++row) {
+				std::string expression;
+				for (int col = 0; col != cols; ++col) {
+					sheet.SetCell({ row, col }, std::to_string(row) + "." + std::to_string(col));
+					expression += (col ? "+" : "") + Position(row, col).ToString();
+				}
+				formulas.push_back(ParseFormula(expression));
+			}
+
+			// формулы вычисляются без кеша ячеек, каждый проход заново читает все текстовые ячейки
+			double total = 0.0;
+			double best = detail::MeasureBest(10, [&]() {
+				for (const auto& formula : formulas) {
+					total += std::get<double>(formula->Evaluate(sheet));
+				}
+			});
+
+			std::cerr << "TextReferenceBenchmark: " << rows << " formulas x " << cols << " text refs, best " << best
+				<< " ms (checksum " << total << ")" << std::endl;
+		}
+
+		// вычисление арифметических выражений
+		void FormulaEvaluateBenchmark() {
+			const int rows = 16000;
+
+			Sheet sheet;
+			std::vector<std::unique_ptr<FormulaInterface>> formulas;
+			for (int row = 0; row != rows; ++row) {
+				for (int col = 0; col != 4; ++col) {
+					sheet.SetCell({ row, col }, std::to_string(row + col + 1));
+				}
+				std::string r = std::to_string(row + 1);
+				formulas.push_back(ParseFormula("(A" + r + "+B" + r + ")*(C" + r + "-D" + r + ")/(A" + r
+					+ "+1)-B" + r + "/3+-(C" + r + "*2.5)+(1+2)*(3-4)/5"));
+			}
+
+			double total = 0.0;
+			double best = detail::MeasureBest(10, [&]() {
+				for (const auto& formula : formulas) {
+					total += std::get<double>(formula->Evaluate(sheet));
+				}
+			});
+
+			std::cerr << "FormulaEvaluateBenchmark: " << rows << " formulas, 7 cell refs and 15 operations each, best " << best
+				<< " ms (checksum " << total << ")" << std::endl;
+		}
+
+		// вычисление формул, получающих ошибки
+		void ErrorPropagationBenchmark() {
+			const int rows = 16000;
+
+			// одна некорректная ячейка, на которую ссылаются все формулы, плюс деление на ноль
+			Sheet sheet;
+			sheet.SetCell({ 0, 0 }, "not a number");
+			std::vector<std::unique_ptr<FormulaInterface>> formulas;
+			for (int row = 0; row != rows; ++row) {
+				sheet.SetCell({ row, 1 }, std::to_string(row));
+				std::string r = std::to_string(row + 1);
+				formulas.push_back(ParseFormula("B" + r + "*2+A1"));
+				formulas.push_back(ParseFormula("B" + r + "/(B" + r + "-B" + r + ")"));
+				formulas.push_back(ParseFormula("(B" + r + "+1)*(A1-B" + r + ")"));
+			}
+
+			std::size_t errors = 0;
+			double best = detail::MeasureBest(10, [&]() {
+				for (const auto& formula : formulas) {
+					errors += std::holds_alternative<FormulaError>(formula->Evaluate(sheet));
+				}
+			});
+
+			std::cerr << "ErrorPropagationBenchmark: " << formulas.size() << " formulas with #VALUE! and #DIV/0!, best "
+				<< best << " ms (errors " << errors << ")" << std::endl;
+		}
+
+		// скорость разбора формул двумя парсерами
+		void ParseThroughputBenchmark() {
+			std::mt19937 random(2024);
+			std::vector<std::string> texts;
+			for (int i = 0; i != 20000; ++i) {
+				texts.push_back(detail::RandomExpression(random, 5));
+			}
+
+			std::size_t depends = 0;
+			double direct = detail::MeasureBest(5, [&]() {
+				for (const auto& text : texts) {
+					depends += ParseFormulaAST(text).HasDepends();
+				}
+			});
+			double reference = detail::MeasureBest(5, [&]() {
+				for (const auto& text : texts) {
+					depends += ParseFormulaASTReference(text).HasDepends();
+				}
+			});
+
+			std::cerr << "ParseThroughputBenchmark: " << texts.size() << " formulas, direct " << direct << " ms, ANTLR "
+				<< reference << " ms (with references " << depends << ")" << std::endl;
+		}
+
+		// загрузка листа с повторяющимися формулами
+		void SharedFormulaLoadBenchmark() {
+			const int rows = 16000;
+			const int cols = 8;
+
+			std::vector<std::string> texts;
+			for (int i = 0; i != 50; ++i) {
+				texts.push_back("=(A1+B" + std::to_string(i + 1) + ")*C1-D1/2");
+			}
+
+			double best = detail::MeasureBest(3, [&]() {
+				Sheet sheet;
+				for (int row = 0; row != rows; ++row) {
+					for (int col = 4; col != 4 + cols; ++col) {
+						sheet.SetCell({ row, col }, texts[(row + col) % texts.size()]);
+					}
+				}
+			});
+
+			std::cerr << "SharedFormulaLoadBenchmark: " << rows * cols << " formula cells, " << texts.size()
+				<< " distinct formulas, best " << best << " ms" << std::endl;
+		}
+
+		// заполнение столбцов однотипными формулами со сдвигом ссылок по строкам
+		void FillDownFormulaBenchmark() {
+			const int rows = 16000;
+			std::size_t formulas = 0;
+
+			double best = detail::MeasureBest(3, [&]() {
+				Sheet sheet;
+				for (int row = 0; row != rows; ++row) {
+					const std::string r = std::to_string(row + 1);
+					sheet.SetCell({ row, 3 }, "=B" + r + "*C" + r + "+A" + r);
+					sheet.SetCell({ row, 4 }, "=(D" + r + "-A" + r + ")/2");
+				}
+				formulas = sheet.GetFormulaPool().Size();
+			});
+
+			std::cerr << "FillDownFormulaBenchmark: " << rows * 2 << " formula cells, " << formulas
+				<< " distinct formulas, best " << best << " ms" << std::endl;
+		}
+
+		// загрузка формул, ссылающихся на одну ячейку-концентратор
+		void HubDependentsBenchmark() {
+			for (int dependents : { 25000, 50000, 100000, 200000 }) {
+				double best = detail::MeasureBest(3, [&]() {
+					Sheet sheet;
+					sheet.SetCell({ 0, 0 }, "1.5");
+					for (int i = 0; i != dependents; ++i) {
+						sheet.SetCell({ i % 16000 + 1, i / 16000 + 1 }, "=A1*2");
+					}
+				});
+
+				std::cerr << "HubDependentsBenchmark: " << dependents << " dependents of one cell, best "
+					<< best << " ms" << std::endl;
+			}
+		}
+
+		// ввод формул в модель-ромб, где к нижним ячейкам ведёт экспоненциально много путей
+		void DiamondModelBenchmark() {
+			for (int layers : { 20, 1000, 10000 }) {
+				double best = detail::MeasureBest(3, [&]() {
+					Sheet sheet;
+					sheet.SetCell({ 0, 0 }, "1");
+					sheet.SetCell({ 0, 1 }, "2");
+					for (int row = 1; row != layers; ++row) {
+						const std::string r = std::to_string(row);
+						sheet.SetCell({ row, 0 }, "=A" + r + "+B" + r);
+						sheet.SetCell({ row, 1 }, "=A" + r + "-B" + r);
+					}
+					// ссылка наверх с дна модели замкнула бы цикл
+					const std::string bottom = std::to_string(layers);
+					try {
+						sheet.SetCell({ 0, 0 }, "=A" + bottom + "+B" + bottom);
+					}
+					catch (const CircularDependencyException&) {
+					}
+				});
+
+				std::cerr << "DiamondModelBenchmark: " << layers << " layers, best " << best << " ms" << std::endl;
+			}
+		}
+
+		// правка начала посчитанной модели: сброс кешей всех зависимых
+		void InvalidationBenchmark() {
+			const int layers = 22;
+			const int chain = 16000;
+
+			Sheet sheet;
+			sheet.SetCell({ 0, 0 }, "1");
+			sheet.SetCell({ 0, 1 }, "2");
+			sheet.SetCell({ 0, 2 }, "1");
+			for (int row = 1; row != chain; ++row) {
+				const std::string r = std::to_string(row);
+				if (row < layers) {
+					sheet.SetCell({ row, 0 }, "=A" + r + "+B" + r);
+					sheet.SetCell({ row, 1 }, "=A" + r + "-B" + r);
+				}
+				sheet.SetCell({ row, 2 }, "=C" + r + "+1");
+			}
+
+			int edits = 0;
+			double best = detail::MeasureBest(20, [&]() {
+				// модель пересчитывается построчно, затем правится её начало
+				for (int row = 1; row != chain; ++row) {
+					sheet.GetCell({ row, 2 })->GetValue();
+					if (row < layers) {
+						sheet.GetCell({ row, 0 })->GetValue();
+						sheet.GetCell({ row, 1 })->GetValue();
+					}
+				}
+				sheet.SetCell({ 0, 0 }, std::to_string(++edits));
+				sheet.SetCell({ 0, 2 }, std::to_string(edits));
+			});
+
+			std::cerr << "InvalidationBenchmark: " << layers << "-layer diamond and " << chain
+				<< "-cell chain, recalculation and edit, best " << best << " ms" << std::endl;
+		}
+
+		// первое чтение конца длинной цепочки формул
+		void DeepChainBenchmark() {
+			const int length = 16000;
+
+			Sheet sheet;
+			sheet.SetCell({ 0, 0 }, "1");
+			for (int row = 1; row != length; ++row) {
+				sheet.SetCell({ row, 0 }, "=A" + std::to_string(row) + "+1");
+			}
+
+			int edits = 0;
+			double best = detail::MeasureBest(20, [&]() {
+				sheet.SetCell({ 0, 0 }, std::to_string(++edits));
+				sheet.GetCell({ length - 1, 0 })->GetValue();
+			});
+
+			std::cerr << "DeepChainBenchmark: " << length << "-cell chain, edit and read of the last cell, best "
+				<< best << " ms" << std::endl;
+		}
+
+		// полный пересчёт широкой модели на разном количестве потоков
+		void RecalculateBenchmark() {
+			const int rows = 16000;
+			const int columns = 24;
+
+			Sheet sheet;
+			for (int row = 0; row != rows; ++row) {
+				sheet.SetCell({ row, 0 }, std::to_string(row % 101));
+			}
+			for (int col = 1; col != columns; ++col) {
+				const std::string prev = Position(0, col - 1).ToString();
+				const std::string letter = prev.substr(0, prev.size() - 1);
+				for (int row = 0; row != rows; ++row) {
+					const std::string r = std::to_string(row + 1);
+					const std::string below = std::to_string((row + 1) % rows + 1);
+					sheet.SetCell({ row, col }, "=(" + letter + r + "*1.0001+" + letter + below + ")/2-A1*" + letter + r);
+				}
+			}
+
+			const unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+			double single = 0.0;
+			int edits = 0;
+			for (unsigned threads = 1; threads <= std::max(cores, 4u); threads *= 2) {
+				double best = detail::MeasureBest(5, [&]() {
+					// правка A1 сбрасывает кеш всех формул модели
+					sheet.SetCell({ 0, 0 }, std::to_string(++edits));
+					sheet.Recalculate(threads);
+				});
+				if (threads == 1) {
+					single = best;
+				}
+
+				std::cerr << "RecalculateBenchmark: " << rows * (columns - 1) << " formulas in " << columns - 1
+					<< " levels, " << threads << " threads, best " << best << " ms, speedup " << single / best << std::endl;
+			}
+		}
+
+		// загрузка листа по одной ячейке и одним пакетом
+		void BatchLoadBenchmark() {
+			const int rows = 16384;
+			const int columns = 32;
+
+			// чётные столбцы - числа, нечётные - формулы со ссылками на соседей слева и справа
+			std::vector<Sheet::CellUpdate> updates;
+			for (int row = 0; row != rows; ++row) {
+				const std::string r = std::to_string(row + 1);
+				for (int col = 0; col != columns; ++col) {
+					if (col % 2 == 0) {
+						updates.push_back({ { row, col }, std::to_string(row * col % 977) });
+					}
+					else {
+						const std::string left = Position(0, col - 1).ToString();
+						const std::string right = Position(0, col + 1).ToString();
+						updates.push_back({ { row, col }, "=" + left.substr(0, left.size() - 1) + r + "*2+"
+							+ right.substr(0, right.size() - 1) + r });
+					}
+				}
+			}
+
+			double single = detail::MeasureBest(3, [&]() {
+				Sheet sheet;
+				for (const auto& [pos, text] : updates) {
+					sheet.SetCell(pos, text);
+				}
+			});
+			double batch = detail::MeasureBest(3, [&]() {
+				Sheet sheet;
+				sheet.SetCells(updates);
+			});
+
+			std::cerr << "BatchLoadBenchmark: " << updates.size() << " cells, SetCell best " << single
+				<< " ms, SetCells best " << batch << " ms" << std::endl;
+		}
+
+		// импорт, в котором формулы приходят раньше своих входных ячеек
+		void ForwardReferenceBenchmark() {
+			const int rows = 16384;
+			const int columns = 8;
+
+			double best = detail::MeasureBest(3, [&]() {
+				Sheet sheet;
+				// сначала формулы, ссылающиеся на ещё пустой столбец A и соседей справа
+				for (int row = 0; row != rows; ++row) {
+					const std::string r = std::to_string(row + 1);
+					for (int col = 1; col != columns; ++col) {
+						const std::string next = Position(0, col + 1).ToString();
+						sheet.SetCell({ row, col }, "=A" + r + "+" + next.substr(0, next.size() - 1) + r);
+					}
+				}
+				// затем входные данные
+				for (int row = 0; row != rows; ++row) {
+					sheet.SetCell({ row, 0 }, std::to_string(row));
+				}
+				for (int row = 0; row != rows; ++row) {
+					sheet.GetCell({ row, 1 })->GetValue();
+				}
+			});
+
+			std::cerr << "ForwardReferenceBenchmark: " << rows * columns << " cells, formulas before inputs, best "
+				<< best << " ms" << std::endl;
+		}
+
+		// удаление ячеек с края большого листа, после каждого из них запрашивается область печати
+		void PrintableAreaBenchmark() {
+			const int rows = 16384;
+			const int columns = 16;
+
+			Sheet sheet;
+			for (int row = 0; row != rows; ++row) {
+				for (int col = 0; col != columns; ++col) {
+					sheet.SetCell({ row, col }, "1");
+				}
+			}
+
+			// снимаем по ячейке с нижнего края и спрашиваем область печати после каждого удаления
+			const int erased = 4096;
+			Size size;
+			double best = detail::MeasureBest(3, [&]() {
+				for (int i = 0; i != erased; ++i) {
+					const Position pos = { rows - 1 - i / columns, columns - 1 - i % columns };
+					sheet.ClearCell(pos);
+					size = sheet.GetPrintableSize();
+				}
+				for (int i = 0; i != erased; ++i) {
+					sheet.SetCell({ rows - 1 - i / columns, columns - 1 - i % columns }, "1");
+				}
+			});
+
+			std::cerr << "PrintableAreaBenchmark: " << erased << " edge erases on " << rows * columns
+				<< " cells (last area " << size.rows << "x" << size.cols << "), best " << best << " ms" << std::endl;
+		}
+
+		// выгрузка большого листа в поток и в файловый дескриптор
+		void ExportBenchmark() {
+			Sheet sheet;
+			detail::FillMixedSheet(sheet, 16384, 64);
+
+			// формулы вычисляются до замеров, сравнивается только вывод
+			std::size_t bytes = 0;
+			{
+				std::ostringstream out;
+				sheet.PrintValues(out);
+				bytes = out.str().size();
+			}
+
+			double stream = detail::MeasureBest(3, [&sheet]() {
+				std::ostringstream out;
+				sheet.PrintValues(out);
+			});
+
+			std::cerr << "ExportBenchmark: 16384x64 mixed cells, " << bytes << " bytes, ostream best " << stream << " ms";
+
+#if !defined(_MSC_VER)
+			if (std::FILE* file = std::tmpfile()) {
+				double direct = detail::MeasureBest(3, [&]() {
+					std::rewind(file);
+					OutputBuffer buffer(fileno(file), std::size_t(1) << 20);
+					sheet.PrintValues(buffer);
+					buffer.Flush();
+				});
+				std::cerr << ", file descriptor best " << direct << " ms";
+
+				// полосы строк на всех ядрах
+				const unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+				double bands = detail::MeasureBest(3, [&]() {
+					std::rewind(file);
+					OutputBuffer buffer(fileno(file), std::size_t(1) << 20);
+					sheet.PrintValues(buffer, threads);
+					buffer.Flush();
+				});
+				std::fclose(file);
+				std::cerr << ", " << threads << " threads best " << bands << " ms";
+			}
+#endif
+			std::cerr << std::endl;
+		}
+
+		// загрузка вывода PrintTexts одним вызовом и тех же ячеек по одной
+		void LoadTextsBenchmark() {
+			std::string texts;
+			std::vector<Sheet::CellUpdate> cells;
+			{
+				Sheet sheet;
+				detail::FillMixedSheet(sheet, 16384, 32);
+				std::ostringstream out;
+				sheet.PrintTexts(out);
+				texts = out.str();
+				sheet.ForEachInRange({ Position(0, 0), sheet.GetPrintableSize() }, [&cells](Position pos, const Cell& cell) {
+					cells.push_back({ pos, cell.GetText() });
+				});
+			}
+
+			double single = detail::MeasureBest(3, [&]() {
+				Sheet sheet;
+				for (const auto& [pos, text] : cells) {
+					sheet.SetCell(pos, text);
+				}
+			});
+
+			double loaded = detail::MeasureBest(3, [&]() {
+				Sheet sheet;
+				std::istringstream input(texts);
+				sheet.LoadTexts(input);
+			});
+
+			std::cerr << "LoadTextsBenchmark: " << cells.size() << " cells, " << texts.size() << " bytes, SetCell best "
+				<< single << " ms, LoadTexts best " << loaded << " ms" << std::endl;
+		}
+
+		// загрузка листа из двоичного снимка и из текста PrintTexts
+		void SnapshotBenchmark() {
+			const std::string path = (std::filesystem::temp_directory_path() / "spreadsheet_snapshot_bench.bin").string();
+
+			std::string texts;
+			std::size_t cells = 0;
+			{
+				Sheet sheet;
+				detail::FillMixedSheet(sheet, 16384, 32);
+				std::ostringstream out;
+				sheet.PrintValues(out);
+				std::ostringstream text_out;
+				sheet.PrintTexts(text_out);
+				texts = text_out.str();
+				cells = sheet.GetPrintableSize().rows * static_cast<std::size_t>(sheet.GetPrintableSize().cols);
+
+				double save = detail::MeasureBest(3, [&]() {
+					sheet.SaveSnapshot(path);
+				});
+				std::cerr << "SnapshotBenchmark: " << cells << " cells, save best " << save << " ms";
+			}
+
+			double text = detail::MeasureBest(3, [&]() {
+				Sheet sheet;
+				std::istringstream input(texts);
+				sheet.LoadTexts(input);
+			});
+
+			double snapshot = detail::MeasureBest(3, [&]() {
+				Sheet sheet;
+				sheet.LoadSnapshot(path);
+			});
+
+			std::cerr << ", LoadTexts best " << text << " ms, LoadSnapshot best " << snapshot << " ms" << std::endl;
+			std::remove(path.c_str());
+		}
+
+		// копирование листа, первая правка копии и обмен листов
+		void SheetCopyBenchmark() {
+			Sheet sheet;
+			detail::FillMixedSheet(sheet, 16384, 32);
+			sheet.Recalculate(1);
+
+			double copy = detail::MeasureBest(5, [&]() {
+				Sheet forked(sheet);
+			});
+
+			// правка копии копирует один блок и сбрасывает кеши зависимых в копиях их блоков
+			double edit = detail::MeasureBest(5, [&]() {
+				Sheet forked(sheet);
+				forked.SetCell({ 8000, 0 }, "1");
+				forked.GetCell({ 8000, 31 })->GetValue();
+			});
+
+			Sheet other;
+			other.SetCell({ 0, 0 }, "1");
+			double swap = detail::MeasureBest(5, [&]() {
+				sheet.SwapSheet(other);
+			});
+
+			std::cerr << "SheetCopyBenchmark: " << sheet.GetPrintableSize().rows * 32 << " cells, copy best " << copy
+				<< " ms, copy and edit best " << edit << " ms, swap best " << swap << " ms" << std::endl;
+		}
+
+		// задержка чтения опубликованной версии без писателя и во время потока правок с публикациями
+		void ReadLatencyBenchmark() {
+			const int rows = 16384;
+			const int cols = 32;
+			const int readers_count = 3;
+			const int bursts = 50;
+
+			Sheet sheet;
+			detail::FillMixedSheet(sheet, rows, cols);
+			sheet.Publish();
+
+			// читатель раз в 100 мкс берёт версию и читает строку ячеек, задержки копятся в микросекундах
+			auto run_readers = [&](std::atomic<bool>& done, std::vector<std::vector<double>>& latencies) {
+				latencies.assign(readers_count, {});
+				std::vector<std::thread> readers;
+				for (int i = 0; i != readers_count; ++i) {
+					readers.emplace_back([&, i]() {
+						std::mt19937 random(i);
+						while (!done.load()) {
+							auto start = std::chrono::steady_clock::now();
+							auto version = sheet.Snapshot();
+							const int row = static_cast<int>(random() % rows);
+							for (int col = 0; col != cols; ++col) {
+								version->GetCell({ row, col })->GetValue();
+							}
+							std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+							latencies[i].push_back(elapsed.count());
+							std::this_thread::sleep_for(std::chrono::microseconds(100));
+						}
+					});
+				}
+				return readers;
+			};
+			auto report = [](std::vector<std::vector<double>>& latencies) {
+				std::vector<double> all;
+				for (auto& part : latencies) {
+					all.insert(all.end(), part.begin(), part.end());
+				}
+				std::sort(all.begin(), all.end());
+				std::ostringstream out;
+				out << "p50 " << all[all.size() / 2] << " us, p99 " << all[all.size() * 99 / 100] << " us, max " << all.back() << " us";
+				return out.str();
+			};
+
+			std::string idle;
+			{
+				std::atomic<bool> done = false;
+				std::vector<std::vector<double>> latencies;
+				auto readers = run_readers(done, latencies);
+				std::this_thread::sleep_for(std::chrono::milliseconds(300));
+				done = true;
+				for (auto& reader : readers) {
+					reader.join();
+				}
+				idle = report(latencies);
+			}
+
+			// писатель заменяет 64 случайных текста числами, сбрасывая кеш формулы справа от каждого,
+			// и публикует версию после каждой серии
+			std::string busy;
+			double burst = 0;
+			{
+				std::atomic<bool> done = false;
+				std::vector<std::vector<double>> latencies;
+				auto readers = run_readers(done, latencies);
+				std::mt19937 random(42);
+				burst = detail::MeasureBest(1, [&]() {
+					for (int step = 0; step != bursts; ++step) {
+						for (int i = 0; i != 64; ++i) {
+							const int row = static_cast<int>(random() % rows);
+							sheet.SetCell({ row, (5 - row % 4) % 4 }, std::to_string(random() % 1000));
+						}
+						sheet.Publish();
+					}
+				}) / bursts;
+				done = true;
+				for (auto& reader : readers) {
+					reader.join();
+				}
+				busy = report(latencies);
+			}
+
+			std::cerr << "ReadLatencyBenchmark: " << rows * cols << " cells, " << readers_count << " readers, idle " << idle
+				<< "; during writes " << busy << ", writer " << burst << " ms per 64 edits and publish" << std::endl;
+		}
+
+		// сравнение листа с его правленой копией: хеши против поячеечного сравнения текстов
+		void ContentHashBenchmark() {
+			const int rows = 16384;
+			const int cols = 32;
+
+			Sheet sheet;
+			detail::FillMixedSheet(sheet, rows, cols);
+			double first = detail::MeasureBest(1, [&]() {
+				sheet.GetContentHash();
+			});
+
+			Sheet copy(sheet);
+			std::mt19937 random(7);
+			double edit = detail::MeasureBest(1, [&]() {
+				for (int i = 0; i != 64; ++i) {
+					copy.SetCell({ static_cast<int>(random() % rows), 0 }, std::to_string(random() % 1000 + 1000));
+				}
+				copy.GetContentHash();
+			});
+
+			// прежний способ: обход всех ячеек с поиском пары и сравнением текстов
+			std::size_t cell_diff = 0;
+			double cells = detail::MeasureBest(3, [&]() {
+				cell_diff = 0;
+				sheet.ForEachInRange({ Position(0, 0), sheet.GetPrintableSize() }, [&](Position pos, const Cell& cell) {
+					cell_diff += !cell.IsEqual(copy.GetDirectCell(pos));
+				});
+			});
+
+			bool equal = true;
+			double is_equal = detail::MeasureBest(3, [&]() {
+				equal = sheet.IsEqual(copy);
+			});
+			std::vector<Position> diff;
+			double diff_time = detail::MeasureBest(3, [&]() {
+				diff = sheet.Diff(copy);
+			});
+			assert(!equal && diff.size() == cell_diff);
+
+			std::cerr << "ContentHashBenchmark: " << rows * cols << " cells, first hash " << first << " ms, 64 edits and rehash "
+				<< edit << " ms; IsEqual best " << is_equal << " ms, Diff best " << diff_time << " ms (" << diff.size()
+				<< " cells), cell by cell best " << cells << " ms" << std::endl;
+		}
+
+	} // namespace benchmarks
+
 	void RunAllTests() {
 
 		TestRunner tr;
 
 		// блок тестов работоспособности позиции
 		tr.RunTest(position_tests::PositionCompleteTests, "PositionCompleteTests");
+		tr.RunTest(storage_tests::SheetStorageBlocksTest, "SheetStorageBlocksTest");
+		tr.RunTest(storage_tests::SheetRangeVisitTest, "SheetRangeVisitTest");
+		tr.RunTest(storage_tests::SlabArenaTest, "SlabArenaTest");
+		tr.RunTest(storage_tests::PrintableAreaTest, "PrintableAreaTest");
+		tr.RunTest(storage_tests::SnapshotTest, "SnapshotTest");
+		tr.RunTest(storage_tests::CopyOnWriteTest, "CopyOnWriteTest");
+		tr.RunTest(storage_tests::PublishedVersionTest, "PublishedVersionTest");
+		tr.RunTest(storage_tests::ContentHashTest, "ContentHashTest");
+		tr.RunTest(value_tests::TextNumberParseTest, "TextNumberParseTest");
+		tr.RunTest(value_tests::FormulaProgramTest, "FormulaProgramTest");
+		tr.RunTest(value_tests::FormulaPoolTest, "FormulaPoolTest");
+		tr.RunTest(value_tests::OutputBufferTest, "OutputBufferTest");
+		tr.RunTest(value_tests::ParallelPrintTest, "ParallelPrintTest");
+		tr.RunTest(value_tests::LoadTextsTest, "LoadTextsTest");
+		tr.RunTest(parser_tests::ParserDifferentialTest, "ParserDifferentialTest");
+		tr.RunTest(graph_tests::DependencyGraphTest, "DependencyGraphTest");
+		tr.RunTest(graph_tests::TopologicalOrderTest, "TopologicalOrderTest");
+		tr.RunTest(graph_tests::CacheInvalidationTest, "CacheInvalidationTest");
+		tr.RunTest(graph_tests::DeepChainEvaluationTest, "DeepChainEvaluationTest");
+		tr.RunTest(graph_tests::ParallelRecalculationTest, "ParallelRecalculationTest");
+		tr.RunTest(graph_tests::BatchSetCellsTest, "BatchSetCellsTest");
+		tr.RunTest(graph_tests::PendingReferencesTest, "PendingReferencesTest");
 		tr.RunTest(final_tests::SheetPrintRangeTest, "SheetPrintRangeTest");
 		tr.RunTest(final_tests::SheetPrintValuesTest, "SheetPrintValuesTest");
 		tr.RunTest(final_tests::SheetPrintTextesTest, "SheetPrintTextesTest");
@@ -361,4 +2946,28 @@ namespace unit_tests {
 		tr.RunTest(final_tests::CyclicDependenceTest, "CyclicDependenceTest");
 	}
 
+	void RunAllBenchmarks() {
+		benchmarks::PrintValuesBenchmark();
+		benchmarks::TextReferenceBenchmark();
+		benchmarks::FormulaEvaluateBenchmark();
+		benchmarks::ErrorPropagationBenchmark();
+		benchmarks::ParseThroughputBenchmark();
+		benchmarks::SharedFormulaLoadBenchmark();
+		benchmarks::FillDownFormulaBenchmark();
+		benchmarks::HubDependentsBenchmark();
+		benchmarks::DiamondModelBenchmark();
+		benchmarks::InvalidationBenchmark();
+		benchmarks::DeepChainBenchmark();
+		benchmarks::RecalculateBenchmark();
+		benchmarks::BatchLoadBenchmark();
+		benchmarks::ForwardReferenceBenchmark();
+		benchmarks::PrintableAreaBenchmark();
+		benchmarks::ExportBenchmark();
+		benchmarks::LoadTextsBenchmark();
+		benchmarks::SnapshotBenchmark();
+		benchmarks::SheetCopyBenchmark();
+		benchmarks::ReadLatencyBenchmark();
+		benchmarks::ContentHashBenchmark();
+	}
+
 } // namespace unit_tests
\ No newline at end of file
@@ -32,12 +32,81 @@ namespace unit_tests {
 	} //namespace final_tests
 
 
+	namespace storage_tests {
+
+		void SheetStorageBlocksTest();                                  // размещение ячеек по блокам хранилища
+		void SheetRangeVisitTest();                                     // обход заполненных ячеек диапазона
+		void SlabArenaTest();                                           // переиспользование памяти слэб-арены
+		void PrintableAreaTest();                                       // границы печатной области при вставке и удалении
+		void SnapshotTest();                                            // сохранение и загрузка двоичного снимка листа
+		void CopyOnWriteTest();                                         // копии листа делят блоки до первой правки
+		void PublishedVersionTest();                                    // чтение опубликованных версий листа во время правок
+		void ContentHashTest();                                         // равенство листов по хешам и список различий
+
+	} // namespace storage_tests
+
+	namespace value_tests {
+
+		void TextNumberParseTest();                                     // разбор числа из текста ячейки для формул
+		void FormulaProgramTest();                                      // вычисление формул на стековой машине
+		void FormulaPoolTest();                                         // разделение одинаковых формул между ячейками
+		void OutputBufferTest();                                        // буферизованный вывод совпадает с выводом в поток
+		void ParallelPrintTest();                                       // печать полосами строк совпадает с последовательной
+		void LoadTextsTest();                                           // загрузка листа из вывода PrintTexts
+
+	} // namespace value_tests
+
+	namespace parser_tests {
+
+		void ParserDifferentialTest();                                  // сверка рукописного парсера с ANTLR
+
+	} // namespace parser_tests
+
+	namespace graph_tests {
+
+		void DependencyGraphTest();                                     // хранение связей ячеек в графе зависимостей листа
+		void TopologicalOrderTest();                                    // топологический порядок и отказ от циклов
+		void CacheInvalidationTest();                                   // сброс кешей зависимых формул после правки
+		void DeepChainEvaluationTest();                                 // вычисление глубоких цепочек без роста стека
+		void ParallelRecalculationTest();                               // пересчёт по уровням на нескольких потоках
+		void BatchSetCellsTest();                                       // пакетная запись ячеек и её откат
+		void PendingReferencesTest();                                   // ссылки на ещё не созданные ячейки
+
+	} // namespace graph_tests
+
 	namespace position_tests {
 
 		void PositionCompleteTests();                                   // запуск всех тестов структуры позиции
 
 	} // namespace position_tests 
 
+	namespace benchmarks {
+
+		void PrintValuesBenchmark();                                    // печать значений большой смешанной таблицы
+		void TextReferenceBenchmark();                                  // вычисление формул, читающих числовой текст
+		void FormulaEvaluateBenchmark();                                // вычисление арифметических выражений
+		void ErrorPropagationBenchmark();                               // вычисление формул, получающих ошибки
+		void ParseThroughputBenchmark();                                // скорость разбора формул двумя парсерами
+		void SharedFormulaLoadBenchmark();                              // загрузка листа с повторяющимися формулами
+		void FillDownFormulaBenchmark();                                // заполнение столбцов формулами со сдвигом ссылок
+		void HubDependentsBenchmark();                                  // загрузка формул, ссылающихся на одну ячейку
+		void DiamondModelBenchmark();                                   // ввод формул в модель-ромб с проверкой циклов
+		void InvalidationBenchmark();                                   // сброс кешей после правки посчитанной модели
+		void DeepChainBenchmark();                                      // первое чтение конца длинной цепочки
+		void RecalculateBenchmark();                                    // пересчёт широкой модели на 1..N потоках
+		void BatchLoadBenchmark();                                      // загрузка листа по одной ячейке и пакетом
+		void ForwardReferenceBenchmark();                               // загрузка формул раньше их входных ячеек
+		void PrintableAreaBenchmark();                                  // удаление крайних ячеек с запросом области печати
+		void ExportBenchmark();                                         // выгрузка большого листа в поток, в файл и полосами
+		void LoadTextsBenchmark();                                      // загрузка вывода PrintTexts и поячеечный ввод
+		void SnapshotBenchmark();                                       // загрузка листа из снимка и из текста
+		void SheetCopyBenchmark();                                      // копирование листа и первая правка копии
+		void ReadLatencyBenchmark();                                    // задержка чтения версий листа во время правок
+		void ContentHashBenchmark();                                    // сравнение листа с копией по хешам и по ячейкам
+
+	} // namespace benchmarks
+
 	void RunAllTests();
+	void RunAllBenchmarks();
 
 } // namespace unit_tests
\ No newline at end of file
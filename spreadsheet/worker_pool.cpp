@@ -0,0 +1,119 @@
+﻿#include "worker_pool.h"
+
+#include <algorithm>
+
+// ----------------------------------- class WorkerPool --------------------------------------------------
+
+WorkerPool::WorkerPool(unsigned threads) {
+    // вызывающий поток тоже выполняет задания, отдельных потоков нужно на один меньше
+    for (unsigned i = 1; i < threads; ++i) {
+        _threads.emplace_back(&WorkerPool::WorkerLoop, this);
+    }
+}
+
+WorkerPool::~WorkerPool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_all();
+
+    for (std::thread& thread : _threads) {
+        thread.join();
+    }
+}
+
+// количество потоков вместе с вызывающим
+unsigned WorkerPool::Size() const {
+    return static_cast<unsigned>(_threads.size()) + 1;
+}
+
+// выполнить task(i) для i из [0, count)
+void WorkerPool::Run(std::size_t count, const std::function<void(std::size_t)>& task) {
+    if (count == 0) {
+        return;
+    }
+
+    if (_threads.empty() || count == 1) {
+        // будить рабочих незачем
+        for (std::size_t i = 0; i != count; ++i) {
+            task(i);
+        }
+        return;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _task = &task;
+        _count = count;
+        // по несколько порций на поток: счётчик не становится узким местом, а неравные по стоимости
+        // элементы всё ещё распределяются между потоками
+        _chunk = std::max<std::size_t>(1, count / (Size() * 8));
+        _next.store(0, std::memory_order_relaxed);
+        _active = _threads.size();
+        _error = nullptr;
+        ++_generation;
+    }
+    _wake.notify_all();
+
+    Drain();
+
+    std::exception_ptr error;
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _done.wait(lock, [this] { return _active == 0; });
+        _task = nullptr;
+        error = _error;
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// цикл рабочего потока
+void WorkerPool::WorkerLoop() {
+    std::uint64_t seen = 0;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _wake.wait(lock, [this, seen] { return _stop || _generation != seen; });
+            if (_stop) {
+                return;
+            }
+            seen = _generation;
+        }
+
+        Drain();
+
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (--_active == 0) {
+            _done.notify_one();
+        }
+    }
+}
+
+// разбирать порции до конца задания
+void WorkerPool::Drain() {
+    // параметры задания меняются только под мьютексом между заданиями, пока идёт разбор они постоянны
+    const std::function<void(std::size_t)>& task = *_task;
+    const std::size_t count = _count;
+    const std::size_t chunk = _chunk;
+
+    for (std::size_t begin = _next.fetch_add(chunk, std::memory_order_relaxed); begin < count;
+         begin = _next.fetch_add(chunk, std::memory_order_relaxed)) {
+        const std::size_t end = std::min(count, begin + chunk);
+        try {
+            for (std::size_t i = begin; i != end; ++i) {
+                task(i);
+            }
+        }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(_mutex);
+            if (!_error) {
+                _error = std::current_exception();
+            }
+        }
+    }
+}
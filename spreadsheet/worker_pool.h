@@ -0,0 +1,47 @@
+﻿#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Пул рабочих потоков для параллельной обработки независимых элементов.
+// Run() раздаёт номера элементов порциями через атомарный счётчик, вызывающий поток работает наравне
+// с рабочими. Возврат из Run() происходит после завершения всех элементов под мьютексом пула, поэтому
+// всё записанное задачами видно вызывающему потоку и следующему вызову Run() без дополнительной синхронизации
+class WorkerPool {
+public:
+    explicit WorkerPool(unsigned threads);                                            // всего потоков вместе с вызывающим
+    ~WorkerPool();
+
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+
+    unsigned Size() const;                                                            // количество потоков вместе с вызывающим
+
+    // выполнить task(i) для i из [0, count). Первое исключение задачи пробрасывается после завершения остальных
+    void Run(std::size_t count, const std::function<void(std::size_t)>& task);
+
+private:
+    std::vector<std::thread> _threads;                                                // рабочие потоки
+    std::mutex _mutex;                                                                // защищает состояние текущего задания
+    std::condition_variable _wake;                                                    // новое задание либо остановка
+    std::condition_variable _done;                                                    // рабочие завершили задание
+
+    const std::function<void(std::size_t)>* _task = nullptr;                          // текущее задание
+    std::size_t _count = 0;                                                           // количество элементов задания
+    std::size_t _chunk = 1;                                                           // элементов в одной порции
+    std::atomic<std::size_t> _next{ 0 };                                              // первый неразданный элемент
+    std::size_t _active = 0;                                                          // рабочих, не закончивших задание
+    std::uint64_t _generation = 0;                                                    // номер текущего задания
+    std::exception_ptr _error;                                                        // первое исключение задания
+    bool _stop = false;                                                               // флаг остановки пула
+
+    void WorkerLoop();                                                                // цикл рабочего потока
+    void Drain();                                                                     // разбирать порции до конца задания
+};